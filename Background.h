@@ -1,119 +1,701 @@
 #pragma once
 
 #include "Logger.h"
+#include "Source.h"
+#include "Stats.h"
+#include "Dirty.h"
+#include "Journal.h"
+#include "PushLog.h"
+#include "IoScheduler.h"
+#include "DirtyBudget.h"
 
+#include <sys/stat.h>
 #include <thread>
 #include <condition_variable>
-#include <iostream>
 #include <mutex>
 #include <deque>
+#include <vector>
+#include <memory>
+#include <limits>
+#include <algorithm>
+#include <functional>
+#include <initializer_list>
 
 #include <boost/filesystem.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
 
+// Pushes released files back to the source on a pool of workers.
+//
+// Every path is in the queue or in flight at most once: syncing a path that is already
+// queued is a no-op, syncing one that is being pushed marks it so it is queued again
+// once the current push completes. That coalesces repeated releases into a single push and
+// guarantees the same file is never pushed by two workers at once.
+//
+// Metadata operations are ordered against pushes only by path: 'waitFor' blocks until
+// nothing at or under the given paths is queued or in flight, woken by push completions.
+//
+// Writes are tracked as dirty extents per path, so a file that still matches its baseline
+// on the source is patched in place with just the changed ranges instead of copied whole.
+// With a write-back journal a push waits for the journal entries of its path to be replayed.
+//
+// 'fsync' waits until the changes made to a file so far are pushed and the source file is
+// synced. Changes are counted per path, a push covers everything counted when it started,
+// so all fsyncs waiting for a path are satisfied by one push and one remote fsync.
+//
+// Bytes written but not pushed yet count against a DirtyBudget, writers are throttled and
+// their files pushed before being released once it fills up. A writer held at the limit
+// gets every file holding the budget pushed, oldest first. A failed push keeps its changes
+// and their share of the budget, they go with the next push of the file.
+//
+// Paths with unpushed changes are kept in a push log in the cache, pushes still pending
+// when cachefs stopped are queued again by 'start' (whole files, the extents are lost).
+// No worker runs before 'start', which is called once mounted: fuse may fork to daemonize.
 class BackgroundSync
 {
+    enum State { Queued, Pushing, Again };
+
 public:
-    BackgroundSync(const boost::filesystem::path& remote, const boost::filesystem::path& local)
-        : running_(true)
-        , started_(false)
-        , remote_(remote)
+    BackgroundSync(const Source::Ptr& remote, const boost::filesystem::path& local, std::size_t workers, Journal* journal,
+                   const DirtyBudget::Limit& dirtyLimit)
+        : remote_(remote)
         , local_(local)
+        , workers_(workers ? workers : 1)
+        , journal_(journal)
+        , running_(true)
+        , started_(false)
+        , inFlight_(0)
+        , coalesced_(0)
+        , fsyncs_(0)
+        , charges_(0)
+        , budget_(dirtyLimit)
+        , log_(local / ".cachefs")
     {
     }
 
     ~BackgroundSync()
     {
-        running_ = false;
+        budget_.stop();
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            running_ = false;
+        }
         cond_.notify_all();
-        if (worker_.joinable())
-            worker_.join();
+        done_.notify_all();
+        for (auto& t : threads_)
+            t.join();
     }
 
+    // resumes the pushes from the push log, workers are started with the first push
     void start()
     {
+        std::unique_lock<std::mutex> lock(lock_);
         if (started_)
             return;
-
         started_ = true;
-        worker_ = std::thread(std::bind(&BackgroundSync::worker, this));
+
+        for (const auto& path : log_.dirty())
+        {
+            struct stat st;
+            if (::lstat((local_ / path).c_str(), &st) == 0 && S_ISREG(st.st_mode))
+            {
+                queue(path.c_str());
+            }
+            else
+            {
+                log_.clean(path);
+            }
+        }
+
+        if (!queue_.empty())
+            spawn();
     }
 
+    // waits until nothing is queued or in flight
     void flush()
     {
-        start();
+        std::unique_lock<std::mutex> lock(lock_);
+        while (!states_.empty() && running_)
+            done_.wait(lock);
+    }
 
-        while (true)
+    // waits until no push of the paths or anything under them is queued or in flight
+    void waitFor(std::initializer_list<const char*> paths)
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        while (running_)
         {
-            {
-                std::unique_lock<std::mutex> lock(lock_);
-                if (queue_.empty() || !running_)
-                    break;
-            }
-            std::this_thread::sleep_for(std::chrono::microseconds(1));
+            bool pending = false;
+            for (const auto path : paths)
+                pending = pending || pending_.count(path);
+
+            if (!pending)
+                break;
+
+            done_.wait(lock);
         }
     }
 
     void sync(const char* path)
     {
-        start();
+        std::unique_lock<std::mutex> lock(lock_);
 
+        // typically the release after an fsync, which pushed everything already
+        const auto it = progress_.find(path);
+        if (it != progress_.end() && it->second->pushed_ >= it->second->written_ && !it->second->waiters_ && !states_.count(path))
+        {
+            progress_.erase(it);
+            ++coalesced_;
+            return;
+        }
+
+        queue(path);
+    }
+
+    // waits until the changes made to the file so far are on the source and synced there
+    int fsync(const char* path, bool data)
+    {
         std::unique_lock<std::mutex> lock(lock_);
-        queue_.emplace_back(path);
-        cond_.notify_all();
+
+        auto it = progress_.find(path);
+        if (it == progress_.end())
+        {
+            // not changed since it was last pushed (or since startup)
+            if (!states_.count(path))
+                return 0;
+
+            // queued without its changes being counted, from the push log
+            it = progress_.emplace(path, std::make_shared<Progress>()).first;
+            ++it->second->written_;
+        }
+
+        // shared with the map, which may drop or move it to another path while this waits
+        const auto progress = it->second;
+        const auto target = progress->written_;
+        if (progress->durable_ >= target)
+            return 0;
+
+        // an earlier failure does not count, this one gets a push of its own
+        if (progress->failed_ >= target)
+            progress->failed_ = 0;
+
+        progress->metadata_ = progress->metadata_ || !data;
+        ++progress->waiters_;
+        queue(path);
+
+        while (running_ && progress->durable_ < target && progress->failed_ < target)
+            done_.wait(lock);
+
+        --progress->waiters_;
+        if (progress->durable_ >= target)
+            return 0;
+        return progress->failed_ >= target ? progress->error_ : -EIO;
+    }
+
+    // records a modified range of the cached file, 'size' may be 0 for size-only changes
+    void write(const char* path, off_t offset, off_t size)
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        log_.dirty(path);
+        charge(path, dirty_[path].write(offset, size));
+        ++tracked(path).written_;
+    }
+
+    // hands over changes collected by a file handle, 'charged' bytes of which were reserved
+    void write(const char* path, const Dirty& changes, off_t charged)
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        log_.dirty(path);
+        charge(path, dirty_[path].merge(changes));
+        budget_.release(charged, 0);
+        ++tracked(path).written_;
+    }
+
+    // counts bytes written but not handed over yet against the dirty budget
+    void reserve(off_t bytes)
+    {
+        budget_.charge(bytes, 0);
+    }
+
+    bool pressure() const
+    {
+        return budget_.pressure();
+    }
+
+    // limits may be changed at any time
+    DirtyBudget& budget()
+    {
+        return budget_;
+    }
+
+    // backpressure for a writer of 'path', once the dirty budget fills up; 'full' is called
+    // while the writer waits at the limit, before the files holding the budget are queued
+    void throttle(const char* path, const std::function<void()>& full = std::function<void()>())
+    {
+        if (!budget_.pressure())
+            return;
+
+        {
+            // the writer may keep the file open for a long time, push what it has so far
+            std::unique_lock<std::mutex> lock(lock_);
+            if (!states_.count(path))
+                queue(path);
+        }
+
+        // the budget may be held by other files, written once and left open
+        budget_.throttle([this, &full](){
+            if (full)
+                full();
+
+            std::unique_lock<std::mutex> lock(lock_);
+            queueCharged();
+        });
+    }
+
+    void resize(const char* path, off_t size)
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        log_.dirty(path);
+        charge(path, 0);
+        settle(path, dirty_[path].resize(size));
+        ++tracked(path).written_;
+    }
+
+    void renamed(const char* from, const char* to)
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+
+        // the changes of the file replaced are gone, and so is its share of the budget
+        dirty_.erase(to);
+        settle(to, std::numeric_limits<off_t>::max());
+        log_.clean(to);
+        if (log_.clean(from))
+            log_.dirty(to);
+
+        const auto it = dirty_.find(from);
+        if (it != dirty_.end())
+        {
+            dirty_.emplace(to, std::move(it->second));
+            dirty_.erase(it);
+        }
+
+        const auto charged = charged_.find(from);
+        if (charged != charged_.end())
+        {
+            charged_.emplace(to, charged->second);
+            charged_.erase(charged);
+        }
+
+        // the file replaced is gone, there is nothing left to sync of it
+        const auto replaced = progress_.find(to);
+        if (replaced != progress_.end())
+        {
+            abandon(*replaced->second);
+            progress_.erase(replaced);
+        }
+
+        // waiters follow the file to its new name, and get a push under it
+        const auto progress = progress_.find(from);
+        if (progress != progress_.end())
+        {
+            const auto moved = progress->second;
+            progress_.erase(progress);
+            progress_.emplace(to, moved);
+            if (moved->waiters_)
+                queue(to);
+        }
+    }
+
+    void forget(const char* path)
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        dirty_.erase(path);
+        const auto progress = progress_.find(path);
+        if (progress != progress_.end())
+        {
+            abandon(*progress->second);
+            progress_.erase(progress);
+        }
+        settle(path, std::numeric_limits<off_t>::max());
+        log_.clean(path);
+    }
+
+    std::size_t queueDepth()
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        return queue_.size();
+    }
+
+    void collect(Stats::Snapshot& s)
+    {
+        Stats::Summary latency;
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            s.gauges_.emplace_back("sync_queue_depth", queue_.size());
+            s.gauges_.emplace_back("sync_in_flight", inFlight_);
+            s.gauges_.emplace_back("sync_coalesced", coalesced_);
+            s.gauges_.emplace_back("sync_remote_fsyncs", fsyncs_);
+            for (const auto& h : latency_)
+                h->merge(latency.buckets_);
+        }
+        latency.total();
+        s.distributions_.emplace_back("push", latency);
+        budget_.collect(s);
     }
 
 private:
-    void worker()
+    // Changes to a path are counted, so an fsync knows which push covers the changes before it
+    struct Progress
     {
-        while (running_)
+        uint64_t written_ = 0;
+        uint64_t pushed_ = 0;       // changes up to this one are on the source
+        uint64_t durable_ = 0;      // and synced there
+        uint64_t failed_ = 0;       // the last failed push (or remote fsync) covered changes up to this one
+        int error_ = 0;
+        std::size_t waiters_ = 0;
+        bool metadata_ = false;     // a waiter wants fsync rather than fdatasync
+    };
+
+    // bytes of a path counted against the budget, 'since_' orders the paths by when they got dirty
+    struct Charge
+    {
+        off_t bytes_ = 0;
+        uint64_t since_ = 0;
+    };
+
+    // the changes of the path counted so far, called under the lock
+    Progress& tracked(const std::string& path)
+    {
+        auto& progress = progress_[path];
+        if (!progress)
+            progress = std::make_shared<Progress>();
+        return *progress;
+    }
+
+    // the changes of the path, unless they are no longer those counted in 'tracking' (the file
+    // was removed or replaced meanwhile, counting starts over); called under the lock
+    boost::unordered_map<std::string, std::shared_ptr<Progress>>::iterator find(const std::string& path, const std::shared_ptr<Progress>& tracking)
+    {
+        const auto it = progress_.find(path);
+        return it != progress_.end() && tracking && it->second != tracking ? progress_.end() : it;
+    }
+
+    // lets the waiters of a file that no longer exists go, called under the lock
+    void abandon(Progress& progress)
+    {
+        progress.durable_ = progress.written_;
+        if (progress.waiters_)
+            done_.notify_all();
+    }
+
+    // queues the path unless it is queued already, called under the lock
+    void queue(const char* path)
+    {
+        spawn();
+
+        const auto it = states_.find(path);
+        if (it == states_.end())
+        {
+            log_.dirty(path);
+            states_.emplace(path, Queued);
+            queue_.emplace_back(path);
+            count(path, +1);
+            cond_.notify_one();
+        }
+        else
+        {
+            if (it->second == Pushing)
+                it->second = Again;
+            ++coalesced_;
+        }
+    }
+
+    // counts newly dirty bytes of the path against the budget, called under the lock
+    void charge(const std::string& path, off_t bytes)
+    {
+        const auto it = charged_.emplace(path, Charge());
+        if (it.second)
+            it.first->second.since_ = ++charges_;
+        it.first->second.bytes_ += bytes;
+        budget_.charge(bytes, it.second ? 1 : 0);
+    }
+
+    // queues the dirty paths holding the budget which are not queued yet, the oldest first;
+    // called under the lock
+    void queueCharged()
+    {
+        std::vector<std::pair<uint64_t, const std::string*>> paths;
+        for (const auto& c : charged_)
+        {
+            if (!states_.count(c.first) && dirty_.count(c.first))
+                paths.emplace_back(c.second.since_, &c.first);
+        }
+
+        std::sort(paths.begin(), paths.end());
+        for (const auto& p : paths)
+            queue(p.second->c_str());
+    }
+
+    // returns up to 'bytes' of the path to the budget, and all of it with the file once nothing
+    // of it is dirty; called under the lock
+    void settle(const std::string& path, off_t bytes)
+    {
+        const auto it = charged_.find(path);
+        if (it == charged_.end())
+            return;
+
+        bytes = dirty_.count(path) ? std::min(bytes, it->second.bytes_) : it->second.bytes_;
+        it->second.bytes_ -= bytes;
+
+        int files = 0;
+        if (!it->second.bytes_ && !dirty_.count(path))
+        {
+            charged_.erase(it);
+            files = 1;
+        }
+        budget_.release(bytes, files);
+    }
+
+    // called under the lock
+    void spawn()
+    {
+        if (!started_ || !threads_.empty())
+            return;
+
+        for (std::size_t i = 0; i < workers_; ++i)
+        {
+            latency_.emplace_back(new Histogram());
+            threads_.emplace_back(std::bind(&BackgroundSync::worker, this, latency_.back().get()));
+        }
+    }
+
+    // keeps the number of pending pushes at or under every directory, called under the lock
+    void count(const std::string& path, int delta)
+    {
+        for (std::size_t end = path.size(); end != 0 && end != std::string::npos; end = path.rfind('/', end - 1))
+        {
+            const auto prefix = path.substr(0, end);
+            auto& pending = pending_[prefix];
+            pending += delta;
+            if (!pending)
+                pending_.erase(prefix);
+        }
+    }
+
+    void worker(Histogram* latency)
+    {
+        const IoScheduler::Scope scope(IoClass::Push);
+
+        std::unique_lock<std::mutex> lock(lock_);
+        while (true)
         {
-            try
+            while (queue_.empty() && running_)
+                cond_.wait(lock);
+
+            if (!running_)
+                break;
+
+            const std::string path = std::move(queue_.front());
+            queue_.pop_front();
+            states_[path] = Pushing;
+            ++inFlight_;
+
+            // changes made from now on belong to the next push
+            std::unique_ptr<Dirty> dirty;
+            const auto changes = dirty_.find(path);
+            if (changes != dirty_.end())
+            {
+                dirty.reset(new Dirty(std::move(changes->second)));
+                dirty_.erase(changes);
+            }
+
+            off_t bytes = dirty ? dirty->bytes() : 0;
+
+            // with nothing new since the last push, only an fsync is wanted
+            uint64_t generation = 0;
+            bool changed = true;
+            std::shared_ptr<Progress> tracking;
+            auto progress = progress_.find(path);
+            if (progress != progress_.end())
             {
-                std::string path;
+                tracking = progress->second;
+                generation = tracking->written_;
+                changed = tracking->pushed_ < generation;
+            }
+            lock.unlock();
+
+            const int pushResult = changed ? push(path, dirty.get(), *latency) : 0;
+            const bool pushed = !pushResult;
 
+            lock.lock();
+
+            // refused or timed out by an unavailable source, the push waits for it at the back of the queue and keeps its changes;
+            // any other failure keeps them for the next push of the file, still counted against the budget
+            const bool held = (pushResult == -EHOSTDOWN || pushResult == -ETIMEDOUT) && running_;
+            if (!pushed && dirty)
+            {
+                dirty_[path].merge(*dirty);
+                bytes = 0;
+            }
+
+            int res = pushed ? 0 : -EIO;
+            bool synced = false;
+            progress = find(path, tracking);
+            if (pushed && progress != progress_.end() && progress->second->waiters_)
+            {
+                // one remote fsync for every waiter so far, later ones get the next round
+                const bool data = !progress->second->metadata_;
+                progress->second->metadata_ = false;
+                lock.unlock();
+
+                res = remote_->fsync(path.c_str(), data);
+                if (res)
                 {
-                    std::unique_lock<std::mutex> lock(lock_);
-                    while (queue_.empty() && running_)
-                        cond_.wait(lock);
+                    LOG(Error) << "fsync of '" << path << "' failed: " << strerror(-res);
+                }
 
-                    if (!running_)
-                        break;
+                lock.lock();
+                ++fsyncs_;
+                synced = true;
+                progress = find(path, tracking);
+            }
 
-                    path = std::move(queue_.front());
-                    queue_.pop_front();
+            if (progress != progress_.end())
+            {
+                auto& p = *progress->second;
+                if (pushed)
+                    p.pushed_ = std::max(p.pushed_, generation);
+                if (!res && synced)
+                    p.durable_ = std::max(p.durable_, generation);
+                if (res)
+                {
+                    p.failed_ = std::max(p.failed_, generation);
+                    p.error_ = res;
                 }
+            }
+            --inFlight_;
+            settle(path, bytes);
 
-                const auto remote = remote_ / path;
-                const auto local = local_ / path;
+            auto it = states_.find(path);
+            if (it->second == Again || held)
+            {
+                // written again while being pushed (or held), go to the back of the queue
+                it->second = Queued;
+                queue_.push_back(path);
+                cond_.notify_one();
+            }
+            else
+            {
+                states_.erase(it);
+                count(path, -1);
 
-                const auto parent = remote.parent_path();
-                if (!boost::filesystem::exists(parent))
-                    boost::filesystem::create_directories(parent);
+                // a failed push stays in the log, so it is retried after a restart at the latest
+                if (pushed && !dirty_.count(path))
+                    log_.clean(path);
 
-                Logger::instance() << "pushing '" << path << "'" << std::endl;
-                boost::filesystem::copy_file(local, remote, boost::filesystem::copy_option::overwrite_if_exists);
-                Logger::instance() << "push completed" << std::endl;
+                // kept after an fsync, so the release following it does not push again
+                if (progress != progress_.end() && !synced && !progress->second->waiters_ &&
+                    progress->second->pushed_ >= progress->second->written_)
+                    progress_.erase(progress);
             }
-            catch (const std::exception& e)
+            done_.notify_all();
+        }
+    }
+
+    // pushes the dirty extents if the source file is still what we last synced with, the whole file otherwise
+    int push(const std::string& path, const Dirty* dirty, Histogram& latency)
+    {
+        try
+        {
+            remote_->hold();
+
+            // the file (or its directory) has to exist on the source before the content goes there
+            if (journal_)
+                journal_->waitFor(path);
+
+            const auto file = local_ / path;
+            struct stat st;
+            const off_t size = ::stat(file.c_str(), &st) == 0 ? st.st_size : 0;
+
+            const auto start = monotonicNanoseconds();
+
+            struct stat remote;
+            const bool delta = dirty && dirty->bytes() < size &&
+                remote_->lstat(path.c_str(), &remote) == 0 && baseline::matches(file, remote);
+
+            int res = -1;
+            off_t bytes = size;
+            struct stat pushed;
+            if (delta)
             {
-                std::cerr << "background worker failed: " << e.what() << std::endl;
+                LOG(Info) << "pushing " << dirty->bytes() << " dirty bytes of '" << path << "'";
+                res = remote_->patch(file, path.c_str(), dirty->extents(), dirty->shrunk(), &pushed, Source::Cancelled());
+                if (res)
+                    LOG(Warning) << "patch of '" << path << "' failed: " << strerror(-res) << ", pushing the whole file";
+                else
+                    bytes = dirty->bytes();
             }
+
+            if (res)
+            {
+                LOG(Info) << "pushing '" << path << "'";
+                res = remote_->push(file, path.c_str(), &pushed, Source::Cancelled());
+            }
+
+            latency.add(monotonicNanoseconds() - start);
+
+            if (res)
+            {
+                // the extents are lost, so the next push of the file has to be a full one
+                baseline::clear(file);
+                LOG(Error) << "push of '" << path << "' failed: " << strerror(-res);
+                return res;
+            }
+
+            // what was put in place, a change made on the source since makes the next push a full one
+            baseline::save(file, pushed);
+
+            LOG(Debug) << "push completed";
+            Stats::add(Stats::PushedBytes, bytes);
+            Stats::add(Stats::Pushes, 1);
+            if (delta && bytes < size)
+                Stats::add(Stats::DeltaPushes, 1);
+            return 0;
+        }
+        catch (const std::exception& e)
+        {
+            LOG(Error) << "background worker failed: " << e.what();
+            // not an outage, the push is not held
+            return -ECANCELED;
         }
     }
 
 private:
 
-    const boost::filesystem::path remote_;
+    const Source::Ptr remote_;
     const boost::filesystem::path local_;
+    const std::size_t workers_;
+    Journal* const journal_;
 
     bool running_;
     bool started_;
+    std::size_t inFlight_;
+    uint64_t coalesced_;
+    uint64_t fsyncs_;
 
     std::mutex lock_;
     std::condition_variable cond_;
+    std::condition_variable done_;
     std::deque<std::string> queue_;
+    boost::unordered_map<std::string, State> states_;
+    boost::unordered_map<std::string, Dirty> dirty_;
+    boost::unordered_map<std::string, std::size_t> pending_;
+    boost::unordered_map<std::string, std::shared_ptr<Progress>> progress_;
+    boost::unordered_map<std::string, Charge> charged_;    // dirty bytes counted against the budget
+    uint64_t charges_;
+    DirtyBudget budget_;
+    PushLog log_;
 
-    std::thread worker_;
+    std::vector<std::unique_ptr<Histogram>> latency_;
+    std::vector<std::thread> threads_;
 };
-
@@ -11,6 +11,10 @@
 #include <memory>
 #include <vector>
 #include <mutex>
+#include <algorithm>
+#include <atomic>
+#include <sstream>
+#include <iomanip>
 
 #include <boost/filesystem.hpp>
 #include <boost/shared_ptr.hpp>
@@ -18,27 +22,127 @@
 
 #include "ReadWriteCache.h"
 #include "ReadOnlyCache.h"
+#include "ControlDir.h"
+#include "CommandQueue.h"
+#include "ThreadPool.h"
+#include "DirectoryScanner.h"
+#include "ResilientSource.h"
+#include "Options.h"
+#include "Policy.h"
+#include "Trace.h"
+#include "Stats.h"
 
 class Cache
 {
 public:
     Cache(const boost::filesystem::path& src,
           const boost::filesystem::path& cache,
-          const boost::filesystem::path& readWrite)
+          const boost::filesystem::path& readWrite,
+          const Options& options = Options())
         : src_(src)
         , cache_(cache)
-        , readWrite_(readWrite)
-        , readOnlyCache_(src, cache, readWrite)
-        , readWriteCache_(src, cache, readWrite)
+        , policies_(createPolicies(src, readWrite, options))
+        , scheduler_(createScheduler(options))
+        , engine_(std::make_shared<IoEngine>(options.io_))
+        , resilient_(createResilient(src, options, engine_))
+        , source_(createSource(src, options, engine_, resilient_, scheduler_))
+        , shared_(options.shared_.dir_.empty() ? nullptr : new SharedStore(options.shared_))
+        , readOnlyCache_(src, cache, policies_, source_, shared_.get(), options.misses_)
+        , readWriteCache_(src, cache, policies_, source_, options)
+        , copyThreads_(options.copyThreads_)
+        , fuse_(nullptr)
     {
+        if (!options.prefetchFile_.empty())
+        {
+            prefetcher_.reset(new Prefetcher(options.prefetchFile_, [this](const std::string& path){
+                const IoScheduler::Scope scope(IoClass::ReadAhead);
+                const auto& policy = policies_.find(path.c_str());
+                if (!policy.readWrite() && policy.cache_)
+                    readOnlyCache_.prefetch(path);
+            }));
+        }
+
+        if (!options.traceFile_.empty())
+            trace_.reset(new TraceRecorder(options.traceFile_));
+
+        if (options.scanner_.interval_)
+        {
+            scanner_.reset(new DirectoryScanner(options.scanner_, [this](){ return readOnlyCache_.directories(); }, [this](const std::string& dir){
+                return readOnlyCache_.rescan(dir, [this](const std::string& p){ notify(p); });
+            }));
+        }
+
+        collector_ = Stats::instance().addCollector([this](Stats::Snapshot& s){
+            readOnlyCache_.collect(s);
+            readWriteCache_.collect(s);
+            scheduler_->collect(s);
+            engine_->collect(s);
+            if (resilient_)
+                resilient_->collect(s);
+            if (shared_)
+                shared_->collect(s);
+            if (scanner_)
+                scanner_->collect(s);
+            s.gauges_.emplace_back("log_overflows", Logger::overflows());
+        });
+
+        boost::system::error_code error;
+        if (boost::filesystem::symlink_status(src_ / ".cachefs", error).type() != boost::filesystem::file_not_found && !error)
+        {
+            LOG(Warning) << "'" << (src_ / ".cachefs").string() << "' is hidden by the control directory of the same name";
+        }
+
+        control_.add("stats", [](){ return Stats::text(Stats::instance().snapshot()); });
+        control_.add("stats.json", [](){ return Stats::json(Stats::instance().snapshot()); });
+
+        // commands written here run in the background, reading it shows how they went
+        control_.add("control", [this](){ return commands_.status(); }, [this](const std::string& line){ commands_.submit(line); });
+        commands_.add("invalidate", "invalidate <path>...    drop cached metadata and content of the subtrees, kernel caches included", [this](const CommandQueue::Args& args){
+            std::size_t dropped = 0;
+            for (std::size_t i = 1; i < args.size(); ++i)
+                dropped += invalidate(PolicyRule::normalize(args[i]));
+            return std::to_string(dropped) + " entries dropped";
+        });
+        commands_.add("preload", "preload <path>...       fetch the subtrees into the cache", [this](const CommandQueue::Args& args){
+            std::string result;
+            for (std::size_t i = 1; i < args.size(); ++i)
+                result += (result.empty() ? "" : "; ") + preload(PolicyRule::normalize(args[i]));
+            return result;
+        });
+        commands_.add("set", "set <option>=<value>... change io-limit, dirty-bytes, dirty-files, log-level or log-rate", [this](const CommandQueue::Args& args){
+            for (std::size_t i = 1; i < args.size(); ++i)
+                set(args[i]);
+            return std::string();
+        });
+        commands_.add("flush", "flush                   wait until all changes are pushed to the source", [this](const CommandQueue::Args&){
+            flush();
+            return std::string();
+        });
+    }
+
+    ~Cache()
+    {
+        Stats::instance().removeCollector(collector_);
+    }
+
+    // starts the background work, called once mounted: threads started before fuse forks
+    // to daemonize would be missing in the process serving the mount
+    void start()
+    {
+        if (resilient_)
+            resilient_->start();
+        readOnlyCache_.start();
+        readWriteCache_.start();
+        commands_.start();
+        if (prefetcher_)
+            prefetcher_->start();
+        if (scanner_)
+            scanner_->start();
     }
 
     bool isReadWrite(const char* path)
     {
-        const auto full = src_ / path;
-        return
-            full.string().size() >= readWrite_.string().size() &&
-            full.string().find(readWrite_.string()) == 0;
+        return policies_.find(path).readWrite();
     }
 
     bool isReadOnly(const char* path)
@@ -48,17 +152,35 @@ public:
 
     int getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
     {
-        return isReadOnly(path) ? readOnlyCache_.getattr(path, stbuf, fi) : readWriteCache_.getattr(path, stbuf, fi);
+        record(TraceOp::Getattr, path);
+        if (ControlDir::owns(path))
+            return control_.getattr(path, stbuf);
+
+        const bool readOnly = isReadOnly(path);
+        const Stats::Scope scope(TraceOp::Getattr, readOnly ? Stats::ReadOnly : Stats::ReadWrite);
+        return readOnly ? readOnlyCache_.getattr(path, stbuf, fi) : readWriteCache_.getattr(path, stbuf, fi);
     }
 
     int access(const char *path, int mask)
     {
-        return isReadOnly(path) ? readOnlyCache_.access(path, mask) : readWriteCache_.access(path, mask);
+        record(TraceOp::Access, path);
+        if (ControlDir::owns(path))
+            return control_.access(path, mask);
+
+        const bool readOnly = isReadOnly(path);
+        const Stats::Scope scope(TraceOp::Access, readOnly ? Stats::ReadOnly : Stats::ReadWrite);
+        return readOnly ? readOnlyCache_.access(path, mask) : readWriteCache_.access(path, mask);
     }
 
     int readlink(const char *path, char *buf, size_t size)
     {
-        return isReadOnly(path) ? readOnlyCache_.readlink(path, buf, size) : readWriteCache_.readlink(path, buf, size);
+        record(TraceOp::Readlink, path);
+        if (ControlDir::owns(path))
+            return -EINVAL;
+
+        const bool readOnly = isReadOnly(path);
+        const Stats::Scope scope(TraceOp::Readlink, readOnly ? Stats::ReadOnly : Stats::ReadWrite);
+        return readOnly ? readOnlyCache_.readlink(path, buf, size) : readWriteCache_.readlink(path, buf, size);
     }
 
     int list(const char* path,
@@ -68,97 +190,473 @@ public:
              struct fuse_file_info* fi,
              enum fuse_readdir_flags flags)
     {
-        return isReadOnly(path) ? readOnlyCache_.list(path, buf, filler, offset, fi, flags) : readWriteCache_.list(path, buf, filler, offset, fi, flags);
+        record(TraceOp::List, path);
+        if (ControlDir::owns(path))
+            return control_.list(path, buf, filler);
+
+        const bool readOnly = isReadOnly(path);
+        const Stats::Scope scope(TraceOp::List, readOnly ? Stats::ReadOnly : Stats::ReadWrite);
+        return readOnly ? readOnlyCache_.list(path, buf, filler, offset, fi, flags) : readWriteCache_.list(path, buf, filler, offset, fi, flags);
     }
 
     int mknod(const char *path, mode_t mode, dev_t rdev)
     {
-        return isReadOnly(path) ? readOnlyCache_.mknod(path, mode, rdev) : readWriteCache_.mknod(path, mode, rdev);
+        record(TraceOp::Mknod, path);
+        if (ControlDir::owns(path))
+            return -EACCES;
+
+        const bool readOnly = isReadOnly(path);
+        const Stats::Scope scope(TraceOp::Mknod, readOnly ? Stats::ReadOnly : Stats::ReadWrite);
+        return readOnly ? readOnlyCache_.mknod(path, mode, rdev) : readWriteCache_.mknod(path, mode, rdev);
     }
 
     int mkdir(const char *path, mode_t mode)
     {
-        return isReadOnly(path) ? readOnlyCache_.mkdir(path, mode) : readWriteCache_.mkdir(path, mode);
+        record(TraceOp::Mkdir, path);
+        if (ControlDir::owns(path))
+            return -EACCES;
+
+        const bool readOnly = isReadOnly(path);
+        const Stats::Scope scope(TraceOp::Mkdir, readOnly ? Stats::ReadOnly : Stats::ReadWrite);
+        return readOnly ? readOnlyCache_.mkdir(path, mode) : readWriteCache_.mkdir(path, mode);
     }
 
     int unlink(const char *path)
     {
-        return isReadOnly(path) ? readOnlyCache_.unlink(path) : readWriteCache_.unlink(path);
+        record(TraceOp::Unlink, path);
+        if (ControlDir::owns(path))
+            return -EACCES;
+
+        const bool readOnly = isReadOnly(path);
+        const Stats::Scope scope(TraceOp::Unlink, readOnly ? Stats::ReadOnly : Stats::ReadWrite);
+        return readOnly ? readOnlyCache_.unlink(path) : readWriteCache_.unlink(path);
     }
 
     int rmdir(const char *path)
     {
-        return isReadOnly(path) ? readOnlyCache_.rmdir(path) : readWriteCache_.rmdir(path);
+        record(TraceOp::Rmdir, path);
+        if (ControlDir::owns(path))
+            return -EACCES;
+
+        const bool readOnly = isReadOnly(path);
+        const Stats::Scope scope(TraceOp::Rmdir, readOnly ? Stats::ReadOnly : Stats::ReadWrite);
+        return readOnly ? readOnlyCache_.rmdir(path) : readWriteCache_.rmdir(path);
     }
 
     int symlink(const char *from, const char *to)
     {
-        return isReadOnly(from) ? readOnlyCache_.symlink(from, to) : readWriteCache_.symlink(from, to);
+        // 'from' is the link target, the link itself is what is traced and decides where it lives
+        record(TraceOp::Symlink, to);
+        if (ControlDir::owns(to))
+            return -EACCES;
+
+        const bool readOnly = isReadOnly(to);
+        const Stats::Scope scope(TraceOp::Symlink, readOnly ? Stats::ReadOnly : Stats::ReadWrite);
+        return readOnly ? readOnlyCache_.symlink(from, to) : readWriteCache_.symlink(from, to);
     }
 
     int rename(const char *from, const char *to, unsigned int flags)
     {
-        return isReadOnly(from) ? readOnlyCache_.rename(from, to, flags) : readWriteCache_.rename(from, to, flags);
+        record(TraceOp::Rename, from);
+        if (ControlDir::owns(from) || ControlDir::owns(to))
+            return -EACCES;
+
+        const bool readOnly = isReadOnly(from);
+        const Stats::Scope scope(TraceOp::Rename, readOnly ? Stats::ReadOnly : Stats::ReadWrite);
+        return readOnly ? readOnlyCache_.rename(from, to, flags) : readWriteCache_.rename(from, to, flags);
     }
 
     int link(const char *from, const char *to)
     {
-        return isReadOnly(from) ? readOnlyCache_.link(from, to) : readWriteCache_.link(from, to);
+        record(TraceOp::Link, from);
+        if (ControlDir::owns(from) || ControlDir::owns(to))
+            return -EACCES;
+
+        const bool readOnly = isReadOnly(from);
+        const Stats::Scope scope(TraceOp::Link, readOnly ? Stats::ReadOnly : Stats::ReadWrite);
+        return readOnly ? readOnlyCache_.link(from, to) : readWriteCache_.link(from, to);
     }
 
     int chmod(const char *path, mode_t mode,
                          struct fuse_file_info *fi)
     {
-        return isReadOnly(path) ? readOnlyCache_.chmod(path, mode, fi) : readWriteCache_.chmod(path, mode, fi);
+        record(TraceOp::Chmod, path);
+        if (ControlDir::owns(path))
+            return -EACCES;
+
+        const bool readOnly = isReadOnly(path);
+        const Stats::Scope scope(TraceOp::Chmod, readOnly ? Stats::ReadOnly : Stats::ReadWrite);
+        return readOnly ? readOnlyCache_.chmod(path, mode, fi) : readWriteCache_.chmod(path, mode, fi);
     }
 
     int chown(const char *path, uid_t uid, gid_t gid,
                          struct fuse_file_info *fi)
     {
-        return isReadOnly(path) ? readOnlyCache_.chown(path, uid, gid, fi) : readWriteCache_.chown(path, uid, gid, fi);
+        record(TraceOp::Chown, path);
+        if (ControlDir::owns(path))
+            return -EACCES;
+
+        const bool readOnly = isReadOnly(path);
+        const Stats::Scope scope(TraceOp::Chown, readOnly ? Stats::ReadOnly : Stats::ReadWrite);
+        return readOnly ? readOnlyCache_.chown(path, uid, gid, fi) : readWriteCache_.chown(path, uid, gid, fi);
     }
 
     int truncate(const char *path, off_t size,
                             struct fuse_file_info *fi)
     {
-        return isReadOnly(path) ? readOnlyCache_.truncate(path, size, fi) : readWriteCache_.truncate(path, size, fi);
+        record(TraceOp::Truncate, path, size);
+        if (ControlDir::owns(path))
+            return control_.truncate(path, size);
+
+        const bool readOnly = isReadOnly(path);
+        const Stats::Scope scope(TraceOp::Truncate, readOnly ? Stats::ReadOnly : Stats::ReadWrite);
+        return readOnly ? readOnlyCache_.truncate(path, size, fi) : readWriteCache_.truncate(path, size, fi);
+    }
+
+    int fallocate(const char *path, int mode, off_t offset, off_t length,
+                  struct fuse_file_info *fi)
+    {
+        record(TraceOp::Fallocate, path, offset, length);
+        if (ControlDir::owns(path))
+            return -EACCES;
+
+        const bool readOnly = isReadOnly(path);
+        const Stats::Scope scope(TraceOp::Fallocate, readOnly ? Stats::ReadOnly : Stats::ReadWrite);
+        return readOnly ? readOnlyCache_.fallocate(path, mode, offset, length, fi) : readWriteCache_.fallocate(path, mode, offset, length, fi);
     }
 
     int create(const char *path, mode_t mode,
                           struct fuse_file_info *fi)
     {
-        return isReadOnly(path) ? readOnlyCache_.create(path, mode, fi) : readWriteCache_.create(path, mode, fi);
+        record(TraceOp::Create, path);
+        if (ControlDir::owns(path))
+            return -EACCES;
+
+        const bool readOnly = isReadOnly(path);
+        const Stats::Scope scope(TraceOp::Create, readOnly ? Stats::ReadOnly : Stats::ReadWrite);
+        return readOnly ? readOnlyCache_.create(path, mode, fi) : readWriteCache_.create(path, mode, fi);
     }
 
     int open(const char *path, struct fuse_file_info *fi)
     {
-        return isReadOnly(path) ? readOnlyCache_.open(path, fi) : readWriteCache_.open(path, fi);
+        record(TraceOp::Open, path);
+        if (ControlDir::owns(path))
+            return control_.open(path, fi);
+
+        const auto& policy = policies_.find(path);
+        const bool readOnly = !policy.readWrite();
+        const Stats::Scope scope(TraceOp::Open, readOnly ? Stats::ReadOnly : Stats::ReadWrite);
+        if (prefetcher_ && readOnly && policy.readAhead_)
+            prefetcher_->onOpen(path, policy.readAhead_);
+        return readOnly ? readOnlyCache_.open(path, fi) : readWriteCache_.open(path, fi);
     }
 
     int read(const char *path, char *buf, size_t size, off_t offset,
                         struct fuse_file_info *fi)
     {
-        return isReadOnly(path) ? readOnlyCache_.read(path, buf, size, offset, fi) : readWriteCache_.read(path, buf, size, offset, fi);
+        record(TraceOp::Read, path, offset, size);
+        if (ControlDir::owns(path))
+            return control_.read(path, buf, size, offset, fi);
+
+        const bool readOnly = isReadOnly(path);
+        const Stats::Scope scope(TraceOp::Read, readOnly ? Stats::ReadOnly : Stats::ReadWrite);
+        return readOnly ? readOnlyCache_.read(path, buf, size, offset, fi) : readWriteCache_.read(path, buf, size, offset, fi);
     }
 
     int write(const char *path, const char *buf, size_t size,
                          off_t offset, struct fuse_file_info *fi)
     {
-        return isReadOnly(path) ? readOnlyCache_.write(path, buf, size, offset, fi) : readWriteCache_.write(path, buf, size, offset, fi);
+        record(TraceOp::Write, path, offset, size);
+        if (ControlDir::owns(path))
+            return control_.write(path, buf, size, offset, fi);
+
+        const bool readOnly = isReadOnly(path);
+        const Stats::Scope scope(TraceOp::Write, readOnly ? Stats::ReadOnly : Stats::ReadWrite);
+        return readOnly ? readOnlyCache_.write(path, buf, size, offset, fi) : readWriteCache_.write(path, buf, size, offset, fi);
     }
 
     int release(const char *path, struct fuse_file_info *fi)
     {
-        return isReadOnly(path) ? readOnlyCache_.release(path, fi) : readWriteCache_.release(path, fi);
+        record(TraceOp::Release, path);
+        if (ControlDir::owns(path))
+            return control_.release(path, fi);
+
+        const bool readOnly = isReadOnly(path);
+        const Stats::Scope scope(TraceOp::Release, readOnly ? Stats::ReadOnly : Stats::ReadWrite);
+        return readOnly ? readOnlyCache_.release(path, fi) : readWriteCache_.release(path, fi);
+    }
+
+    int fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+    {
+        record(TraceOp::Fsync, path);
+        if (ControlDir::owns(path))
+            return 0;
+
+        const bool readOnly = isReadOnly(path);
+        const Stats::Scope scope(TraceOp::Fsync, readOnly ? Stats::ReadOnly : Stats::ReadWrite);
+        return readOnly ? readOnlyCache_.fsync(path, isdatasync, fi) : readWriteCache_.fsync(path, isdatasync, fi);
     }
 
+    // fuse instance of the mount, needed to tell the kernel about invalidated entries
+    void mounted(struct fuse* fuse)
+    {
+        fuse_.store(fuse, std::memory_order_release);
+    }
+
+    // drops the cached subtree and makes the kernel forget what it has cached of it, returns the
+    // number of cache entries dropped. Read-write subtrees hold the newest content already, for
+    // them only the kernel caches are dropped.
+    std::size_t invalidate(const std::string& path)
+    {
+        if (isReadWrite(path.c_str()))
+        {
+            notify(path);
+            return 0;
+        }
+
+        return readOnlyCache_.invalidate(path, [this](const std::string& p){ notify(p); });
+    }
+
+    // warms the caches up with a subtree: lists every directory and fetches every regular file,
+    // all of it as preload traffic
+    std::string preload(const std::string& root)
+    {
+        const IoScheduler::Scope scope(IoClass::Preload);
+        const auto start = monotonicNanoseconds();
+
+        std::atomic<std::size_t> files(0);
+        std::atomic<std::size_t> failed(0);
+        std::size_t dirs = 0;
+
+        ThreadPool pool(copyThreads_, copyThreads_ * 4);
+        const auto fetch = [&](const std::string& path){
+            pool.submit([this, path, &files, &failed](){
+                const IoScheduler::Scope scope(IoClass::Preload);
+                fuse_file_info fi = {};
+                fi.flags = O_RDONLY;
+                const bool readOnly = isReadOnly(path.c_str());
+                if (readOnly ? readOnlyCache_.open(path.c_str(), &fi) : readWriteCache_.open(path.c_str(), &fi))
+                {
+                    ++failed;
+                    return;
+                }
+
+                readOnly ? readOnlyCache_.release(path.c_str(), &fi) : readWriteCache_.release(path.c_str(), &fi);
+                ++files;
+            });
+        };
+
+        std::vector<std::string> pending{ root };
+        while (!pending.empty() && commands_.running())
+        {
+            const auto path = pending.back();
+            pending.pop_back();
+
+            const auto& policy = policies_.find(path.c_str());
+            const bool readOnly = !policy.readWrite();
+
+            struct stat st;
+            if (readOnly ? readOnlyCache_.getattr(path.c_str(), &st, nullptr) : readWriteCache_.getattr(path.c_str(), &st, nullptr))
+            {
+                ++failed;
+                continue;
+            }
+
+            if (S_ISREG(st.st_mode) && (!readOnly || policy.cache_))
+                fetch(path);
+
+            if (!S_ISDIR(st.st_mode))
+                continue;
+
+            std::vector<std::string> names;
+            const int res = readOnly ?
+                readOnlyCache_.list(path.c_str(), &names, collect, 0, nullptr, fuse_readdir_flags()) :
+                readWriteCache_.list(path.c_str(), &names, collect, 0, nullptr, fuse_readdir_flags());
+            if (res)
+            {
+                ++failed;
+                continue;
+            }
+
+            ++dirs;
+            for (const auto& name : names)
+            {
+                if (name != "." && name != "..")
+                    pending.push_back((path == "/" ? "" : path) + "/" + name);
+            }
+        }
+        pool.wait();
+
+        std::ostringstream os;
+        os << dirs << " directories, " << files << " files";
+        if (failed)
+            os << ", " << failed << " failed";
+        os << " in " << std::fixed << std::setprecision(3) << (monotonicNanoseconds() - start) / 1e9 << "s";
+        return os.str();
+    }
+
+    // applies '<option>=<value>' the way the command line option would, for the options that
+    // can change while mounted
+    void set(const std::string& setting)
+    {
+        const auto eq = setting.find('=');
+        const auto name = setting.substr(0, eq);
+        const auto value = eq == std::string::npos ? std::string() : setting.substr(eq + 1);
+
+        Options options;
+        if (name == "io-limit")
+        {
+            options.set(name, value);
+            const auto c = value.substr(0, value.find(':'));
+            IoClass io;
+            if (c == "total")
+                scheduler_->setTotal(options.ioTotal_);
+            else if (IoScheduler::parseClass(c, io))
+                scheduler_->setLimit(io, options.ioLimits_[static_cast<std::size_t>(io)]);
+        }
+        else if (name == "dirty-bytes" || name == "dirty-files")
+        {
+            options.set(name, value);
+            auto limit = readWriteCache_.budget().limit();
+            if (name == "dirty-bytes")
+                limit.bytes_ = options.dirtyLimit_.bytes_;
+            else
+                limit.files_ = options.dirtyLimit_.files_;
+            readWriteCache_.budget().setLimit(limit);
+        }
+        else if (name == "log-level")
+        {
+            options.set(name, value);
+            Logger::setLevel(options.logLevel_);
+        }
+        else if (name == "log-rate")
+        {
+            options.set(name, value);
+            Logger::setRateLimit(options.logRate_);
+        }
+        else
+        {
+            throw std::invalid_argument("'" + name + "' cannot be changed while mounted");
+        }
+    }
+
+    // source traffic shaping, limits may be changed at any time
+    IoScheduler& scheduler()
+    {
+        return *scheduler_;
+    }
+
+    // waits until all modified read-write files are pushed to the source
+    void flush()
+    {
+        readWriteCache_.flush();
+    }
+
+private:
+    // the read-write subdir given on the command line is added to the rules of the policy file
+    static PolicyTree createPolicies(const boost::filesystem::path& src, const boost::filesystem::path& readWrite, const Options& options)
+    {
+        Policy defaults;
+        defaults.readAhead_ = static_cast<uint32_t>(options.prefetchWindow_);
+
+        auto rules = options.policies_;
+        if (!readWrite.empty())
+        {
+            const auto path = PolicyRule::normalize("/" + readWrite.string().substr(src.string().size()));
+            auto it = std::find_if(rules.begin(), rules.end(), [&](const PolicyRule& r){ return r.path_ == path; });
+            if (it == rules.end())
+            {
+                rules.emplace_back();
+                it = rules.end() - 1;
+                it->path_ = path;
+            }
+            it->readWrite_ = true;
+        }
+
+        PolicyTree policies(defaults, rules);
+        for (const auto& root : policies.readWriteRoots())
+            LOG(Info) << "read-write subtree '" << root << "'";
+        return policies;
+    }
+
+    static std::shared_ptr<IoScheduler> createScheduler(const Options& options)
+    {
+        auto scheduler = std::make_shared<IoScheduler>();
+        for (std::size_t i = 0; i < IoScheduler::CLASS_COUNT; ++i)
+            scheduler->setLimit(static_cast<IoClass>(i), options.ioLimits_[i]);
+        scheduler->setTotal(options.ioTotal_);
+        return scheduler;
+    }
+
+    static Source::Ptr createRemote(const boost::filesystem::path& src, const Options& options, const IoEngine::Ptr& engine)
+    {
+        Source::Ptr source = std::make_shared<LocalSource>(src, engine);
+        if (options.slowSource_.enabled())
+            source = std::make_shared<SlowSource>(source, options.slowSource_);
+        return source;
+    }
+
+    static std::shared_ptr<ResilientSource> createResilient(const boost::filesystem::path& src, const Options& options, const IoEngine::Ptr& engine)
+    {
+        if (!options.resilience_.enabled())
+            return nullptr;
+        return std::make_shared<ResilientSource>(createRemote(src, options, engine), options.resilience_);
+    }
+
+    static Source::Ptr createSource(const boost::filesystem::path& src, const Options& options, const IoEngine::Ptr& engine,
+                                    const std::shared_ptr<ResilientSource>& resilient, const std::shared_ptr<IoScheduler>& scheduler)
+    {
+        const Source::Ptr source = resilient ? resilient : createRemote(src, options, engine);
+        return std::make_shared<ScheduledSource>(source, scheduler);
+    }
+
+    // tells the kernel to drop what it caches for 'path', called off the FUSE threads
+    void notify(const std::string& path)
+    {
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 2)
+        if (auto* fuse = fuse_.load(std::memory_order_acquire))
+            fuse_invalidate_path(fuse, path.c_str());
+#endif
+    }
+
+    // filler collecting the names of a listing into the std::vector<std::string> passed as 'buf'
+    static int collect(void* buf, const char* name, const struct stat*, off_t, enum fuse_fill_dir_flags)
+    {
+        static_cast<std::vector<std::string>*>(buf)->push_back(name);
+        return 0;
+    }
+
+    void record(TraceOp op, const char* path, uint64_t offset = 0, uint64_t size = 0)
+    {
+        if (trace_)
+            trace_->record(op, path, offset, size);
+    }
 
 private:
     const boost::filesystem::path src_;
     const boost::filesystem::path cache_;
-    const boost::filesystem::path readWrite_;
+    const PolicyTree policies_;
+
+    const std::shared_ptr<IoScheduler> scheduler_;
+    const IoEngine::Ptr engine_;
+    const std::shared_ptr<ResilientSource> resilient_;
+    const Source::Ptr source_;
 
+    const std::unique_ptr<SharedStore> shared_;
     ReadOnlyCache readOnlyCache_;
     ReadWriteCache readWriteCache_;
+
+    ControlDir control_;
+    std::size_t collector_;
+
+    const std::size_t copyThreads_;
+    std::atomic<struct fuse*> fuse_;
+
+    std::unique_ptr<TraceRecorder> trace_;
+    std::unique_ptr<Prefetcher> prefetcher_;
+    std::unique_ptr<DirectoryScanner> scanner_;
+
+    // last, its commands use everything above
+    CommandQueue commands_;
 };
 
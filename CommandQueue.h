@@ -0,0 +1,229 @@
+#pragma once
+
+#include "Logger.h"
+#include "Trace.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <sstream>
+#include <iomanip>
+#include <functional>
+#include <condition_variable>
+
+// Runs control commands on a thread of its own, so whoever submits one (a FUSE thread
+// writing to a control file) returns at once however long the command takes. Commands run
+// one at a time in submission order; the state of the last ones is kept to be read back.
+//
+// A command line is a name followed by space separated arguments. A command returns a
+// message for the status and reports failures by throwing. Commands submitted before
+// 'start' stay queued.
+class CommandQueue
+{
+public:
+    typedef std::vector<std::string> Args;
+    typedef std::function<std::string(const Args&)> Command;
+
+    CommandQueue()
+        : next_(1)
+        , running_(true)
+    {
+    }
+
+    ~CommandQueue()
+    {
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            running_ = false;
+        }
+        cond_.notify_all();
+        if (worker_.joinable())
+            worker_.join();
+    }
+
+    void start()
+    {
+        if (!worker_.joinable())
+            worker_ = std::thread(std::bind(&CommandQueue::worker, this));
+    }
+
+    void add(const std::string& name, const std::string& usage, const Command& command)
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        commands_[name] = Entry{usage, command};
+    }
+
+    // never blocks, a full queue rejects the command
+    void submit(const std::string& line)
+    {
+        std::istringstream words(line);
+        Args args;
+        for (std::string word; words >> word; )
+            args.push_back(word);
+        if (args.empty())
+            return;
+
+        std::unique_lock<std::mutex> lock(lock_);
+        Record record;
+        record.id_ = next_++;
+        record.line_ = line;
+        record.submitted_ = monotonicNanoseconds();
+
+        if (!commands_.count(args.front()))
+        {
+            record.state_ = Failed;
+            record.message_ = "unknown command";
+        }
+        else if (pending_ >= MAX_PENDING)
+        {
+            record.state_ = Failed;
+            record.message_ = "too many commands queued";
+        }
+        else
+        {
+            ++pending_;
+            queue_.emplace_back(record.id_, std::move(args));
+            cond_.notify_all();
+        }
+
+        if (record.state_ == Failed)
+            record.finished_ = record.submitted_;
+
+        LOG(Info) << "control command #" << record.id_ << " '" << line << "'" << (record.state_ == Failed ? " rejected: " + record.message_ : "");
+        history_.push_back(record);
+        if (history_.size() > HISTORY)
+            history_.pop_front();
+    }
+
+    // false once the queue is shutting down, long running commands check it to stop early
+    bool running() const
+    {
+        return running_.load(std::memory_order_relaxed);
+    }
+
+    // the known commands and the last ones submitted
+    std::string status() const
+    {
+        std::ostringstream os;
+        std::unique_lock<std::mutex> lock(lock_);
+
+        os << "commands:" << std::endl;
+        for (const auto& c : commands_)
+            os << "  " << c.second.usage_ << std::endl;
+
+        os << "history:" << std::endl;
+        const auto now = monotonicNanoseconds();
+        for (const auto& r : history_)
+        {
+            const auto end = r.state_ == Queued || r.state_ == Running ? now : r.finished_;
+            os << "  #" << std::left << std::setw(6) << r.id_ << std::setw(9) << stateName(r.state_)
+               << std::right << std::fixed << std::setprecision(3) << std::setw(9) << (end - r.submitted_) / 1e9 << "s  "
+               << r.line_;
+            if (!r.message_.empty())
+                os << ": " << r.message_;
+            os << std::endl;
+        }
+        return os.str();
+    }
+
+private:
+    enum State { Queued, Running, Done, Failed };
+
+    struct Entry
+    {
+        std::string usage_;
+        Command command_;
+    };
+
+    struct Record
+    {
+        uint64_t id_ = 0;
+        std::string line_;
+        State state_ = Queued;
+        std::string message_;
+        uint64_t submitted_ = 0;
+        uint64_t finished_ = 0;
+    };
+
+    static const char* stateName(State state)
+    {
+        static const char* names[] = { "queued", "running", "done", "failed" };
+        return names[state];
+    }
+
+    // called under the lock
+    Record* find(uint64_t id)
+    {
+        for (auto& r : history_)
+        {
+            if (r.id_ == id)
+                return &r;
+        }
+        return nullptr;
+    }
+
+    void worker()
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        while (true)
+        {
+            while (queue_.empty() && running_)
+                cond_.wait(lock);
+
+            if (!running_)
+                break;
+
+            const auto id = queue_.front().first;
+            const auto args = std::move(queue_.front().second);
+            queue_.pop_front();
+
+            const auto command = commands_[args.front()].command_;
+            if (auto* r = find(id))
+                r->state_ = Running;
+            lock.unlock();
+
+            State state = Done;
+            std::string message;
+            try
+            {
+                message = command(args);
+            }
+            catch (const std::exception& e)
+            {
+                state = Failed;
+                message = e.what();
+            }
+
+            LOG(Info) << "control command #" << id << (state == Done ? " done" : " failed") << (message.empty() ? "" : ": " + message);
+
+            lock.lock();
+            --pending_;
+            if (auto* r = find(id))
+            {
+                r->state_ = state;
+                r->message_ = message;
+                r->finished_ = monotonicNanoseconds();
+            }
+        }
+    }
+
+private:
+    static const std::size_t MAX_PENDING = 64;
+    static const std::size_t HISTORY = 32;
+
+    mutable std::mutex lock_;
+    std::condition_variable cond_;
+    std::map<std::string, Entry> commands_;
+    std::deque<std::pair<uint64_t, Args>> queue_;
+    std::deque<Record> history_;
+    std::size_t pending_ = 0;
+    uint64_t next_;
+    std::atomic<bool> running_;
+
+    std::thread worker_;
+};
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fuse.h>
+#include <unistd.h>
+#include <cstring>
+#include <string>
+#include <map>
+#include <mutex>
+#include <functional>
+
+// Virtual '/.cachefs' directory inside the mount. Its files do not exist anywhere,
+// their content is generated when they are opened.
+//
+// Files with a handler also take writes from the user who mounted cachefs (or root), every
+// line written is passed to the handler as is. A write holds whole lines.
+class ControlDir
+{
+public:
+    typedef std::function<std::string()> Generator;
+    typedef std::function<void(const std::string&)> Handler;
+
+    static bool owns(const char* path)
+    {
+        return strncmp(path, "/.cachefs", 9) == 0 && (path[9] == '\0' || path[9] == '/');
+    }
+
+    void add(const std::string& name, const Generator& generator, const Handler& handler = Handler())
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        files_[name] = File{generator, handler};
+    }
+
+    int getattr(const char *path, struct stat *stbuf)
+    {
+        memset(stbuf, 0, sizeof(*stbuf));
+        stbuf->st_uid = getuid();
+        stbuf->st_gid = getgid();
+
+        if (isRoot(path))
+        {
+            stbuf->st_mode = S_IFDIR | 0555;
+            stbuf->st_nlink = 2;
+            return 0;
+        }
+
+        File file;
+        if (!find(path, &file))
+            return -ENOENT;
+
+        // the size is unknown until the content is generated, reads go through direct_io
+        stbuf->st_mode = S_IFREG | (file.handler_ ? 0644 : 0444);
+        stbuf->st_nlink = 1;
+        return 0;
+    }
+
+    int access(const char *path, int mask)
+    {
+        if (isRoot(path))
+            return mask & W_OK ? -EACCES : 0;
+
+        File file;
+        if (!find(path, &file))
+            return -ENOENT;
+
+        return mask & W_OK && !writable(file) ? -EACCES : 0;
+    }
+
+    int list(const char* path, void* buf, fuse_fill_dir_t filler)
+    {
+        if (!isRoot(path))
+            return -ENOTDIR;
+
+        filler(buf, ".", nullptr, 0, static_cast<fuse_fill_dir_flags>(0));
+        filler(buf, "..", nullptr, 0, static_cast<fuse_fill_dir_flags>(0));
+
+        std::unique_lock<std::mutex> lock(lock_);
+        for (const auto& file : files_)
+        {
+            if (filler(buf, file.first.c_str(), nullptr, 0, static_cast<fuse_fill_dir_flags>(0)))
+                break;
+        }
+        return 0;
+    }
+
+    int open(const char *path, struct fuse_file_info *fi)
+    {
+        File file;
+        if (!find(path, &file))
+            return isRoot(path) ? -EISDIR : -ENOENT;
+
+        if ((fi->flags & O_ACCMODE) != O_RDONLY && !writable(file))
+            return -EACCES;
+
+        // content is rendered once per open, so a reader always sees one consistent snapshot
+        const auto content = file.generator_();
+
+        const int fd = memfd_create("cachefs", MFD_CLOEXEC);
+        if (fd == -1)
+            return -errno;
+
+        std::size_t written = 0;
+        while (written < content.size())
+        {
+            const auto res = ::write(fd, content.data() + written, content.size() - written);
+            if (res == -1)
+            {
+                const int error = errno;
+                close(fd);
+                return -error;
+            }
+            written += res;
+        }
+
+        fi->fh = fd;
+        fi->direct_io = 1;
+        return 0;
+    }
+
+    int read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+    {
+        (void) path;
+        const int res = pread(fi->fh, buf, size, offset);
+        return res == -1 ? -errno : res;
+    }
+
+    int write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+    {
+        (void) offset;
+        (void) fi;
+
+        File file;
+        if (!find(path, &file) || !file.handler_)
+            return -EACCES;
+
+        const char* end = buf + size;
+        for (const char* line = buf; line < end; )
+        {
+            const char* next = static_cast<const char*>(memchr(line, '\n', end - line));
+            if (!next)
+                next = end;
+            if (next > line)
+                file.handler_(std::string(line, next));
+            line = next + 1;
+        }
+        return size;
+    }
+
+    // shells open command files with O_TRUNC, which is all a truncate of them may do
+    int truncate(const char *path, off_t size)
+    {
+        File file;
+        if (!find(path, &file) || !file.handler_ || size)
+            return -EACCES;
+        return 0;
+    }
+
+    int release(const char *path, struct fuse_file_info *fi)
+    {
+        (void) path;
+        close(fi->fh);
+        return 0;
+    }
+
+private:
+    struct File
+    {
+        Generator generator_;
+        Handler handler_;
+    };
+
+    // commands are taken from the owner of the mount only
+    static bool writable(const File& file)
+    {
+        if (!file.handler_)
+            return false;
+
+        const auto* context = fuse_get_context();
+        return !context || context->uid == 0 || context->uid == getuid();
+    }
+
+    static bool isRoot(const char* path)
+    {
+        return path[9] == '\0' || (path[9] == '/' && path[10] == '\0');
+    }
+
+    bool find(const char* path, File* file)
+    {
+        if (path[9] != '/')
+            return false;
+
+        std::unique_lock<std::mutex> lock(lock_);
+        const auto it = files_.find(path + 10);
+        if (it == files_.end())
+            return false;
+
+        *file = it->second;
+        return true;
+    }
+
+private:
+    std::mutex lock_;
+    std::map<std::string, File> files_;
+};
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "Logger.h"
+#include "Trace.h"
+#include "Stats.h"
+#include "IoScheduler.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+
+// Picks up changes made to the source behind the cache's back. Only directories are looked
+// at: a file created, removed or renamed moves the mtime and ctime of its directory, so a
+// pass stats every cached directory once and lists again just the ones that moved.
+//
+// A pass is spread over the whole interval and never exceeds 'rate' directories a second,
+// so scanning a large tree shows up as a trickle of stats rather than a burst. The first
+// pass starts one interval after 'start'.
+class DirectoryScanner
+{
+public:
+    typedef std::function<std::vector<std::string>()> Directories;
+    typedef std::function<bool(const std::string&)> Rescan;
+
+    struct Settings
+    {
+        uint32_t interval_ = 0;     // seconds a pass takes, 0 disables the scanner
+        uint32_t rate_ = 100;       // directories per second at most
+    };
+
+    // 'directories' returns the ones to check, 'rescan' checks one and returns true if it changed
+    DirectoryScanner(const Settings& settings, const Directories& directories, const Rescan& rescan)
+        : settings_(settings)
+        , directories_(directories)
+        , rescan_(rescan)
+        , running_(true)
+        , scanned_(0)
+        , changed_(0)
+        , passes_(0)
+    {
+    }
+
+    ~DirectoryScanner()
+    {
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            running_ = false;
+        }
+        cond_.notify_all();
+        if (worker_.joinable())
+            worker_.join();
+    }
+
+    void start()
+    {
+        if (!worker_.joinable())
+            worker_ = std::thread(std::bind(&DirectoryScanner::worker, this));
+    }
+
+    void collect(Stats::Snapshot& s) const
+    {
+        s.gauges_.emplace_back("scan_dirs", scanned_.load(std::memory_order_relaxed));
+        s.gauges_.emplace_back("scan_changed", changed_.load(std::memory_order_relaxed));
+        s.gauges_.emplace_back("scan_passes", passes_.load(std::memory_order_relaxed));
+    }
+
+private:
+    // false once stopped
+    bool sleep(std::chrono::nanoseconds duration)
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        cond_.wait_for(lock, duration, [this](){ return !running_; });
+        return running_;
+    }
+
+    void worker()
+    {
+        const IoScheduler::Scope scope(IoClass::Preload);
+        const std::chrono::nanoseconds interval = std::chrono::seconds(settings_.interval_);
+        const std::chrono::nanoseconds minimum = std::chrono::nanoseconds(std::chrono::seconds(1)) / std::max<uint32_t>(settings_.rate_, 1);
+
+        // a pass spreads its stats over the interval, only a quick one leaves time to wait
+        std::chrono::nanoseconds wait = interval;
+        while (sleep(wait))
+        {
+            const auto start = monotonicNanoseconds();
+            const auto dirs = directories_();
+            const auto pause = dirs.empty() ? minimum : std::max<std::chrono::nanoseconds>(minimum, interval / static_cast<int64_t>(dirs.size()));
+
+            std::size_t changed = 0;
+            for (std::size_t i = 0; i < dirs.size(); ++i)
+            {
+                if (i && !sleep(pause))
+                    return;
+
+                try
+                {
+                    if (rescan_(dirs[i]))
+                        ++changed;
+                }
+                catch (const std::exception& e)
+                {
+                    LOG(Warning) << "failed to rescan " << dirs[i] << ": " << e.what();
+                }
+            }
+
+            scanned_ += dirs.size();
+            changed_ += changed;
+            ++passes_;
+
+            const std::chrono::nanoseconds elapsed(monotonicNanoseconds() - start);
+            wait = elapsed < interval ? interval - elapsed : std::chrono::nanoseconds(0);
+            LOG(Debug) << "scanned " << dirs.size() << " directories in " << elapsed.count() / 1000000 << "ms, " << changed << " changed";
+        }
+    }
+
+private:
+    const Settings settings_;
+    const Directories directories_;
+    const Rescan rescan_;
+
+    std::mutex lock_;
+    std::condition_variable cond_;
+    bool running_;
+
+    std::atomic<uint64_t> scanned_;
+    std::atomic<uint64_t> changed_;
+    std::atomic<uint64_t> passes_;
+
+    std::thread worker_;
+};
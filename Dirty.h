@@ -0,0 +1,145 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <cstdio>
+#include <cstdint>
+#include <map>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include <boost/filesystem.hpp>
+
+typedef std::pair<off_t, off_t> Extent;    // [first, second)
+
+// Byte ranges of a cached file modified since its last push, kept merged and sorted
+class Dirty
+{
+public:
+    Dirty()
+        : shrunk_(-1)
+    {
+    }
+
+    // returns the number of bytes that were not dirty yet
+    off_t write(off_t offset, off_t size)
+    {
+        if (size <= 0)
+            return 0;
+
+        off_t begin = offset;
+        off_t end = offset + size;
+        off_t swallowed = 0;
+
+        // swallow every extent overlapping or touching [begin, end)
+        auto it = extents_.upper_bound(begin);
+        if (it != extents_.begin() && std::prev(it)->second >= begin)
+            --it;
+
+        while (it != extents_.end() && it->first <= end)
+        {
+            begin = std::min(begin, it->first);
+            end = std::max(end, it->second);
+            swallowed += it->second - it->first;
+            it = extents_.erase(it);
+        }
+
+        extents_.emplace(begin, end);
+        return end - begin - swallowed;
+    }
+
+    // a truncate: data past 'size' is gone, the remote file has to be cut there before patching;
+    // returns the number of dirty bytes dropped
+    off_t resize(off_t size)
+    {
+        off_t dropped = 0;
+        auto it = extents_.lower_bound(size);
+        if (it != extents_.begin() && std::prev(it)->second > size)
+        {
+            dropped += std::prev(it)->second - size;
+            std::prev(it)->second = size;
+        }
+        for (auto e = it; e != extents_.end(); ++e)
+            dropped += e->second - e->first;
+        extents_.erase(it, extents_.end());
+
+        shrunk_ = shrunk_ < 0 ? size : std::min(shrunk_, size);
+        return dropped;
+    }
+
+    // adds the extents of 'other' and its truncation (the shorter one wins), returns the
+    // number of bytes that were not dirty yet
+    off_t merge(const Dirty& other)
+    {
+        off_t added = 0;
+        for (const auto& e : other.extents_)
+            added += write(e.first, e.second - e.first);
+        if (other.shrunk_ >= 0)
+            shrunk_ = shrunk_ < 0 ? other.shrunk_ : std::min(shrunk_, other.shrunk_);
+        return added;
+    }
+
+    std::vector<Extent> extents() const
+    {
+        return std::vector<Extent>(extents_.begin(), extents_.end());
+    }
+
+    off_t bytes() const
+    {
+        off_t total = 0;
+        for (const auto& e : extents_)
+            total += e.second - e.first;
+        return total;
+    }
+
+    // size the remote file has to be cut to before the extents are applied, -1 if it does not
+    off_t shrunk() const
+    {
+        return shrunk_;
+    }
+
+private:
+    std::map<off_t, off_t> extents_;
+    off_t shrunk_;
+};
+
+// The size and mtime the source file had when the cached copy was last in sync with it.
+// Stored in an xattr of the cached file: a delta push is only safe while the source file
+// still matches it, otherwise somebody else changed it and the whole file is pushed.
+namespace baseline
+{
+
+static const char* const XATTR = "user.cachefs.remote";
+
+inline void save(const boost::filesystem::path& local, const struct stat& remote)
+{
+    char value[64];
+    const int size = snprintf(value, sizeof(value), "%lld %lld %ld",
+                              static_cast<long long>(remote.st_size),
+                              static_cast<long long>(remote.st_mtim.tv_sec),
+                              static_cast<long>(remote.st_mtim.tv_nsec));
+    setxattr(local.c_str(), XATTR, value, size, 0);
+}
+
+inline void clear(const boost::filesystem::path& local)
+{
+    removexattr(local.c_str(), XATTR);
+}
+
+inline bool matches(const boost::filesystem::path& local, const struct stat& remote)
+{
+    char value[64] = {};
+    if (getxattr(local.c_str(), XATTR, value, sizeof(value) - 1) <= 0)
+        return false;
+
+    long long size = 0, sec = 0;
+    long nsec = 0;
+    if (sscanf(value, "%lld %lld %ld", &size, &sec, &nsec) != 3)
+        return false;
+
+    return size == remote.st_size && sec == remote.st_mtim.tv_sec && nsec == remote.st_mtim.tv_nsec;
+}
+
+} // namespace baseline
@@ -0,0 +1,169 @@
+#pragma once
+
+#include "Stats.h"
+
+#include <cstdint>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+
+// Limit on data written to the read-write tree but not pushed yet, enforced by slowing
+// writers down the way the kernel's dirty_ratio does.
+//
+// Below half of a limit writers run free. Between half and the limit each write is paused,
+// the pause growing with the square of the distance to the limit, so writers settle near
+// the rate pushes drain at instead of hitting a wall. At the limit writers wait until pushes
+// bring the dirty data back under it, asking the owner to push whatever holds the budget
+// while they wait. A limit of 0 is unlimited.
+class DirtyBudget
+{
+public:
+    struct Limit
+    {
+        uint64_t bytes_ = 0;
+        uint64_t files_ = 0;
+    };
+
+    explicit DirtyBudget(const Limit& limit)
+        : bytes_(0)
+        , files_(0)
+        , running_(true)
+        , throttled_(0)
+    {
+        setLimit(limit);
+    }
+
+    ~DirtyBudget()
+    {
+        stop();
+    }
+
+    // lets every waiting writer go
+    void stop()
+    {
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            running_ = false;
+        }
+        cond_.notify_all();
+    }
+
+    void setLimit(const Limit& limit)
+    {
+        limitBytes_.store(limit.bytes_, std::memory_order_relaxed);
+        limitFiles_.store(limit.files_, std::memory_order_relaxed);
+        cond_.notify_all();
+    }
+
+    Limit limit() const
+    {
+        Limit limit;
+        limit.bytes_ = limitBytes_.load(std::memory_order_relaxed);
+        limit.files_ = limitFiles_.load(std::memory_order_relaxed);
+        return limit;
+    }
+
+    // lock free, it is on the path of every write
+    void charge(int64_t bytes, int64_t files)
+    {
+        bytes_.fetch_add(bytes, std::memory_order_relaxed);
+        files_.fetch_add(files, std::memory_order_relaxed);
+    }
+
+    void release(int64_t bytes, int64_t files)
+    {
+        bytes_.fetch_sub(bytes, std::memory_order_relaxed);
+        files_.fetch_sub(files, std::memory_order_relaxed);
+
+        // waiters also poll, a wakeup missed for not holding the lock only costs time
+        cond_.notify_all();
+    }
+
+    // past the point where writers get throttled, time to push what is written
+    bool pressure() const
+    {
+        return ratio() >= SETPOINT;
+    }
+
+    // pauses the calling writer according to the dirty data; 'full' is called without the lock
+    // every round the writer waits at the limit, to get the dirty data pushed
+    void throttle(const std::function<void()>& full = std::function<void()>())
+    {
+        const double r = ratio();
+        if (r < SETPOINT)
+            return;
+
+        std::unique_lock<std::mutex> lock(lock_);
+        const auto start = monotonicNanoseconds();
+        if (r < 1)
+        {
+            const double position = (r - SETPOINT) / (1 - SETPOINT);
+            cond_.wait_for(lock, std::chrono::microseconds(static_cast<uint64_t>(position * position * MAX_PAUSE_US)));
+        }
+        else
+        {
+            while (running_ && ratio() >= 1)
+            {
+                if (full)
+                {
+                    lock.unlock();
+                    full();
+                    lock.lock();
+                    if (!running_ || ratio() < 1)
+                        break;
+                }
+                cond_.wait_for(lock, std::chrono::milliseconds(100));
+            }
+        }
+
+        ++throttled_;
+        pauses_.add(monotonicNanoseconds() - start);
+    }
+
+    void collect(Stats::Snapshot& s)
+    {
+        Stats::Summary pauses;
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            s.gauges_.emplace_back("dirty_bytes", std::max<int64_t>(bytes_.load(std::memory_order_relaxed), 0));
+            s.gauges_.emplace_back("dirty_files", std::max<int64_t>(files_.load(std::memory_order_relaxed), 0));
+            s.gauges_.emplace_back("dirty_throttled", throttled_);
+            pauses_.merge(pauses.buckets_);
+        }
+        pauses.total();
+        s.distributions_.emplace_back("throttle", pauses);
+    }
+
+private:
+    // how full the fuller of the two budgets is
+    double ratio() const
+    {
+        const auto limitBytes = limitBytes_.load(std::memory_order_relaxed);
+        const auto limitFiles = limitFiles_.load(std::memory_order_relaxed);
+
+        double r = 0;
+        if (limitBytes)
+            r = std::max(r, static_cast<double>(bytes_.load(std::memory_order_relaxed)) / limitBytes);
+        if (limitFiles)
+            r = std::max(r, static_cast<double>(files_.load(std::memory_order_relaxed)) / limitFiles);
+        return r;
+    }
+
+private:
+    static constexpr double SETPOINT = 0.5;
+    static const uint64_t MAX_PAUSE_US = 100000;
+
+    std::atomic<uint64_t> limitBytes_;
+    std::atomic<uint64_t> limitFiles_;
+    std::atomic<int64_t> bytes_;
+    std::atomic<int64_t> files_;
+
+    std::mutex lock_;
+    std::condition_variable cond_;
+    bool running_;
+    uint64_t throttled_;
+    Histogram pauses_;
+};
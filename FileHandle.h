@@ -0,0 +1,99 @@
+#pragma once
+
+#include "Dirty.h"
+
+#include <unistd.h>
+#include <string>
+#include <mutex>
+#include <atomic>
+
+// One open of a read-write file, referenced from fi->fh.
+//
+// Writes through it collect their extents here, under a lock only the users of this handle
+// share, and the extents are handed to the background sync in one go when the handle is
+// released, synced or truncated through. Whether the file was written at all is an atomic
+// flag, so release decides about pushing without looking anything up.
+class FileHandle
+{
+public:
+    FileHandle(int fd, const char* path)
+        : fd_(fd)
+        , path_(path)
+        , written_(false)
+        , pending_(false)
+        , charged_(0)
+    {
+    }
+
+    ~FileHandle()
+    {
+        close(fd_);
+    }
+
+    FileHandle(const FileHandle&) = delete;
+    FileHandle& operator=(const FileHandle&) = delete;
+
+    int fd() const
+    {
+        return fd_;
+    }
+
+    // records a write, 'size' may be 0 for size-only changes; returns the bytes not dirty yet
+    off_t write(off_t offset, off_t size)
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        pending_ = true;
+        const auto added = changes_.write(offset, size);
+        charged_ += added;
+        return added;
+    }
+
+    // true on the first call only, when the handle has been written
+    bool mark()
+    {
+        return !written_.exchange(true, std::memory_order_relaxed);
+    }
+
+    bool written() const
+    {
+        return written_.load(std::memory_order_relaxed);
+    }
+
+    // moves the changes recorded since the last call to 'changes', false if there are none;
+    // 'charged' is the number of bytes they were counted with
+    bool take(Dirty& changes, off_t& charged)
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        if (!pending_)
+            return false;
+
+        changes = std::move(changes_);
+        changes_ = Dirty();
+        charged = charged_;
+        charged_ = 0;
+        pending_ = false;
+        return true;
+    }
+
+    // the path the handle was opened under, the owner keeps it up to date across renames
+    // and serializes access
+    const std::string& path() const
+    {
+        return path_;
+    }
+
+    void rename(const std::string& path)
+    {
+        path_ = path;
+    }
+
+private:
+    const int fd_;
+    std::string path_;
+    std::atomic<bool> written_;
+
+    std::mutex lock_;
+    bool pending_;
+    Dirty changes_;
+    off_t charged_;
+};
@@ -0,0 +1,494 @@
+#pragma once
+
+#include "Logger.h"
+#include "Stats.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+#ifdef CACHEFS_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+// Copies byte ranges between local files on the transfer paths: fills from a local source
+// and pushes and patches back to it. With a depth set and io_uring usable, a copy keeps
+// 'depth' blocks in flight on a ring of its own, each one read and then written at the same
+// offset. Buffers and files are registered with the kernel, so a batch of blocks costs one
+// syscall rather than two per block.
+//
+// io_uring is driven through raw syscalls, no library needed. When the build has no
+// io_uring header, the kernel is too old or a sandbox forbids it, copies fall back to pread
+// and pwrite of one block at a time.
+class IoEngine
+{
+public:
+    typedef std::shared_ptr<IoEngine> Ptr;
+
+    struct Settings
+    {
+        uint32_t depth_ = 0;                // blocks in flight per copy, 0 copies with blocking syscalls
+        std::size_t block_ = 128 * 1024;
+
+        bool enabled() const
+        {
+            return depth_ > 0;
+        }
+    };
+
+    explicit IoEngine(const Settings& settings)
+        : settings_(settings)
+        , usable_(settings.enabled())
+        , rings_(0)
+        , ringCopies_(0)
+        , blockingCopies_(0)
+        , bytes_(0)
+    {
+#ifndef CACHEFS_IO_URING
+        if (settings_.enabled())
+        {
+            LOG(Warning) << "built without io_uring, copying with blocking syscalls";
+        }
+        usable_ = false;
+#endif
+    }
+
+    bool enabled() const
+    {
+        return settings_.enabled();
+    }
+
+    // copies [begin, end) of 'in' to the same offsets of 'out'; 'in' ending early is -EIO,
+    // unless 'stopAtEof' is set and the copy just ends there
+    int copy(int in, int out, off_t begin, off_t end, bool stopAtEof = false)
+    {
+        if (begin >= end)
+            return 0;
+
+        int res = 0;
+#ifdef CACHEFS_IO_URING
+        if (auto ring = acquire())
+        {
+            res = ring->copy(in, out, begin, end, stopAtEof);
+            release(std::move(ring));
+            ++ringCopies_;
+        }
+        else
+#endif
+        {
+            res = blocking(in, out, begin, end, stopAtEof);
+            ++blockingCopies_;
+        }
+
+        if (!res)
+            bytes_ += end - begin;
+        return res;
+    }
+
+    void collect(Stats::Snapshot& s) const
+    {
+        s.gauges_.emplace_back("io_uring", usable_.load(std::memory_order_relaxed) ? 1 : 0);
+        s.gauges_.emplace_back("io_uring_rings", rings_.load(std::memory_order_relaxed));
+        s.gauges_.emplace_back("io_uring_copies", ringCopies_.load(std::memory_order_relaxed));
+        s.gauges_.emplace_back("io_blocking_copies", blockingCopies_.load(std::memory_order_relaxed));
+        s.gauges_.emplace_back("io_copied_bytes", bytes_.load(std::memory_order_relaxed));
+    }
+
+private:
+    static int blocking(int in, int out, off_t begin, off_t end, bool stopAtEof)
+    {
+        std::vector<char> buffer(BLOCKING_BUFFER);
+        for (off_t pos = begin; pos < end; )
+        {
+            const auto read = pread(in, buffer.data(), std::min<off_t>(buffer.size(), end - pos), pos);
+            if (read == 0 && stopAtEof)
+                return 0;
+            if (read <= 0)
+                return read ? -errno : -EIO;
+
+            for (ssize_t done = 0; done < read; )
+            {
+                const auto written = pwrite(out, buffer.data() + done, read - done, pos + done);
+                if (written <= 0)
+                    return written ? -errno : -EIO;
+                done += written;
+            }
+            pos += read;
+        }
+        return 0;
+    }
+
+#ifdef CACHEFS_IO_URING
+    // a ring with 'depth' registered buffers of 'block' bytes, used by one copy at a time
+    class Ring
+    {
+    public:
+        ~Ring()
+        {
+            // closing the ring cancels whatever is left and drops the registrations
+            if (fd_ != -1)
+                close(fd_);
+            if (sqes_)
+                munmap(sqes_, sqesSize_);
+            if (cq_ && cq_ != sq_)
+                munmap(cq_, cqSize_);
+            if (sq_)
+                munmap(sq_, sqSize_);
+            if (buffers_)
+                munmap(buffers_, buffersSize_);
+        }
+
+        int open(uint32_t depth, std::size_t block)
+        {
+            depth_ = depth;
+            block_ = block;
+
+            io_uring_params params;
+            memset(&params, 0, sizeof(params));
+            fd_ = static_cast<int>(syscall(__NR_io_uring_setup, depth, &params));
+            if (fd_ == -1)
+                return -errno;
+
+            sqSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cqSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (single)
+                sqSize_ = cqSize_ = std::max(sqSize_, cqSize_);
+
+            sq_ = map(sqSize_, IORING_OFF_SQ_RING);
+            cq_ = single ? sq_ : map(cqSize_, IORING_OFF_CQ_RING);
+            sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+            sqes_ = static_cast<io_uring_sqe*>(map(sqesSize_, IORING_OFF_SQES));
+            if (!sq_ || !cq_ || !sqes_)
+                return -errno;
+
+            char* sq = static_cast<char*>(sq_);
+            sqTail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+            sqMask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+            sqArray_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+            char* cq = static_cast<char*>(cq_);
+            cqHead_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+            cqTail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+            cqMask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+            cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+            buffersSize_ = depth * block;
+            void* buffers = mmap(nullptr, buffersSize_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (buffers == MAP_FAILED)
+                return -errno;
+            buffers_ = static_cast<char*>(buffers);
+
+            iovec iov = { buffers_, buffersSize_ };
+            if (control(IORING_REGISTER_BUFFERS, &iov, 1) == -1)
+                return -errno;
+
+            // two slots, updated to the files of each copy; without them plain fds are used
+            const int files[2] = { -1, -1 };
+            files_ = control(IORING_REGISTER_FILES, files, 2) != -1;
+            return 0;
+        }
+
+        // false after an error leaving the ring in an unknown state
+        bool reusable() const
+        {
+            return !broken_;
+        }
+
+        int copy(int in, int out, off_t begin, off_t end, bool stopAtEof)
+        {
+            fds_[0] = in;
+            fds_[1] = out;
+            fixedFiles_ = files_ && update(fds_);
+
+            std::vector<Slot> slots(depth_);
+            next_ = begin;
+            end_ = end;
+            stopAtEof_ = stopAtEof;
+            inflight_ = 0;
+            error_ = 0;
+            for (uint32_t i = 0; i < depth_; ++i)
+                start(slots, i);
+
+            while (inflight_)
+            {
+                const long res = syscall(__NR_io_uring_enter, fd_, queued_, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+                if (res >= 0)
+                    queued_ -= static_cast<unsigned>(res);
+                else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                {
+                    // ops may still be in flight on the buffers, the ring is not used again
+                    broken_ = true;
+                    return -errno;
+                }
+
+                reap(slots);
+            }
+
+            // a registered file stays open as long as it is registered, an idle ring holds none
+            if (fixedFiles_)
+            {
+                const int none[2] = { -1, -1 };
+                if (!update(none))
+                    broken_ = true;
+            }
+            return error_;
+        }
+
+    private:
+        enum State { Reading, Writing };
+
+        // a block being copied, with at most one op in flight
+        struct Slot
+        {
+            State state_ = Reading;
+            off_t pos_ = 0;
+            off_t end_ = 0;
+            uint32_t filled_ = 0;
+            uint32_t flushed_ = 0;
+        };
+
+        void* map(std::size_t size, off_t offset)
+        {
+            void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+            return p == MAP_FAILED ? nullptr : p;
+        }
+
+        int control(unsigned op, const void* arg, unsigned count)
+        {
+            return static_cast<int>(syscall(__NR_io_uring_register, fd_, op, arg, count));
+        }
+
+        // points the two registered file slots at 'fds'
+        bool update(const int* fds)
+        {
+            io_uring_files_update update;
+            memset(&update, 0, sizeof(update));
+            update.offset = 0;
+            update.fds = reinterpret_cast<uintptr_t>(fds);
+            return control(IORING_REGISTER_FILES_UPDATE, &update, 2) == 2;
+        }
+
+        char* buffer(uint32_t slot)
+        {
+            return buffers_ + slot * block_;
+        }
+
+        // takes the next block of the range, if any
+        void start(std::vector<Slot>& slots, uint32_t i)
+        {
+            if (next_ >= end_ || error_)
+                return;
+
+            auto& s = slots[i];
+            s.state_ = Reading;
+            s.pos_ = next_;
+            s.end_ = std::min<off_t>(next_ + block_, end_);
+            next_ = s.end_;
+            submit(slots, i);
+        }
+
+        void submit(std::vector<Slot>& slots, uint32_t i)
+        {
+            const auto& s = slots[i];
+            const bool write = s.state_ == Writing;
+
+            const unsigned tail = *sqTail_;
+            const unsigned index = tail & sqMask_;
+            io_uring_sqe& sqe = sqes_[index];
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+            sqe.fd = fixedFiles_ ? (write ? 1 : 0) : fds_[write ? 1 : 0];
+            sqe.flags = fixedFiles_ ? IOSQE_FIXED_FILE : 0;
+            sqe.addr = reinterpret_cast<uintptr_t>(buffer(i) + (write ? s.flushed_ : 0));
+            sqe.len = write ? s.filled_ - s.flushed_ : static_cast<uint32_t>(s.end_ - s.pos_);
+            sqe.off = s.pos_ + (write ? s.flushed_ : 0);
+            sqe.buf_index = 0;
+            sqe.user_data = i;
+
+            sqArray_[index] = index;
+            __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+            ++queued_;
+            ++inflight_;
+        }
+
+        void reap(std::vector<Slot>& slots)
+        {
+            unsigned head = *cqHead_;
+            const unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head)
+            {
+                const io_uring_cqe& cqe = cqes_[head & cqMask_];
+                complete(slots, static_cast<uint32_t>(cqe.user_data), cqe.res);
+            }
+            __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+        }
+
+        void complete(std::vector<Slot>& slots, uint32_t i, int res)
+        {
+            --inflight_;
+            if (error_)
+                return;
+
+            auto& s = slots[i];
+            if (res == -EINTR || res == -EAGAIN)
+            {
+                submit(slots, i);
+                return;
+            }
+            if (res == 0 && s.state_ == Reading && stopAtEof_)
+            {
+                // nothing is started past the end of the file, blocks before it still finish
+                end_ = std::min(end_, s.pos_);
+                return;
+            }
+            if (res <= 0)
+            {
+                // a read of nothing means the file got shorter than the range
+                error_ = res ? res : -EIO;
+                return;
+            }
+
+            if (s.state_ == Reading)
+            {
+                s.state_ = Writing;
+                s.filled_ = static_cast<uint32_t>(res);
+                s.flushed_ = 0;
+                submit(slots, i);
+                return;
+            }
+
+            s.flushed_ += static_cast<uint32_t>(res);
+            if (s.flushed_ < s.filled_)
+            {
+                submit(slots, i);
+                return;
+            }
+
+            // a short read leaves the rest of the block to read again
+            s.pos_ += s.filled_;
+            if (s.pos_ < s.end_)
+            {
+                s.state_ = Reading;
+                submit(slots, i);
+            }
+            else
+                start(slots, i);
+        }
+
+    private:
+        int fd_ = -1;
+        uint32_t depth_ = 0;
+        std::size_t block_ = 0;
+
+        void* sq_ = nullptr;
+        std::size_t sqSize_ = 0;
+        void* cq_ = nullptr;
+        std::size_t cqSize_ = 0;
+        io_uring_sqe* sqes_ = nullptr;
+        std::size_t sqesSize_ = 0;
+
+        unsigned* sqTail_ = nullptr;
+        unsigned sqMask_ = 0;
+        unsigned* sqArray_ = nullptr;
+        unsigned* cqHead_ = nullptr;
+        unsigned* cqTail_ = nullptr;
+        unsigned cqMask_ = 0;
+        io_uring_cqe* cqes_ = nullptr;
+
+        char* buffers_ = nullptr;
+        std::size_t buffersSize_ = 0;
+        bool files_ = false;
+        bool broken_ = false;
+
+        // the copy in progress
+        int fds_[2] = { -1, -1 };
+        bool fixedFiles_ = false;
+        off_t next_ = 0;
+        off_t end_ = 0;
+        bool stopAtEof_ = false;
+        unsigned queued_ = 0;
+        unsigned inflight_ = 0;
+        int error_ = 0;
+    };
+
+    // an idle ring or a new one, null if io_uring cannot be used
+    std::unique_ptr<Ring> acquire()
+    {
+        if (!usable_.load(std::memory_order_relaxed))
+            return nullptr;
+
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            if (!idle_.empty())
+            {
+                auto ring = std::move(idle_.back());
+                idle_.pop_back();
+                return ring;
+            }
+        }
+
+        std::unique_ptr<Ring> ring(new Ring());
+        const int res = ring->open(settings_.depth_, settings_.block_);
+        if (!res)
+        {
+            ++rings_;
+            return ring;
+        }
+
+        // a failure after rings worked is taken as transient, only this copy falls back
+        if (!ringCopies_.load() && usable_.exchange(false))
+        {
+            LOG(Warning) << "io_uring unavailable, copying with blocking syscalls: " << strerror(-res);
+        }
+        else
+        {
+            LOG(Debug) << "failed to set up an io_uring: " << strerror(-res);
+        }
+        return nullptr;
+    }
+
+    void release(std::unique_ptr<Ring> ring)
+    {
+        if (!ring->reusable())
+        {
+            --rings_;
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(lock_);
+        if (idle_.size() < IDLE_RINGS)
+            idle_.push_back(std::move(ring));
+        else
+            --rings_;
+    }
+#endif
+
+private:
+    static const std::size_t BLOCKING_BUFFER = 1024 * 1024;
+    static const std::size_t IDLE_RINGS = 16;
+
+    const Settings settings_;
+    std::atomic<bool> usable_;
+
+#ifdef CACHEFS_IO_URING
+    std::mutex lock_;
+    std::vector<std::unique_ptr<Ring>> idle_;
+#endif
+
+    std::atomic<uint64_t> rings_;
+    std::atomic<uint64_t> ringCopies_;
+    std::atomic<uint64_t> blockingCopies_;
+    std::atomic<uint64_t> bytes_;
+};
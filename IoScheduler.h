@@ -0,0 +1,452 @@
+#pragma once
+
+#include "Logger.h"
+#include "Stats.h"
+#include "Source.h"
+
+#include <sys/stat.h>
+#include <cstdint>
+#include <string>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <condition_variable>
+
+#include <boost/filesystem.hpp>
+
+// What a source op is done for, in order of priority
+enum class IoClass : uint8_t
+{
+    Foreground,     // cache misses somebody is waiting for
+    ReadAhead,
+    Push,
+    Preload
+};
+
+// Shapes all traffic to the source. Every class has its own token buckets for bytes and ops
+// per second, and all of them share a total one, which the highest class with an op ready
+// gets first. Ops of one class start in arrival order.
+//
+// Buckets hold up to one second worth of tokens and may go into debt: an op starts once
+// the buckets it needs are positive and then takes its bytes, so a large transfer delays
+// the ops after it rather than waiting for a burst it could never get. Transfers whose size
+// is only known afterwards are charged when they complete.
+//
+// The class comes from the thread issuing the op, set with a 'Scope'. Limits can be
+// changed at any time, a limit of 0 is unlimited.
+class IoScheduler
+{
+public:
+    static const std::size_t CLASS_COUNT = 4;
+
+    struct Limit
+    {
+        uint64_t bandwidth_ = 0;    // bytes per second
+        uint64_t iops_ = 0;
+
+        bool enabled() const
+        {
+            return bandwidth_ || iops_;
+        }
+    };
+
+    // source ops issued by the current thread belong to 'c' while the scope lives
+    class Scope
+    {
+    public:
+        explicit Scope(IoClass c)
+            : previous_(current())
+        {
+            current() = c;
+        }
+
+        ~Scope()
+        {
+            current() = previous_;
+        }
+
+    private:
+        const IoClass previous_;
+    };
+
+    static IoClass& current()
+    {
+        thread_local IoClass c = IoClass::Foreground;
+        return c;
+    }
+
+    static const char* name(IoClass c)
+    {
+        static const char* names[] = { "foreground", "readahead", "push", "preload" };
+        static_assert(sizeof(names) / sizeof(names[0]) == CLASS_COUNT, "class names are out of date");
+        return names[static_cast<std::size_t>(c)];
+    }
+
+    static bool parseClass(const std::string& name, IoClass& c)
+    {
+        for (std::size_t i = 0; i < CLASS_COUNT; ++i)
+        {
+            if (name == IoScheduler::name(static_cast<IoClass>(i)))
+            {
+                c = static_cast<IoClass>(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    IoScheduler()
+        : limited_(false)
+        , last_(monotonicNanoseconds())
+    {
+        for (std::size_t i = 0; i < CLASS_COUNT; ++i)
+        {
+            ops_[i].store(0, std::memory_order_relaxed);
+            bytes_[i].store(0, std::memory_order_relaxed);
+            waits_[i] = 0;
+            tickets_[i] = 0;
+        }
+    }
+
+    void setLimit(IoClass c, const Limit& limit)
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        classes_[static_cast<std::size_t>(c)].set(limit);
+        update();
+    }
+
+    void setTotal(const Limit& limit)
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        total_.set(limit);
+        update();
+    }
+
+    // waits until an op of the current thread's class may start, then charges it with 'bytes'
+    void acquire(uint64_t bytes)
+    {
+        const auto c = static_cast<std::size_t>(current());
+        ops_[c].fetch_add(1, std::memory_order_relaxed);
+        bytes_[c].fetch_add(bytes, std::memory_order_relaxed);
+
+        if (!limited_.load(std::memory_order_acquire))
+            return;
+
+        std::unique_lock<std::mutex> lock(lock_);
+        const auto ticket = tickets_[c]++;
+        queues_[c].push_back(ticket);
+
+        const auto start = monotonicNanoseconds();
+        bool waited = false;
+        while (true)
+        {
+            refill();
+            if (queues_[c].front() == ticket && admissible(c))
+                break;
+
+            waited = true;
+            cond_.wait_for(lock, std::chrono::nanoseconds(delay(c)));
+        }
+
+        queues_[c].pop_front();
+        classes_[c].take(1, bytes);
+        total_.take(1, bytes);
+
+        if (waited)
+        {
+            ++waits_[c];
+            wait_.add(monotonicNanoseconds() - start);
+        }
+        cond_.notify_all();
+    }
+
+    // charges a transfer of the current thread's class whose size was not known up front
+    void charge(uint64_t bytes)
+    {
+        const auto c = static_cast<std::size_t>(current());
+        bytes_[c].fetch_add(bytes, std::memory_order_relaxed);
+
+        if (!limited_.load(std::memory_order_acquire))
+            return;
+
+        std::unique_lock<std::mutex> lock(lock_);
+        refill();
+        classes_[c].take(0, bytes);
+        total_.take(0, bytes);
+    }
+
+    void collect(Stats::Snapshot& s)
+    {
+        Stats::Summary wait;
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            for (std::size_t i = 0; i < CLASS_COUNT; ++i)
+            {
+                const std::string prefix = std::string("io_") + name(static_cast<IoClass>(i));
+                s.gauges_.emplace_back(prefix + "_ops", ops_[i].load(std::memory_order_relaxed));
+                s.gauges_.emplace_back(prefix + "_bytes", bytes_[i].load(std::memory_order_relaxed));
+                s.gauges_.emplace_back(prefix + "_throttled", waits_[i]);
+                s.gauges_.emplace_back(prefix + "_queued", queues_[i].size());
+            }
+            wait_.merge(wait.buckets_);
+        }
+        wait.total();
+        s.distributions_.emplace_back("io_wait", wait);
+    }
+
+private:
+    class Bucket
+    {
+    public:
+        void set(const Limit& limit)
+        {
+            // a new limit starts with a full burst
+            if (!limit_.bandwidth_)
+                bytes_ = limit.bandwidth_;
+            if (!limit_.iops_)
+                ops_ = limit.iops_;
+
+            limit_ = limit;
+            bytes_ = std::min<double>(bytes_, limit.bandwidth_);
+            ops_ = std::min<double>(ops_, limit.iops_);
+        }
+
+        const Limit& limit() const
+        {
+            return limit_;
+        }
+
+        void refill(double seconds)
+        {
+            bytes_ = std::min<double>(bytes_ + seconds * limit_.bandwidth_, limit_.bandwidth_);
+            ops_ = std::min<double>(ops_ + seconds * limit_.iops_, limit_.iops_);
+        }
+
+        bool ready() const
+        {
+            return (!limit_.bandwidth_ || bytes_ > 0) && (!limit_.iops_ || ops_ > 0);
+        }
+
+        void take(uint64_t ops, uint64_t bytes)
+        {
+            if (limit_.bandwidth_)
+                bytes_ -= bytes;
+            if (limit_.iops_)
+                ops_ -= ops;
+        }
+
+        // nanoseconds until the bucket is ready
+        uint64_t delay() const
+        {
+            double seconds = 0;
+            if (limit_.bandwidth_ && bytes_ <= 0)
+                seconds = std::max(seconds, (1 - bytes_) / limit_.bandwidth_);
+            if (limit_.iops_ && ops_ <= 0)
+                seconds = std::max(seconds, (0.001 - ops_) / limit_.iops_);
+            return static_cast<uint64_t>(seconds * 1e9);
+        }
+
+    private:
+        Limit limit_;
+        double bytes_ = 0;
+        double ops_ = 0;
+    };
+
+    // called under the lock
+    void update()
+    {
+        bool limited = total_.limit().enabled();
+        for (const auto& b : classes_)
+            limited = limited || b.limit().enabled();
+        limited_.store(limited, std::memory_order_release);
+        cond_.notify_all();
+    }
+
+    // called under the lock
+    void refill()
+    {
+        const auto now = monotonicNanoseconds();
+        const double seconds = (now - last_) / 1e9;
+        last_ = now;
+
+        total_.refill(seconds);
+        for (auto& b : classes_)
+            b.refill(seconds);
+    }
+
+    // the next op of class 'c' may start, called under the lock
+    bool admissible(std::size_t c) const
+    {
+        if (!classes_[c].ready() || !total_.ready())
+            return false;
+
+        // a higher class that is only waiting for the shared tokens goes first
+        for (std::size_t higher = 0; higher < c; ++higher)
+        {
+            if (!queues_[higher].empty() && classes_[higher].ready())
+                return false;
+        }
+        return true;
+    }
+
+    // how long a waiter of class 'c' sleeps unless woken by another op, called under the lock
+    uint64_t delay(std::size_t c) const
+    {
+        const uint64_t wait = std::max(classes_[c].delay(), total_.delay());
+        return std::min<uint64_t>(std::max<uint64_t>(wait, 100000), 100000000);
+    }
+
+private:
+    std::atomic<bool> limited_;
+
+    std::mutex lock_;
+    std::condition_variable cond_;
+    uint64_t last_;
+    Bucket total_;
+    Bucket classes_[CLASS_COUNT];
+    std::deque<uint64_t> queues_[CLASS_COUNT];
+    uint64_t tickets_[CLASS_COUNT];
+    uint64_t waits_[CLASS_COUNT];
+    Histogram wait_;
+
+    std::atomic<uint64_t> ops_[CLASS_COUNT];
+    std::atomic<uint64_t> bytes_[CLASS_COUNT];
+};
+
+// Source whose ops go through an IoScheduler first
+class ScheduledSource : public Source
+{
+public:
+    ScheduledSource(const Source::Ptr& source, const std::shared_ptr<IoScheduler>& scheduler)
+        : source_(source)
+        , scheduler_(scheduler)
+    {
+    }
+
+    void hold() override
+    {
+        source_->hold();
+    }
+
+    int lstat(const char* path, struct stat* st) override
+    {
+        scheduler_->acquire(0);
+        return source_->lstat(path, st);
+    }
+
+    int access(const char* path, int mask) override
+    {
+        scheduler_->acquire(0);
+        return source_->access(path, mask);
+    }
+
+    int readlink(const char* path, char* buf, size_t size) override
+    {
+        scheduler_->acquire(0);
+        return source_->readlink(path, buf, size);
+    }
+
+    int list(const char* path, std::vector<DirEntry>& entries) override
+    {
+        scheduler_->acquire(0);
+        return source_->list(path, entries);
+    }
+
+    int fetch(const char* path, const boost::filesystem::path& local) override
+    {
+        scheduler_->acquire(0);
+        const int res = source_->fetch(path, local);
+        if (!res)
+            scheduler_->charge(size(local));
+        return res;
+    }
+
+    int push(const boost::filesystem::path& local, const char* path, struct stat* pushed, const Cancelled& cancelled) override
+    {
+        scheduler_->acquire(size(local));
+        return source_->push(local, path, pushed, cancelled);
+    }
+
+    int patch(const boost::filesystem::path& local, const char* path, const std::vector<Extent>& extents, off_t shrink,
+              struct stat* pushed, const Cancelled& cancelled) override
+    {
+        uint64_t bytes = 0;
+        for (const auto& e : extents)
+            bytes += e.second - e.first;
+        scheduler_->acquire(bytes);
+        return source_->patch(local, path, extents, shrink, pushed, cancelled);
+    }
+
+    int fsync(const char* path, bool data) override
+    {
+        scheduler_->acquire(0);
+        return source_->fsync(path, data);
+    }
+
+    int mkdir(const char* path, mode_t mode) override
+    {
+        scheduler_->acquire(0);
+        return source_->mkdir(path, mode);
+    }
+
+    int unlink(const char* path) override
+    {
+        scheduler_->acquire(0);
+        return source_->unlink(path);
+    }
+
+    int rmdir(const char* path) override
+    {
+        scheduler_->acquire(0);
+        return source_->rmdir(path);
+    }
+
+    int symlink(const char* target, const char* path) override
+    {
+        scheduler_->acquire(0);
+        return source_->symlink(target, path);
+    }
+
+    int rename(const char* from, const char* to) override
+    {
+        scheduler_->acquire(0);
+        return source_->rename(from, to);
+    }
+
+    int link(const char* from, const char* to) override
+    {
+        scheduler_->acquire(0);
+        return source_->link(from, to);
+    }
+
+    int chmod(const char* path, mode_t mode) override
+    {
+        scheduler_->acquire(0);
+        return source_->chmod(path, mode);
+    }
+
+    int chown(const char* path, uid_t uid, gid_t gid) override
+    {
+        scheduler_->acquire(0);
+        return source_->chown(path, uid, gid);
+    }
+
+    int create(const char* path, int flags, mode_t mode) override
+    {
+        scheduler_->acquire(0);
+        return source_->create(path, flags, mode);
+    }
+
+private:
+    static uint64_t size(const boost::filesystem::path& local)
+    {
+        struct stat st;
+        return ::stat(local.c_str(), &st) == 0 ? st.st_size : 0;
+    }
+
+private:
+    const Source::Ptr source_;
+    const std::shared_ptr<IoScheduler> scheduler_;
+};
@@ -0,0 +1,802 @@
+#pragma once
+
+#include "Logger.h"
+#include "Stats.h"
+#include "Source.h"
+#include "IoScheduler.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <algorithm>
+#include <condition_variable>
+
+#include <boost/crc.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/unordered_map.hpp>
+
+// Durable log of metadata operations on the read-write tree, replayed against the source
+// in the background.
+//
+// 'append' returns once the entry is on disk; appends arriving while a write is in
+// progress are committed together with a single fdatasync. Replay workers apply entries
+// in order, an entry only starts when nothing it touches (its paths, their ancestors or
+// descendants) is touched by an earlier entry still pending, so independent subtrees are
+// replayed in parallel. The sequence number of the last entry replayed without gaps is
+// checkpointed next to the journal, followed by the sequence numbers of the entries replayed
+// after it, each one made durable before anything depending on the entry is replayed. Ops
+// like rename or create are not idempotent, so on startup only the entries not recorded
+// there are replayed again: at most the ones in flight at a crash, with nothing after them
+// applied yet. Replay treats "already done" results (EEXIST on create, ENOENT on remove, a
+// rename whose source is gone) as success. Replay starts with 'start', once mounted.
+//
+// An entry the source keeps refusing is set aside and counted in the stats, the checkpoint
+// stays before it so it is replayed again on the next start; entries after it go on.
+class Journal
+{
+public:
+    enum Op : uint8_t { Mkdir, Unlink, Rmdir, Symlink, Rename, Link, Chmod, Chown, Create };
+
+    struct Entry
+    {
+        uint64_t seq_ = 0;
+        Op op_ = Mkdir;
+        std::string path_;
+        std::string other_;     // rename and link target, symlink contents
+        uint32_t mode_ = 0;
+        uint32_t uid_ = 0;
+        uint32_t gid_ = 0;
+        int32_t flags_ = 0;
+    };
+
+    Journal(const Source::Ptr& source, const boost::filesystem::path& dir, std::size_t workers)
+        : workers_(workers ? workers : 1)
+        , source_(source)
+        , file_(dir / "journal")
+        , checkpointFile_(dir / "journal.applied")
+        , running_(true)
+        , writing_(false)
+        , last_(0)
+        , durable_(0)
+        , applied_(0)
+        , checkpointed_(0)
+        , recorded_(0)
+        , recordsEnd_(sizeof(uint64_t))
+    {
+        boost::filesystem::create_directories(dir);
+
+        fd_ = ::open(file_.c_str(), O_RDWR | O_CREAT | O_APPEND, 0600);
+        checkpointFd_ = ::open(checkpointFile_.c_str(), O_RDWR | O_CREAT, 0600);
+        if (fd_ == -1 || checkpointFd_ == -1)
+            throw std::runtime_error("failed to open journal in " + dir.string());
+
+        recover();
+
+        for (std::size_t i = 0; i < workers_; ++i)
+            latency_.emplace_back(new Histogram());
+    }
+
+    ~Journal()
+    {
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            running_ = false;
+        }
+        cond_.notify_all();
+        done_.notify_all();
+        for (auto& t : threads_)
+            t.join();
+
+        checkpoint();
+        close(fd_);
+        close(checkpointFd_);
+    }
+
+    void start()
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        if (!threads_.empty())
+            return;
+
+        for (const auto& latency : latency_)
+            threads_.emplace_back(std::bind(&Journal::worker, this, latency.get()));
+    }
+
+    // makes the entry durable, returns 0 or -errno if the journal could not be written
+    int append(Entry entry)
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        entry.seq_ = ++last_;
+        encode(entry, buffer_);
+        count(entry, +1);
+        unsynced_.push_back(std::move(entry));
+        const auto seq = last_;
+
+        while (durable_ < seq)
+        {
+            if (writing_)
+            {
+                commit_.wait(lock);
+                const int res = writeFailure(seq);
+                if (res)
+                    return res;
+                continue;
+            }
+
+            // this thread writes everything appended so far, later appends wait for the next round
+            writing_ = true;
+            std::vector<char> data;
+            std::deque<Entry> batch;
+            data.swap(buffer_);
+            batch.swap(unsynced_);
+            lock.unlock();
+
+            const int res = write(data);
+
+            lock.lock();
+            writing_ = false;
+            durable_ = batch.back().seq_;
+            if (res)
+            {
+                // the whole batch is dropped, its writers (waiting or not) get the error
+                LOG(Error) << "journal write failed: " << strerror(-res);
+                for (const auto& e : batch)
+                    count(e, -1);
+                if (batch.size() > 1)
+                    writeFailures_.emplace(batch.front().seq_, WriteFailure{batch.back().seq_, res, batch.size() - 1});
+                commit_.notify_all();
+                done_.notify_all();
+                return res;
+            }
+
+            for (auto& e : batch)
+                queue_.push_back(std::move(e));
+            cond_.notify_all();
+            commit_.notify_all();
+        }
+
+        return 0;
+    }
+
+    // waits until no pending entry touches 'path' or any of its ancestors
+    void waitFor(const std::string& path)
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        while (running_ && touched(path))
+            done_.wait(lock);
+    }
+
+    std::size_t pending()
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        return last_ - applied_;
+    }
+
+    void collect(Stats::Snapshot& s)
+    {
+        Stats::Summary latency;
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            s.gauges_.emplace_back("journal_pending", last_ - applied_);
+            s.gauges_.emplace_back("journal_failed", failed_.size());
+            for (const auto& h : latency_)
+                h->merge(latency.buckets_);
+        }
+        latency.total();
+        s.distributions_.emplace_back("replay", latency);
+    }
+
+private:
+    enum Outcome { Applied, Failed, Stopped };
+
+    // a batch of entries that could not be written, waited for by the writers of all but one
+    struct WriteFailure
+    {
+        uint64_t last_;
+        int error_;
+        std::size_t waiters_;
+    };
+
+    // the error for the writer of 'seq' if its batch failed to be written, called under the lock
+    int writeFailure(uint64_t seq)
+    {
+        auto it = writeFailures_.upper_bound(seq);
+        if (it == writeFailures_.begin())
+            return 0;
+
+        --it;
+        if (seq > it->second.last_)
+            return 0;
+
+        const int res = it->second.error_;
+        if (!--it->second.waiters_)
+            writeFailures_.erase(it);
+        return res;
+    }
+
+#pragma pack(push, 1)
+    struct Header
+    {
+        uint32_t crc_;          // of everything after this field, paths included
+        uint64_t seq_;
+        uint8_t op_;
+        uint32_t mode_;
+        uint32_t uid_;
+        uint32_t gid_;
+        int32_t flags_;
+        uint16_t path_;
+        uint16_t other_;
+    };
+#pragma pack(pop)
+
+    static void encode(const Entry& e, std::vector<char>& out)
+    {
+        Header h;
+        h.seq_ = e.seq_;
+        h.op_ = e.op_;
+        h.mode_ = e.mode_;
+        h.uid_ = e.uid_;
+        h.gid_ = e.gid_;
+        h.flags_ = e.flags_;
+        h.path_ = static_cast<uint16_t>(e.path_.size());
+        h.other_ = static_cast<uint16_t>(e.other_.size());
+
+        const auto start = out.size();
+        out.resize(start + sizeof(h));
+        out.insert(out.end(), e.path_.begin(), e.path_.end());
+        out.insert(out.end(), e.other_.begin(), e.other_.end());
+
+        boost::crc_32_type crc;
+        crc.process_bytes(reinterpret_cast<const char*>(&h) + sizeof(h.crc_), sizeof(h) - sizeof(h.crc_));
+        crc.process_bytes(out.data() + start + sizeof(h), out.size() - start - sizeof(h));
+        h.crc_ = crc.checksum();
+        memcpy(out.data() + start, &h, sizeof(h));
+    }
+
+    // parses one entry at 'pos', false at the end of the data or at a torn write
+    static bool decode(const std::vector<char>& data, std::size_t& pos, Entry& e)
+    {
+        Header h;
+        if (pos + sizeof(h) > data.size())
+            return false;
+
+        memcpy(&h, data.data() + pos, sizeof(h));
+        const auto size = sizeof(h) + h.path_ + h.other_;
+        if (pos + size > data.size())
+            return false;
+
+        boost::crc_32_type crc;
+        crc.process_bytes(data.data() + pos + sizeof(h.crc_), size - sizeof(h.crc_));
+        if (crc.checksum() != h.crc_)
+            return false;
+
+        const char* strings = data.data() + pos + sizeof(h);
+        e.seq_ = h.seq_;
+        e.op_ = static_cast<Op>(h.op_);
+        e.mode_ = h.mode_;
+        e.uid_ = h.uid_;
+        e.gid_ = h.gid_;
+        e.flags_ = h.flags_;
+        e.path_.assign(strings, h.path_);
+        e.other_.assign(strings + h.path_, h.other_);
+        pos += size;
+        return true;
+    }
+
+    int write(const std::vector<char>& data)
+    {
+        struct stat st;
+        if (fstat(fd_, &st) == -1)
+            return -errno;
+
+        int res = 0;
+        std::size_t written = 0;
+        while (!res && written < data.size())
+        {
+            const auto count = ::write(fd_, data.data() + written, data.size() - written);
+            if (count < 0)
+                res = -errno;
+            else
+                written += count;
+        }
+
+        if (!res && fdatasync(fd_) == -1)
+            res = -errno;
+
+        // a torn entry would hide every entry written after it from recovery
+        if (res && ftruncate(fd_, st.st_size) == -1)
+        {
+            LOG(Error) << "failed to cut the journal back: " << strerror(errno);
+        }
+        return res;
+    }
+
+    void recover()
+    {
+        uint64_t checkpoint = 0;
+        if (pread(checkpointFd_, &checkpoint, sizeof(checkpoint), 0) != sizeof(checkpoint))
+            checkpoint = 0;
+
+        // entries replayed after the checkpoint, a torn record at the end is dropped
+        std::set<uint64_t> replayed;
+        uint64_t seq;
+        while (pread(checkpointFd_, &seq, sizeof(seq), recordsEnd_) == sizeof(seq))
+        {
+            if (seq > checkpoint)
+                replayed.insert(seq);
+            recordsEnd_ += sizeof(seq);
+        }
+        if (ftruncate(checkpointFd_, recordsEnd_) == -1)
+        {
+            LOG(Error) << "failed to truncate journal checkpoint: " << strerror(errno);
+        }
+        recorded_ = replayed.empty() ? 0 : *replayed.rbegin();
+
+        std::vector<char> data;
+        char chunk[64 * 1024];
+        ssize_t res;
+        off_t offset = 0;
+        while ((res = pread(fd_, chunk, sizeof(chunk), offset)) > 0)
+        {
+            data.insert(data.end(), chunk, chunk + res);
+            offset += res;
+        }
+
+        std::size_t pos = 0;
+        Entry e;
+        while (decode(data, pos, e))
+        {
+            last_ = std::max(last_, e.seq_);
+            if (e.seq_ <= checkpoint || replayed.count(e.seq_))
+                continue;
+
+            count(e, +1);
+            queue_.push_back(e);
+        }
+
+        if (pos < data.size())
+        {
+            LOG(Warning) << "journal has " << data.size() - pos << " trailing bytes of a torn write, dropping them";
+            if (ftruncate(fd_, pos) == -1)
+            {
+                LOG(Error) << "failed to truncate journal: " << strerror(errno);
+            }
+        }
+
+        last_ = std::max(last_, checkpoint);
+        durable_ = last_;
+        applied_ = checkpointed_ = queue_.empty() ? last_ : queue_.front().seq_ - 1;
+        if (!queue_.empty())
+        {
+            LOG(Info) << "replaying " << queue_.size() << " journal entries";
+        }
+    }
+
+    void worker(Histogram* latency)
+    {
+        const IoScheduler::Scope scope(IoClass::Push);
+
+        std::unique_lock<std::mutex> lock(lock_);
+        while (true)
+        {
+            auto it = queue_.end();
+            while (running_ && (it = runnable()) == queue_.end())
+                cond_.wait(lock);
+
+            if (!running_)
+                break;
+
+            Entry entry = std::move(*it);
+            queue_.erase(it);
+            replaying_.insert(entry.seq_);
+            inFlight_.push_back(&entry);
+            lock.unlock();
+
+            const auto start = monotonicNanoseconds();
+            const auto outcome = apply(entry);
+            latency->add(monotonicNanoseconds() - start);
+
+            // while the entry still holds back everything depending on it
+            if (outcome == Applied)
+                record(entry.seq_);
+
+            lock.lock();
+            if (outcome == Stopped)
+            {
+                // stopped while the source was unavailable, the next start replays it
+                inFlight_.erase(std::find(inFlight_.begin(), inFlight_.end(), &entry));
+                break;
+            }
+
+            replaying_.erase(entry.seq_);
+            inFlight_.erase(std::find(inFlight_.begin(), inFlight_.end(), &entry));
+            count(entry, -1);
+
+            // kept for the next start, whoever waits for its paths goes on
+            if (outcome == Failed)
+                failed_.emplace(entry.seq_, std::move(entry));
+
+            // everything up to the oldest entry still queued, running or failed is applied
+            uint64_t applied = durable_;
+            if (!queue_.empty())
+                applied = std::min(applied, queue_.front().seq_ - 1);
+            if (!replaying_.empty())
+                applied = std::min(applied, *replaying_.begin() - 1);
+            if (!failed_.empty())
+                applied = std::min(applied, failed_.begin()->first - 1);
+            applied_ = std::max(applied_, applied);
+
+            const bool idle = queue_.empty() && replaying_.empty();
+            if (idle || applied_ >= checkpointed_ + CHECKPOINT_INTERVAL)
+            {
+                lock.unlock();
+                checkpoint();
+                lock.lock();
+            }
+
+            cond_.notify_all();
+            done_.notify_all();
+        }
+    }
+
+    // first queued entry not depending on an earlier one, called under the lock
+    std::deque<Entry>::iterator runnable()
+    {
+        const auto end = queue_.size() > WINDOW ? queue_.begin() + WINDOW : queue_.end();
+        for (auto it = queue_.begin(); it != end; ++it)
+        {
+            bool blocked = false;
+            for (const auto* e : inFlight_)
+                blocked = blocked || conflicts(*it, *e);
+            for (auto before = queue_.begin(); !blocked && before != it; ++before)
+                blocked = conflicts(*it, *before);
+
+            if (!blocked)
+                return it;
+        }
+        return queue_.end();
+    }
+
+    static bool conflicts(const Entry& l, const Entry& r)
+    {
+        return related(l.path_, r.path_) ||
+            (twoPaths(l) && related(l.other_, r.path_)) ||
+            (twoPaths(r) && related(l.path_, r.other_)) ||
+            (twoPaths(l) && twoPaths(r) && related(l.other_, r.other_));
+    }
+
+    static bool twoPaths(const Entry& e)
+    {
+        return e.op_ == Rename || e.op_ == Link;
+    }
+
+    // one is the other or an ancestor of it
+    static bool related(const std::string& a, const std::string& b)
+    {
+        const auto& shorter = a.size() < b.size() ? a : b;
+        const auto& longer = a.size() < b.size() ? b : a;
+        return longer.compare(0, shorter.size(), shorter) == 0 &&
+            (longer.size() == shorter.size() || longer[shorter.size()] == '/');
+    }
+
+    Outcome apply(const Entry& e)
+    {
+        for (unsigned attempt = 0; ; )
+        {
+            source_->hold();
+
+            const int res = execute(e);
+            if (!res)
+                return Applied;
+
+            // refused while the source is unavailable, waits for it without using up an attempt
+            if (res == -EHOSTDOWN)
+            {
+                std::unique_lock<std::mutex> lock(lock_);
+                if (!running_)
+                    return Stopped;
+            }
+            else if (!(Source::unavailable(res) || res == -EAGAIN) || attempt++ >= RETRIES)
+            {
+                LOG(Error) << "journal replay of '" << e.path_ << "' (op " << static_cast<int>(e.op_)
+                           << ", entry " << e.seq_ << ") failed: " << strerror(-res) << ", kept for the next start";
+                return Failed;
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(100 << std::min(attempt, 6u)));
+        }
+    }
+
+    int execute(const Entry& e)
+    {
+        int res = 0;
+        switch (e.op_)
+        {
+        case Mkdir:
+            res = source_->mkdir(e.path_.c_str(), e.mode_);
+            return res == -EEXIST ? 0 : res;
+        case Unlink:
+            res = source_->unlink(e.path_.c_str());
+            return res == -ENOENT ? 0 : res;
+        case Rmdir:
+            res = source_->rmdir(e.path_.c_str());
+            return res == -ENOENT ? 0 : res;
+        case Symlink:
+            res = source_->symlink(e.other_.c_str(), e.path_.c_str());
+            return res == -EEXIST ? 0 : res;
+        case Rename:
+            res = source_->rename(e.path_.c_str(), e.other_.c_str());
+            if (res == -ENOENT)
+            {
+                // replayed already if the source is gone and the target exists; with both gone
+                // there is nothing left to move, holding the checkpoint back would not change that
+                struct stat st;
+                res = source_->lstat(e.other_.c_str(), &st);
+                if (res == -ENOENT)
+                {
+                    LOG(Warning) << "journal replay of rename '" << e.path_ << "' to '" << e.other_ << "' (entry " << e.seq_
+                                 << ") found neither on the source, counted as applied";
+                    return 0;
+                }
+            }
+            return res;
+        case Link:
+            res = source_->link(e.path_.c_str(), e.other_.c_str());
+            return res == -EEXIST ? 0 : res;
+        case Chmod:
+            return source_->chmod(e.path_.c_str(), e.mode_);
+        case Chown:
+            return source_->chown(e.path_.c_str(), e.uid_, e.gid_);
+        case Create:
+            // never truncate on replay, the content arrives with the push
+            return source_->create(e.path_.c_str(), e.flags_ & ~(O_TRUNC | O_EXCL), e.mode_);
+        }
+        return -EINVAL;
+    }
+
+    void checkpoint()
+    {
+        std::unique_lock<std::mutex> lock(checkpointLock_);
+
+        uint64_t applied;
+        bool empty;
+        {
+            std::unique_lock<std::mutex> state(lock_);
+            applied = applied_;
+            empty = applied_ == last_ && !writing_;
+        }
+
+        if (applied != checkpointed_)
+        {
+            if (pwrite(checkpointFd_, &applied, sizeof(applied), 0) != sizeof(applied) || fdatasync(checkpointFd_) == -1)
+            {
+                LOG(Error) << "journal checkpoint failed: " << strerror(errno);
+                return;
+            }
+            checkpointed_ = applied;
+
+            // the records are all covered by the checkpoint now, made durable with the next one
+            if (recorded_ <= applied && recordsEnd_ > static_cast<off_t>(sizeof(applied)) && ftruncate(checkpointFd_, sizeof(applied)) == 0)
+                recordsEnd_ = sizeof(applied);
+        }
+
+        if (!empty)
+            return;
+
+        // everything is replayed, the journal can start over (sequence numbers keep growing)
+        std::unique_lock<std::mutex> state(lock_);
+        if (applied_ == last_ && !writing_ && buffer_.empty())
+        {
+            struct stat st;
+            if (fstat(fd_, &st) == 0 && st.st_size > COMPACT_SIZE && ftruncate(fd_, 0) == -1)
+            {
+                LOG(Error) << "journal truncation failed: " << strerror(errno);
+            }
+        }
+    }
+
+    // makes it known across a restart that the entry was replayed, so it is not replayed again;
+    // without the record it is, the "already done" results cover that as well as they can
+    void record(uint64_t seq)
+    {
+        std::unique_lock<std::mutex> lock(checkpointLock_);
+        if (pwrite(checkpointFd_, &seq, sizeof(seq), recordsEnd_) != sizeof(seq) || fdatasync(checkpointFd_) == -1)
+        {
+            LOG(Error) << "failed to record replay of journal entry " << seq << ": " << strerror(errno);
+            return;
+        }
+        recordsEnd_ += sizeof(seq);
+        recorded_ = std::max(recorded_, seq);
+    }
+
+    // keeps the number of pending entries per path, called under the lock
+    void count(const Entry& e, int delta)
+    {
+        count(e.path_, delta);
+        if (twoPaths(e))
+            count(e.other_, delta);
+    }
+
+    void count(const std::string& path, int delta)
+    {
+        auto& pending = pending_[path];
+        pending += delta;
+        if (!pending)
+            pending_.erase(path);
+    }
+
+    bool touched(const std::string& path) const
+    {
+        if (pending_.empty())
+            return false;
+
+        for (std::size_t end = path.size(); end != 0 && end != std::string::npos; end = path.rfind('/', end - 1))
+            if (pending_.count(path.substr(0, end)))
+                return true;
+        return false;
+    }
+
+private:
+    // how far replay may look ahead for an independent entry
+    static const std::size_t WINDOW = 64;
+    // entries replayed between checkpoints, their records pile up until one covers them all
+    static const uint64_t CHECKPOINT_INTERVAL = 256;
+    static const off_t COMPACT_SIZE = 16 * 1024 * 1024;
+    static const unsigned RETRIES = 10;
+
+    const std::size_t workers_;
+    const Source::Ptr source_;
+    const boost::filesystem::path file_;
+    const boost::filesystem::path checkpointFile_;
+    int fd_;
+    int checkpointFd_;
+
+    std::mutex lock_;
+    std::condition_variable cond_;
+    std::condition_variable commit_;
+    std::condition_variable done_;
+    bool running_;
+    bool writing_;
+
+    uint64_t last_;         // last sequence number handed out
+    uint64_t durable_;      // entries up to this one are on disk
+    uint64_t applied_;      // entries up to this one are replayed
+    std::map<uint64_t, WriteFailure> writeFailures_;    // by the first sequence number of the batch
+
+    std::vector<char> buffer_;          // encoded entries waiting for the next write
+    std::deque<Entry> unsynced_;        // the same entries, to be queued once they are durable
+    std::deque<Entry> queue_;           // durable entries waiting for replay
+    std::set<uint64_t> replaying_;
+    std::vector<const Entry*> inFlight_;
+    std::map<uint64_t, Entry> failed_;  // replay failed for good, held until the next start
+    boost::unordered_map<std::string, std::size_t> pending_;
+
+    std::mutex checkpointLock_;
+    uint64_t checkpointed_;
+    uint64_t recorded_;         // the newest entry recorded as replayed after the checkpoint
+    off_t recordsEnd_;
+
+    std::vector<std::unique_ptr<Histogram>> latency_;
+    std::vector<std::thread> threads_;
+};
+
+// Source whose metadata operations are journaled and acknowledged as soon as the journal
+// entry is durable; everything else goes straight to the wrapped source.
+class WriteBackSource : public Source
+{
+public:
+    WriteBackSource(const Source::Ptr& source, Journal& journal)
+        : source_(source)
+        , journal_(journal)
+    {
+    }
+
+    void hold() override { source_->hold(); }
+    int lstat(const char* path, struct stat* st) override { return source_->lstat(path, st); }
+    int access(const char* path, int mask) override { return source_->access(path, mask); }
+    int readlink(const char* path, char* buf, size_t size) override { return source_->readlink(path, buf, size); }
+    int list(const char* path, std::vector<DirEntry>& entries) override { return source_->list(path, entries); }
+
+    int fetch(const char* path, const boost::filesystem::path& local) override
+    {
+        return source_->fetch(path, local);
+    }
+
+    int push(const boost::filesystem::path& local, const char* path, struct stat* pushed, const Cancelled& cancelled) override
+    {
+        return source_->push(local, path, pushed, cancelled);
+    }
+
+    int patch(const boost::filesystem::path& local, const char* path, const std::vector<Extent>& extents, off_t shrink,
+              struct stat* pushed, const Cancelled& cancelled) override
+    {
+        return source_->patch(local, path, extents, shrink, pushed, cancelled);
+    }
+
+    int fsync(const char* path, bool data) override
+    {
+        return source_->fsync(path, data);
+    }
+
+    int mkdir(const char* path, mode_t mode) override
+    {
+        return append(Journal::Mkdir, path, nullptr, mode);
+    }
+
+    int unlink(const char* path) override
+    {
+        return append(Journal::Unlink, path);
+    }
+
+    int rmdir(const char* path) override
+    {
+        return append(Journal::Rmdir, path);
+    }
+
+    int symlink(const char* target, const char* path) override
+    {
+        return append(Journal::Symlink, path, target);
+    }
+
+    int rename(const char* from, const char* to) override
+    {
+        return append(Journal::Rename, from, to);
+    }
+
+    int link(const char* from, const char* to) override
+    {
+        return append(Journal::Link, from, to);
+    }
+
+    int chmod(const char* path, mode_t mode) override
+    {
+        return append(Journal::Chmod, path, nullptr, mode);
+    }
+
+    int chown(const char* path, uid_t uid, gid_t gid) override
+    {
+        Journal::Entry e;
+        e.op_ = Journal::Chown;
+        e.path_ = path;
+        e.uid_ = uid;
+        e.gid_ = gid;
+        return journal_.append(std::move(e));
+    }
+
+    int create(const char* path, int flags, mode_t mode) override
+    {
+        Journal::Entry e;
+        e.op_ = Journal::Create;
+        e.path_ = path;
+        e.flags_ = flags;
+        e.mode_ = mode;
+        return journal_.append(std::move(e));
+    }
+
+private:
+    int append(Journal::Op op, const char* path, const char* other = nullptr, mode_t mode = 0)
+    {
+        Journal::Entry e;
+        e.op_ = op;
+        e.path_ = path;
+        if (other)
+            e.other_ = other;
+        e.mode_ = mode;
+        return journal_.append(std::move(e));
+    }
+
+private:
+    const Source::Ptr source_;
+    Journal& journal_;
+};
@@ -0,0 +1,430 @@
+#pragma once
+
+#include "Logger.h"
+#include "Stats.h"
+#include "Source.h"
+#include "PathSet.h"
+#include "TreeCopier.h"
+#include "Journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <string>
+#include <vector>
+#include <set>
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+
+#include <boost/filesystem.hpp>
+
+// Materializes the read-write subtree in the cache one directory at a time.
+//
+// A directory is materialized when it is first touched: its subdirectories are created
+// empty (and materialized on their own later), symlinks are copied and regular files get
+// sparse placeholders ("stubs") with the size, mode and times of the source file. The
+// content of a stub is fetched when the file is first opened or read.
+//
+// The state lives in extended attributes of the cached entries, so it survives restarts;
+// the in-memory set of complete paths only saves the getxattr calls and the lock, so
+// operations on a materialized directory take no locks and allocate nothing. Without xattr support in the cache
+// directory the whole subtree is copied eagerly on first access instead, which can also be
+// requested explicitly with 'preload'.
+class LazyTree
+{
+    enum State { Unknown, Complete, Stub };
+
+public:
+    // empties the local file, returns 0 or -errno
+    typedef std::function<int()> Truncate;
+
+    LazyTree(const Source::Ptr& source,
+             const boost::filesystem::path& cache,
+             const std::string& root,
+             bool preload,
+             std::size_t copyThreads,
+             Journal* journal)
+        : source_(source)
+        , cache_(cache)
+        , root_(root)
+        , temp_(cache / ".cachefs" / "tmp")
+        , preload_(preload)
+        , copyThreads_(copyThreads)
+        , journal_(journal)
+        , lazy_(true)
+        , ready_(false)
+    {
+        boost::system::error_code ignore;
+        boost::filesystem::create_directories(temp_, ignore);
+
+        if (setxattr(temp_.c_str(), XATTR_COMPLETE, "1", 1, 0) == -1)
+        {
+            LOG(Warning) << "cache dir does not support extended attributes (" << strerror(errno)
+                         << "), read-write subtree '" << root_ << "' will be copied eagerly";
+            lazy_ = false;
+        }
+    }
+
+    // materializes the directory containing 'path'
+    int parent(const char* path)
+    {
+        if (root_ == path)
+            return ensureRoot();
+
+        return directory(path, strrchr(path, '/') - path);
+    }
+
+    int directory(const char* dir)
+    {
+        return directory(dir, strlen(dir));
+    }
+
+    // materializes the directory and all its ancestors up to the root
+    int directory(const char* dir, std::size_t size)
+    {
+        int res = ensureRoot();
+        if (res || !lazy_)
+            return res;
+
+        // ancestors are always materialized before their children
+        if (complete_.contains(dir, size))
+            return 0;
+
+        std::size_t end = root_.size();
+        while (true)
+        {
+            res = populate(std::string(dir, end));
+            if (res || end >= size)
+                return res;
+
+            const void* next = memchr(dir + end + 1, '/', size - end - 1);
+            end = next ? static_cast<const char*>(next) - dir : size;
+        }
+    }
+
+    // makes sure the content of a stub is present, the parent has to be materialized already
+    int content(const char* path)
+    {
+        if (!lazy_ || complete_.contains(path, strlen(path)))
+            return 0;
+
+        std::unique_lock<std::mutex> lock(lock_);
+        wait(lock, path);
+
+        if (state(path, false) != Stub)
+            return 0;
+
+        busy_.insert(path);
+        lock.unlock();
+
+        const int res = fetch(path);
+
+        lock.lock();
+        busy_.erase(path);
+        if (!res)
+            complete_.insert(path, strlen(path));
+        cond_.notify_all();
+        return res;
+    }
+
+    // runs 'truncate' on a file that is complete without fetching anything once it is empty
+    // (created or truncated to zero); a fetch of the same path in progress finishes first, and
+    // the file stays a stub unless 'truncate' succeeds
+    int own(const char* path, const Truncate& truncate)
+    {
+        if (!lazy_ || complete_.contains(path, strlen(path)))
+            return truncate();
+
+        std::unique_lock<std::mutex> lock(lock_);
+        wait(lock, path);
+
+        busy_.insert(path);
+        lock.unlock();
+
+        int res = truncate();
+        if (!res && removexattr((cache_ / path).c_str(), XATTR_STUB) == -1 && errno != ENODATA)
+            res = -errno;
+
+        lock.lock();
+        busy_.erase(path);
+        if (!res)
+            complete_.insert(path, strlen(path));
+        cond_.notify_all();
+        return res;
+    }
+
+    // the directory was created locally, so there is nothing to populate
+    void created(const char* path)
+    {
+        if (!lazy_)
+            return;
+
+        setxattr((cache_ / path).c_str(), XATTR_COMPLETE, "1", 1, 0);
+        complete_.insert(path, strlen(path));
+    }
+
+    // the entry moved or disappeared, its state (and the state of everything under a directory) is reloaded from xattrs
+    void forget(const char* path, bool directory)
+    {
+        if (directory)
+            complete_.eraseTree(path);
+        else
+            complete_.erase(path);
+    }
+
+private:
+    int ensureRoot()
+    {
+        if (ready_.load(std::memory_order_acquire))
+            return 0;
+
+        std::unique_lock<std::mutex> lock(lock_);
+        if (ready_)
+            return 0;
+
+        const auto dest = cache_ / root_;
+        if (!lazy_)
+        {
+            // no way to keep track of stubs, copy everything
+            int res = 0;
+            if (!boost::filesystem::exists(dest))
+                res = TreeCopier(source_, temp_, copyThreads_).copy(root_, dest);
+            ready_.store(!res, std::memory_order_release);
+            return res;
+        }
+
+        if (preload_ && state(root_, true) != Complete)
+        {
+            // resumes an interrupted preload, directories are marked complete bottom up
+            int res = TreeCopier(source_, temp_, copyThreads_, [](const boost::filesystem::path& dir){
+                setxattr(dir.c_str(), XATTR_COMPLETE, "1", 1, 0);
+            }).copy(root_, dest);
+            if (res)
+                return res;
+        }
+
+        if (!boost::filesystem::exists(dest))
+        {
+            struct stat st;
+            int res = source_->lstat(root_.c_str(), &st);
+            if (res)
+                return res;
+
+            boost::system::error_code error;
+            boost::filesystem::create_directories(dest, error);
+            if (error)
+                return -error.value();
+
+            ::chmod(dest.c_str(), st.st_mode & 07777);
+        }
+
+        ready_.store(true, std::memory_order_release);
+        return 0;
+    }
+
+    void wait(std::unique_lock<std::mutex>& lock, const std::string& path)
+    {
+        while (busy_.count(path))
+            cond_.wait(lock);
+    }
+
+    State state(const std::string& path, bool directory)
+    {
+        if (complete_.contains(path))
+            return Complete;
+
+        char value;
+        const auto cached = (cache_ / path).string();
+        State state = Unknown;
+        if (directory)
+            state = getxattr(cached.c_str(), XATTR_COMPLETE, &value, 1) == -1 ? Unknown : Complete;
+        else
+            state = getxattr(cached.c_str(), XATTR_STUB, &value, 1) == -1 ? Complete : Stub;
+
+        if (state == Complete)
+            complete_.insert(path);
+        return state;
+    }
+
+    int populate(const std::string& dir)
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        wait(lock, dir);
+
+        if (state(dir, true) == Complete)
+            return 0;
+
+        busy_.insert(dir);
+        lock.unlock();
+
+        const int res = populateDirectory(dir);
+
+        lock.lock();
+        busy_.erase(dir);
+        if (!res)
+            complete_.insert(dir);
+        cond_.notify_all();
+        return res;
+    }
+
+    int populateDirectory(const std::string& dir)
+    {
+        LOG(Debug) << "materializing '" << dir << "'";
+        Stats::miss();
+
+        const auto dest = cache_ / dir;
+
+        // the source directory may still be on its way there
+        if (journal_)
+            journal_->waitFor(dir);
+
+        std::vector<DirEntry> entries;
+        int res = source_->list(dir.c_str(), entries);
+        if (res)
+            return res;
+
+        for (const auto& entry : entries)
+        {
+            if (entry.name_ == "." || entry.name_ == "..")
+                continue;
+
+            const auto path = dir + "/" + entry.name_;
+            const auto dst = dest / entry.name_;
+
+            // anything existing locally was created or materialized earlier and wins
+            struct stat local;
+            if (::lstat(dst.c_str(), &local) == 0)
+                continue;
+
+            struct stat st;
+            res = source_->lstat(path.c_str(), &st);
+            if (res == -ENOENT)
+                continue;
+            if (res)
+                return res;
+
+            res = create(path, dst, st);
+            if (res)
+                return res;
+        }
+
+        if (setxattr(dest.c_str(), XATTR_COMPLETE, "1", 1, 0) == -1)
+            return -errno;
+
+        return 0;
+    }
+
+    // creates the local counterpart of a source entry, a stub for regular files
+    int create(const std::string& path, const boost::filesystem::path& dst, const struct stat& st)
+    {
+        if (S_ISDIR(st.st_mode))
+        {
+            if (::mkdir(dst.c_str(), st.st_mode & 07777) == -1)
+                return -errno;
+        }
+        else if (S_ISLNK(st.st_mode))
+        {
+            int res = symlink(path, dst, st);
+            if (res)
+                return res;
+        }
+        else if (S_ISREG(st.st_mode))
+        {
+            const int fd = ::open(dst.c_str(), O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 07777);
+            if (fd == -1)
+                return -errno;
+
+            int res = 0;
+            if (ftruncate(fd, st.st_size) == -1 || fsetxattr(fd, XATTR_STUB, "1", 1, 0) == -1)
+                res = -errno;
+            close(fd);
+
+            if (res)
+            {
+                ::unlink(dst.c_str());
+                return res;
+            }
+        }
+        else
+        {
+            // devices, fifos and sockets are not mirrored into the cache
+            return 0;
+        }
+
+        const struct timespec times[2] = { st.st_atim, st.st_mtim };
+        utimensat(AT_FDCWD, dst.c_str(), times, AT_SYMLINK_NOFOLLOW);
+        return 0;
+    }
+
+    int symlink(const std::string& path, const boost::filesystem::path& dst, const struct stat& st)
+    {
+        std::vector<char> target(st.st_size + 1);
+        int res = source_->readlink(path.c_str(), target.data(), target.size());
+        if (res < 0)
+            return res;
+
+        return ::symlink(std::string(target.data(), res).c_str(), dst.c_str()) == -1 ? -errno : 0;
+    }
+
+    int fetch(const char* path)
+    {
+        LOG(Info) << "read-write fetch '" << path << "'";
+        Stats::miss();
+
+        const auto cached = cache_ / path;
+        const auto temp = temp_ / boost::filesystem::unique_path();
+
+        if (journal_)
+            journal_->waitFor(path);
+
+        struct stat st;
+        int res = source_->lstat(path, &st);
+        if (!res)
+            res = source_->fetch(path, temp);
+
+        if (!res)
+        {
+            const struct timespec times[2] = { st.st_atim, st.st_mtim };
+            ::chmod(temp.c_str(), st.st_mode & 07777);
+            utimensat(AT_FDCWD, temp.c_str(), times, 0);
+            baseline::save(temp, st);
+
+            if (::rename(temp.c_str(), cached.c_str()) == -1)
+                res = -errno;
+        }
+
+        if (res)
+        {
+            ::unlink(temp.c_str());
+            return res;
+        }
+
+        Stats::add(Stats::Fills, 1);
+        Stats::add(Stats::SourceBytes, st.st_size);
+        return 0;
+    }
+
+private:
+    static constexpr const char* XATTR_STUB = "user.cachefs.stub";
+    static constexpr const char* XATTR_COMPLETE = "user.cachefs.complete";
+
+    const Source::Ptr source_;
+    const boost::filesystem::path cache_;
+    const std::string root_;
+    const boost::filesystem::path temp_;
+    const bool preload_;
+    const std::size_t copyThreads_;
+    Journal* const journal_;
+
+    bool lazy_;
+    std::atomic<bool> ready_;
+
+    std::mutex lock_;
+    std::condition_variable cond_;
+    std::set<std::string> busy_;
+    PathSet complete_;
+};
@@ -1,36 +1,392 @@
-#include <iosfwd>
 #include "Logger.h"
 
+#include <time.h>
 #include <fstream>
+#include <sstream>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+#include <condition_variable>
 
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/date_time/posix_time/time_formatters.hpp>
+#include <boost/date_time/c_local_time_adjustor.hpp>
 
-class FileHolder
+namespace
+{
+
+#pragma pack(push, 1)
+struct Header
+{
+    uint32_t size_;     // payload size
+    uint64_t time_;     // CLOCK_REALTIME, microseconds
+    uint16_t thread_;
+    uint8_t level_;
+};
+#pragma pack(pop)
+
+// single producer, single consumer byte ring
+class Ring
+{
+public:
+    static const std::size_t SIZE = 256 * 1024;
+
+    Ring(uint16_t thread)
+        : thread_(thread)
+        , head_(0)
+        , tail_(0)
+    {
+    }
+
+    bool push(const Header& header, const char* payload)
+    {
+        const auto total = sizeof(header) + header.size_;
+        const auto head = head_.load(std::memory_order_relaxed);
+        const auto tail = tail_.load(std::memory_order_acquire);
+        if (SIZE - (head - tail) < total)
+            return false;
+
+        copyIn(head, reinterpret_cast<const char*>(&header), sizeof(header));
+        copyIn(head + sizeof(header), payload, header.size_);
+        head_.store(head + total, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(Header& header, std::vector<char>& payload)
+    {
+        const auto tail = tail_.load(std::memory_order_relaxed);
+        const auto head = head_.load(std::memory_order_acquire);
+        if (head == tail)
+            return false;
+
+        copyOut(tail, reinterpret_cast<char*>(&header), sizeof(header));
+        payload.resize(header.size_);
+        copyOut(tail + sizeof(header), payload.data(), header.size_);
+        tail_.store(tail + sizeof(header) + header.size_, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const
+    {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+
+    const uint16_t thread_;
+
+private:
+    void copyIn(std::size_t pos, const char* data, std::size_t size)
+    {
+        const auto offset = pos % SIZE;
+        const auto first = std::min(size, SIZE - offset);
+        memcpy(buffer_ + offset, data, first);
+        memcpy(buffer_, data + first, size - first);
+    }
+
+    void copyOut(std::size_t pos, char* data, std::size_t size) const
+    {
+        const auto offset = pos % SIZE;
+        const auto first = std::min(size, SIZE - offset);
+        memcpy(data, buffer_ + offset, first);
+        memcpy(data + first, buffer_, size - first);
+    }
+
+private:
+    std::atomic<std::size_t> head_;
+    std::atomic<std::size_t> tail_;
+    char buffer_[SIZE];
+};
+
+class Writer
 {
 public:
-    FileHolder()
+    Writer()
+        : running_(true)
+        , overflows_(0)
+        , written_(0)
+        , requested_(0)
+        , threads_(0)
     {
         ofs_.open("/tmp/cachefs.log", std::ios::binary);
         if (!ofs_.is_open())
             throw std::runtime_error("failed to open log");
     }
 
-    std::ostream& get()
+    ~Writer()
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        running_ = false;
+        if (!thread_.joinable())
+        {
+            drain(rings_);
+            return;
+        }
+        lock.unlock();
+
+        cond_.notify_all();
+        thread_.join();
+    }
+
+    void start()
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        if (!thread_.joinable())
+            thread_ = std::thread(std::bind(&Writer::run, this));
+    }
+
+    // ring of the calling thread, the writer keeps it alive until it is drained
+    Ring& ring()
+    {
+        thread_local std::shared_ptr<Ring> ring = add();
+        return *ring;
+    }
+
+    void overflow()
+    {
+        overflows_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t overflows() const
     {
-        return ofs_;
+        return overflows_.load(std::memory_order_relaxed);
+    }
+
+    void flush()
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        if (!thread_.joinable())
+        {
+            // nobody else drains the rings before 'start'
+            drain(rings_);
+            return;
+        }
+
+        const auto target = ++requested_;
+        cond_.notify_all();
+        while (written_ < target && running_)
+            flushed_.wait(lock);
+    }
+
+private:
+    std::shared_ptr<Ring> add()
+    {
+        const auto ring = std::make_shared<Ring>(threads_++);
+        std::unique_lock<std::mutex> lock(lock_);
+        rings_.push_back(ring);
+        return ring;
+    }
+
+    void run()
+    {
+        while (true)
+        {
+            // taken per round, a snapshot kept across rounds would keep every ring alive
+            std::vector<std::shared_ptr<Ring>> rings;
+            uint64_t requested;
+            bool running;
+            {
+                std::unique_lock<std::mutex> lock(lock_);
+                if (running_ && requested_ == written_)
+                    cond_.wait_for(lock, std::chrono::milliseconds(10));
+
+                // rings of exited threads are dropped once drained
+                rings_.erase(std::remove_if(rings_.begin(), rings_.end(), [](const std::shared_ptr<Ring>& r){
+                    return r.use_count() == 1 && r->empty();
+                }), rings_.end());
+
+                rings = rings_;
+                requested = requested_;
+                running = running_;
+            }
+
+            drain(rings);
+
+            {
+                std::unique_lock<std::mutex> lock(lock_);
+                written_ = requested;
+            }
+            flushed_.notify_all();
+
+            if (!running)
+                break;
+        }
+    }
+
+    // the only consumer of the rings
+    void drain(const std::vector<std::shared_ptr<Ring>>& rings)
+    {
+        bool any = false;
+        for (const auto& ring : rings)
+        {
+            Header header;
+            while (ring->pop(header, payload_))
+            {
+                format(header, payload_);
+                any = true;
+            }
+        }
+
+        if (any)
+            ofs_.flush();
+    }
+
+    void format(const Header& header, const std::vector<char>& payload)
+    {
+        static const char* levels[] = { "TRACE", "DEBUG", "INFO", "WARN", "ERROR" };
+
+        const auto time = boost::posix_time::from_time_t(header.time_ / 1000000) +
+                          boost::posix_time::microseconds(header.time_ % 1000000);
+        const auto local = boost::date_time::c_local_adjustor<boost::posix_time::ptime>::utc_to_local(time);
+
+        ofs_ << "[" << boost::posix_time::to_iso_extended_string(local) << "] "
+             << levels[std::min<std::size_t>(header.level_, 4)] << " " << header.thread_ << ": ";
+
+        std::size_t pos = 0;
+        while (pos < payload.size())
+        {
+            const auto tag = static_cast<Logger::Tag>(payload[pos++]);
+            switch (tag)
+            {
+            case Logger::String:
+            {
+                uint16_t len;
+                memcpy(&len, payload.data() + pos, sizeof(len));
+                ofs_.write(payload.data() + pos + sizeof(len), len);
+                pos += sizeof(len) + len;
+                break;
+            }
+            case Logger::Signed:
+            {
+                int64_t v;
+                memcpy(&v, payload.data() + pos, sizeof(v));
+                ofs_ << v;
+                pos += sizeof(v);
+                break;
+            }
+            case Logger::Unsigned:
+            {
+                uint64_t v;
+                memcpy(&v, payload.data() + pos, sizeof(v));
+                ofs_ << v;
+                pos += sizeof(v);
+                break;
+            }
+            case Logger::Double:
+            {
+                double v;
+                memcpy(&v, payload.data() + pos, sizeof(v));
+                ofs_ << v;
+                pos += sizeof(v);
+                break;
+            }
+            case Logger::Char:
+                ofs_ << payload[pos++];
+                break;
+            case Logger::Bool:
+                ofs_ << (payload[pos++] ? "true" : "false");
+                break;
+            default:
+                pos = payload.size();
+                break;
+            }
+        }
+
+        ofs_ << "\n";
     }
 
 private:
     std::ofstream ofs_;
+    std::vector<char> payload_;
+
+    std::mutex lock_;
+    std::condition_variable cond_;
+    std::condition_variable flushed_;
+    std::vector<std::shared_ptr<Ring>> rings_;
+    bool running_;
+
+    std::atomic<uint64_t> overflows_;
+    uint64_t written_;
+    uint64_t requested_;
+    std::atomic<uint16_t> threads_;
+
+    std::thread thread_;
 };
 
+Writer& writer()
+{
+    static Writer writer;
+    return writer;
+}
+
+} // namespace
+
+Logger::Record::Record(Level level, Site& site)
+    : level_(level)
+    , size_(0)
+{
+    uint32_t suppressed;
+    active_ = site.admit(suppressed);
+    if (!active_)
+        return;
+
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    time_ = static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+
+    if (suppressed)
+        *this << "(" << suppressed << " similar records suppressed) ";
+}
+
+Logger::Record::~Record()
+{
+    if (!active_)
+        return;
+
+    Header header;
+    header.size_ = static_cast<uint32_t>(size_);
+    header.time_ = time_;
+    header.level_ = level_;
+
+    auto& w = writer();
+    auto& ring = w.ring();
+    header.thread_ = ring.thread_;
+    if (!ring.push(header, data_))
+        w.overflow();
+}
+
+bool Logger::parseLevel(const std::string& name, Level& level)
+{
+    static const char* names[] = { "trace", "debug", "info", "warning", "error", "off" };
+    for (uint8_t i = 0; i <= Off; ++i)
+    {
+        if (name == names[i])
+        {
+            level = static_cast<Level>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t Logger::overflows()
+{
+    return writer().overflows();
+}
+
+void Logger::start()
+{
+    writer().start();
+}
+
+void Logger::flush()
+{
+    writer().flush();
+}
 
-std::ostream& Logger::instance()
+uint32_t Logger::coarseSeconds()
 {
-    static FileHolder file;
-    return file.get()
-        << "["
-        << boost::posix_time::to_iso_extended_string(boost::posix_time::microsec_clock::local_time())
-        << "]: ";
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return static_cast<uint32_t>(ts.tv_sec);
 }
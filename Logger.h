@@ -1,7 +1,194 @@
 #pragma once
 
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <atomic>
+#include <ostream>
+#include <type_traits>
+
+// Asynchronous logger. A LOG() statement encodes its arguments into a binary record
+// which goes to a lock-free ring owned by the calling thread; a background writer
+// drains the rings, formats the records and writes them to /tmp/cachefs.log.
+// When the level is disabled the statement costs one relaxed atomic load.
+//
+// The writer thread is started by 'start', once fuse has forked to daemonize; records
+// logged before that wait in the rings.
 class Logger
 {
 public:
-    static std::ostream& instance();
+    enum Level : uint8_t { Trace, Debug, Info, Warning, Error, Off };
+
+    static bool enabled(Level level)
+    {
+        return level >= threshold().load(std::memory_order_relaxed);
+    }
+
+    static void setLevel(Level level)
+    {
+        threshold().store(level, std::memory_order_relaxed);
+    }
+
+    static bool parseLevel(const std::string& name, Level& level);
+
+    // maximum number of records per second a single LOG() statement may produce
+    static void setRateLimit(uint32_t perSecond)
+    {
+        rateLimit().store(perSecond, std::memory_order_relaxed);
+    }
+
+    // records dropped because the thread ring was full
+    static uint64_t overflows();
+
+    static void start();
+
+    // waits until everything logged so far is written out
+    static void flush();
+
+    // state of a single LOG() statement
+    class Site
+    {
+    public:
+        Site() : window_(0), count_(0), dropped_(0) {}
+
+        // returns false if the statement exceeded its rate in the current second,
+        // otherwise the number of records suppressed in the previous one goes to 'suppressed'
+        bool admit(uint32_t& suppressed)
+        {
+            const auto limit = rateLimit().load(std::memory_order_relaxed);
+            const auto now = coarseSeconds();
+
+            suppressed = 0;
+            if (window_.load(std::memory_order_relaxed) != now)
+            {
+                window_.store(now, std::memory_order_relaxed);
+                count_.store(0, std::memory_order_relaxed);
+                suppressed = dropped_.exchange(0, std::memory_order_relaxed);
+            }
+
+            if (limit && count_.fetch_add(1, std::memory_order_relaxed) >= limit)
+            {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            return true;
+        }
+
+    private:
+        std::atomic<uint32_t> window_;
+        std::atomic<uint32_t> count_;
+        std::atomic<uint32_t> dropped_;
+    };
+
+    enum Tag : uint8_t { String, Signed, Unsigned, Double, Char, Bool };
+
+    class Record
+    {
+    public:
+        Record(Level level, Site& site);
+        ~Record();
+
+        Record& operator<<(const char* value)
+        {
+            return string(value ? value : "(null)", value ? strlen(value) : 6);
+        }
+
+        Record& operator<<(const std::string& value)
+        {
+            return string(value.data(), value.size());
+        }
+
+        Record& operator<<(char value)
+        {
+            return put(Char, &value, sizeof(value));
+        }
+
+        Record& operator<<(bool value)
+        {
+            return put(Bool, &value, sizeof(value));
+        }
+
+        Record& operator<<(double value)
+        {
+            return put(Double, &value, sizeof(value));
+        }
+
+        template<typename T>
+        typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value, Record&>::type operator<<(T value)
+        {
+            const int64_t v = value;
+            return put(Signed, &v, sizeof(v));
+        }
+
+        template<typename T>
+        typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value, Record&>::type operator<<(T value)
+        {
+            const uint64_t v = value;
+            return put(Unsigned, &v, sizeof(v));
+        }
+
+        // records are line based, std::endl and friends are accepted and ignored
+        Record& operator<<(std::ostream& (*)(std::ostream&))
+        {
+            return *this;
+        }
+
+    private:
+        Record& string(const char* data, std::size_t size)
+        {
+            if (!active_)
+                return *this;
+
+            const auto room = CAPACITY - size_;
+            if (room <= 1 + sizeof(uint16_t))
+                return *this;
+
+            const uint16_t len = static_cast<uint16_t>(std::min(size, room - 1 - sizeof(uint16_t)));
+            data_[size_++] = String;
+            memcpy(data_ + size_, &len, sizeof(len));
+            memcpy(data_ + size_ + sizeof(len), data, len);
+            size_ += sizeof(len) + len;
+            return *this;
+        }
+
+        Record& put(Tag tag, const void* value, std::size_t size)
+        {
+            if (!active_ || size_ + 1 + size > CAPACITY)
+                return *this;
+
+            data_[size_++] = tag;
+            memcpy(data_ + size_, value, size);
+            size_ += size;
+            return *this;
+        }
+
+    public:
+        static const std::size_t CAPACITY = 1024;
+
+    private:
+        const Level level_;
+        uint64_t time_;
+        bool active_;
+        std::size_t size_;
+        char data_[CAPACITY];
+    };
+
+private:
+    static std::atomic<uint8_t>& threshold()
+    {
+        static std::atomic<uint8_t> level(Info);
+        return level;
+    }
+
+    static std::atomic<uint32_t>& rateLimit()
+    {
+        static std::atomic<uint32_t> limit(100);
+        return limit;
+    }
+
+    static uint32_t coarseSeconds();
 };
+
+#define LOG(level) \
+    if (!::Logger::enabled(::Logger::level)) {} \
+    else ::Logger::Record(::Logger::level, []() -> ::Logger::Site& { static ::Logger::Site site; return site; }())
@@ -0,0 +1,268 @@
+#pragma once
+
+#include "Logger.h"
+#include "Stats.h"
+#include "IoScheduler.h"
+
+#include <cstdint>
+#include <string>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+#include <boost/unordered_map.hpp>
+
+// Runs cache misses on workers of their own rather than on the threads asking for them.
+// At most 'threads' misses go to the source at once, so a burst of cold opens queues here
+// instead of occupying every FUSE thread, and a hit never waits for any of them.
+//
+// A miss is queued with the class of the thread asking (see IoScheduler::Scope) and the
+// highest class waiting starts first: a foreground open overtakes queued readahead and
+// preload. Misses for the same key are run once; a later request joins the pending one and
+// raises its class if it is higher. 'run' waits for the result, 'post' does not.
+//
+// The workers are spawned by 'start' once mounted, misses run on the thread asking before.
+class MissPipeline
+{
+public:
+    typedef std::function<int()> Work;
+
+    struct Settings
+    {
+        std::size_t threads_ = 16;      // misses running at once, 0 runs them on the thread asking
+    };
+
+    explicit MissPipeline(const Settings& settings)
+        : threads_(settings.threads_)
+        , running_(true)
+        , busy_(0)
+        , queued_(0)
+        , joined_(0)
+        , dropped_(0)
+        , started_(false)
+    {
+    }
+
+    // misses still queued fail with -ECANCELED, the running ones are waited for
+    ~MissPipeline()
+    {
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            running_ = false;
+        }
+        cond_.notify_all();
+        for (auto& w : workers_)
+            w.join();
+    }
+
+    void start()
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        if (!workers_.empty())
+            return;
+
+        for (std::size_t i = 0; i < threads_; ++i)
+            workers_.emplace_back(std::bind(&MissPipeline::worker, this));
+        started_ = !workers_.empty();
+    }
+
+    // runs 'work' unless a miss for 'key' is pending already and returns its result; an empty
+    // key is never shared
+    int run(const std::string& key, const Work& work)
+    {
+        if (!started_)
+            return work();
+
+        std::unique_lock<std::mutex> lock(lock_);
+        const auto miss = enqueue(key, work);
+        if (!miss)
+            return -ECANCELED;
+
+        while (!miss->done_)
+            miss->cond_.wait(lock);
+        return miss->result_;
+    }
+
+    // queues 'work' without waiting for it, false if it is dropped because too many are queued
+    bool post(const std::string& key, const Work& work)
+    {
+        if (!started_)
+        {
+            work();
+            return true;
+        }
+
+        std::unique_lock<std::mutex> lock(lock_);
+        if (queued_ >= MAX_QUEUED && !pending_.count(key))
+        {
+            ++dropped_;
+            return false;
+        }
+        return enqueue(key, work) != nullptr;
+    }
+
+    void collect(Stats::Snapshot& s) const
+    {
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            s.gauges_.emplace_back("miss_queued", queued_);
+            s.gauges_.emplace_back("miss_running", busy_);
+        }
+        s.gauges_.emplace_back("miss_joined", joined_.load(std::memory_order_relaxed));
+        s.gauges_.emplace_back("miss_dropped", dropped_.load(std::memory_order_relaxed));
+    }
+
+private:
+    struct Miss
+    {
+        std::string key_;
+        Work work_;
+        IoClass class_ = IoClass::Foreground;
+        bool started_ = false;
+        bool done_ = false;
+        int result_ = 0;
+        std::condition_variable cond_;
+    };
+
+    typedef std::shared_ptr<Miss> MissPtr;
+
+    static std::size_t rank(IoClass c)
+    {
+        return static_cast<std::size_t>(c);
+    }
+
+    // the pending miss for 'key' or a new one, null once stopped; called under the lock
+    MissPtr enqueue(const std::string& key, const Work& work)
+    {
+        if (!running_)
+            return nullptr;
+
+        const auto c = IoScheduler::current();
+        if (!key.empty())
+        {
+            const auto it = pending_.find(key);
+            if (it != pending_.end())
+            {
+                ++joined_;
+                const auto& miss = it->second;
+
+                // queued again in the higher class, the stale entry is skipped when popped
+                if (!miss->started_ && rank(c) < rank(miss->class_))
+                {
+                    miss->class_ = c;
+                    queues_[rank(c)].push_back(miss);
+                    cond_.notify_one();
+                }
+                return miss;
+            }
+        }
+
+        const auto miss = std::make_shared<Miss>();
+        miss->key_ = key;
+        miss->work_ = work;
+        miss->class_ = c;
+        if (!key.empty())
+            pending_.emplace(key, miss);
+
+        queues_[rank(c)].push_back(miss);
+        ++queued_;
+        cond_.notify_one();
+        return miss;
+    }
+
+    // the highest queued miss, null if none; called under the lock
+    MissPtr next()
+    {
+        for (std::size_t c = 0; c < IoScheduler::CLASS_COUNT; ++c)
+        {
+            auto& queue = queues_[c];
+            while (!queue.empty())
+            {
+                const auto miss = queue.front();
+                queue.pop_front();
+                if (!miss->started_ && rank(miss->class_) == c)
+                    return miss;
+            }
+        }
+        return nullptr;
+    }
+
+    // called under the lock
+    void finish(const MissPtr& miss, int result)
+    {
+        miss->done_ = true;
+        miss->result_ = result;
+        miss->work_ = Work();
+        if (!miss->key_.empty())
+            pending_.erase(miss->key_);
+        miss->cond_.notify_all();
+    }
+
+    void worker()
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        while (true)
+        {
+            MissPtr miss;
+            while (running_ && !(miss = next()))
+                cond_.wait(lock);
+
+            if (!running_)
+                break;
+
+            miss->started_ = true;
+            --queued_;
+            ++busy_;
+            lock.unlock();
+
+            int res = 0;
+            try
+            {
+                const IoScheduler::Scope scope(miss->class_);
+                res = miss->work_();
+            }
+            catch (const std::exception& e)
+            {
+                LOG(Error) << "cache miss '" << miss->key_ << "' failed: " << e.what();
+                res = -EIO;
+            }
+
+            lock.lock();
+            --busy_;
+            finish(miss, res);
+        }
+
+        // whatever is left never runs
+        while (const auto miss = next())
+        {
+            miss->started_ = true;
+            --queued_;
+            finish(miss, -ECANCELED);
+        }
+    }
+
+private:
+    static const std::size_t MAX_QUEUED = 4096;
+
+    const std::size_t threads_;
+
+    mutable std::mutex lock_;
+    std::condition_variable cond_;
+    bool running_;
+    std::deque<MissPtr> queues_[IoScheduler::CLASS_COUNT];
+    boost::unordered_map<std::string, MissPtr> pending_;
+    std::size_t busy_;
+    std::size_t queued_;
+
+    std::atomic<uint64_t> joined_;
+    std::atomic<uint64_t> dropped_;
+    std::atomic<bool> started_;
+
+    // last, they use everything above
+    std::vector<std::thread> workers_;
+};
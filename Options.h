@@ -0,0 +1,211 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+#include <iostream>
+
+#include <boost/filesystem.hpp>
+
+#include "Logger.h"
+#include "Source.h"
+#include "IoScheduler.h"
+#include "DirtyBudget.h"
+#include "Policy.h"
+#include "DirectoryScanner.h"
+#include "ResilientSource.h"
+#include "SharedStore.h"
+#include "MissPipeline.h"
+
+struct Options
+{
+    typedef std::function<void(const std::string&)> Setter;
+
+    // removes all '--name=value' arguments known to cachefs, the rest goes to fuse as is
+    bool parse(int& argc, char* argv[])
+    {
+        const auto setters = this->setters();
+
+        int out = 0;
+        for (int i = 0; i < argc; ++i)
+        {
+            const std::string arg = argv[i];
+            const auto eq = arg.find('=');
+            const auto it = eq == std::string::npos ? setters.end() : setters.find(arg.substr(0, eq));
+            if (it == setters.end())
+            {
+                argv[out++] = argv[i];
+                continue;
+            }
+
+            try
+            {
+                it->second(arg.substr(eq + 1));
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << "invalid value for '" << it->first << "': " << e.what() << std::endl;
+                return false;
+            }
+        }
+
+        argc = out;
+        return true;
+    }
+
+    // sets a single option given without the leading dashes, throws std::invalid_argument on errors
+    void set(const std::string& name, const std::string& value)
+    {
+        const auto setters = this->setters();
+        const auto it = setters.find("--" + name);
+        if (it == setters.end())
+            throw std::invalid_argument("unknown option '" + name + "'");
+
+        try
+        {
+            it->second(value);
+        }
+        catch (const std::exception& e)
+        {
+            throw std::invalid_argument("invalid value for '" + name + "': " + e.what());
+        }
+    }
+
+    std::map<std::string, Setter> setters()
+    {
+        std::map<std::string, Setter> setters;
+        setters["--trace"] = [this](const std::string& v){ traceFile_ = v; };
+        setters["--prefetch"] = [this](const std::string& v){ prefetchFile_ = v; };
+        setters["--policy"] = [this](const std::string& v){ policies_ = PolicyRule::load(v); };
+        setters["--prefetch-window"] = [this](const std::string& v){ prefetchWindow_ = std::stoul(v); };
+        setters["--log-level"] = [this](const std::string& v){
+            if (!Logger::parseLevel(v, logLevel_))
+                throw std::invalid_argument("unknown level");
+        };
+        setters["--log-rate"] = [this](const std::string& v){ logRate_ = std::stoul(v); };
+        setters["--source-latency-us"] = [this](const std::string& v){ slowSource_.latency_ = std::chrono::microseconds(std::stoul(v)); };
+        setters["--source-bandwidth"] = [this](const std::string& v){ slowSource_.bandwidth_ = std::stoull(v); };
+        setters["--rw-preload"] = [this](const std::string& v){ readWritePreload_ = parseBool(v); };
+        setters["--fill-threads"] = [this](const std::string& v){ misses_.threads_ = std::stoul(v); };
+        setters["--copy-threads"] = [this](const std::string& v){ copyThreads_ = std::stoul(v); };
+        setters["--push-threads"] = [this](const std::string& v){ pushThreads_ = std::stoul(v); };
+        setters["--write-back"] = [this](const std::string& v){ writeBack_ = parseBool(v); };
+        setters["--dirty-bytes"] = [this](const std::string& v){ dirtyLimit_.bytes_ = std::stoull(v); };
+        setters["--dirty-files"] = [this](const std::string& v){ dirtyLimit_.files_ = std::stoull(v); };
+        setters["--replay-threads"] = [this](const std::string& v){ replayThreads_ = std::stoul(v); };
+        setters["--io-limit"] = [this](const std::string& v){ parseIoLimit(v); };
+        setters["--scan-interval"] = [this](const std::string& v){ scanner_.interval_ = std::stoul(v); };
+        setters["--scan-rate"] = [this](const std::string& v){ scanner_.rate_ = std::stoul(v); };
+        setters["--shared-cache"] = [this](const std::string& v){ shared_.dir_ = v; };
+        setters["--shared-cache-size"] = [this](const std::string& v){ shared_.size_ = std::stoull(v); };
+        setters["--shared-cache-entries"] = [this](const std::string& v){ shared_.entries_ = std::stoull(v); };
+        setters["--io-depth"] = [this](const std::string& v){ io_.depth_ = std::stoul(v); };
+        setters["--io-block"] = [this](const std::string& v){ io_.block_ = std::stoull(v); };
+        setters["--source-failure-rate"] = [this](const std::string& v){ slowSource_.failureRate_ = std::stod(v); };
+        setters["--source-hang-file"] = [this](const std::string& v){ slowSource_.hangFile_ = v; };
+        setters["--source-timeout"] = [this](const std::string& v){ resilience_.timeout_ = std::chrono::milliseconds(std::stoul(v)); };
+        setters["--source-transfer-timeout"] = [this](const std::string& v){ resilience_.transferTimeout_ = std::chrono::milliseconds(std::stoul(v)); };
+        setters["--source-threads"] = [this](const std::string& v){ resilience_.threads_ = std::stoul(v); };
+        setters["--breaker-failures"] = [this](const std::string& v){ resilience_.failures_ = std::stoul(v); };
+        setters["--breaker-cooldown"] = [this](const std::string& v){ resilience_.cooldown_ = std::chrono::milliseconds(std::stoul(v)); };
+        return setters;
+    }
+
+    void usage(std::ostream& os) const
+    {
+        os << "cachefs options:" << std::endl;
+        os << "    --trace=<file>              record binary access trace to <file>" << std::endl;
+        os << "    --prefetch=<file>           prefetch files following the access sequence recorded in <file>" << std::endl;
+        os << "    --prefetch-window=<n>       number of files to fetch ahead of the matched sequence (default 64)" << std::endl;
+        os << "    --policy=<file>             read-write subtrees and per-subtree caching, one '<path> <setting>...' per line:" << std::endl;
+        os << "                                rw|ro, cache|nocache, pinned|unpinned, ttl=<seconds>, readahead=<files>" << std::endl;
+        os << "    --log-level=<level>         trace, debug, info, warning, error or off (default info)" << std::endl;
+        os << "    --log-rate=<n>              records per second allowed for a single log statement, 0 is unlimited (default 100)" << std::endl;
+        os << "    --rw-preload=<0|1>          copy the whole read-write subtree on first access instead of on demand" << std::endl;
+        os << "    --fill-threads=<n>          read-only cache misses fetched at once, queued by priority; 0 fetches them" << std::endl;
+        os << "                                on the thread asking (default 16)" << std::endl;
+        os << "    --copy-threads=<n>          parallel transfers when copying the read-write subtree (default 16)" << std::endl;
+        os << "    --push-threads=<n>          parallel pushes of released files back to the source (default 4)" << std::endl;
+        os << "    --write-back=<0|1>          acknowledge read-write metadata ops once journaled, replay them in the background" << std::endl;
+        os << "    --replay-threads=<n>        parallel journal replay for independent paths (default 4)" << std::endl;
+        os << "    --dirty-bytes=<n>           throttle writers as unpushed written bytes approach <n>, 0 is unlimited" << std::endl;
+        os << "    --dirty-files=<n>           throttle writers as files with unpushed changes approach <n>, 0 is unlimited" << std::endl;
+        os << "    --io-limit=<class>:<b>[:<n>] limit source traffic of <class> to <b> bytes and <n> ops per second, 0 is" << std::endl;
+        os << "                                unlimited; classes are foreground, readahead, push, preload and total" << std::endl;
+        os << "    --scan-interval=<n>         look for changes made to the source by re-checking cached directories every" << std::endl;
+        os << "                                <n> seconds, 0 is never (default)" << std::endl;
+        os << "    --scan-rate=<n>             directories checked per second at most (default 100)" << std::endl;
+        os << "    --shared-cache=<dir>        keep read-only content in <dir>, shared with other cachefs processes of the" << std::endl;
+        os << "                                host mounting the same source" << std::endl;
+        os << "    --shared-cache-size=<n>     evict least recently used shared content beyond <n> bytes, 0 is unlimited" << std::endl;
+        os << "    --shared-cache-entries=<n>  files the shared index holds, fixed when it is created (default 1048576)" << std::endl;
+        os << "    --io-depth=<n>              blocks in flight per transfer to and from a local source with io_uring, 0" << std::endl;
+        os << "                                uses blocking reads and writes (default)" << std::endl;
+        os << "    --io-block=<n>              bytes per io_uring read and write (default 131072)" << std::endl;
+        os << "    --source-timeout=<ms>       fail source metadata ops taking longer, 0 lets them hang (default 10000)" << std::endl;
+        os << "    --source-transfer-timeout=<ms> fail source transfers and fsyncs taking longer, 0 lets them take as long" << std::endl;
+        os << "                                as they need (default), big files over slow links need a generous one" << std::endl;
+        os << "    --source-threads=<n>        threads running source ops (default 32)" << std::endl;
+        os << "    --breaker-failures=<n>      consecutive source failures before only the cache is served (default 5)" << std::endl;
+        os << "    --breaker-cooldown=<ms>     wait before trying an unavailable source again (default 5000)" << std::endl;
+        os << "    --source-latency-us=<n>     emulate a slow source: add <n> microseconds to every source op" << std::endl;
+        os << "    --source-bandwidth=<n>      emulate a slow source: limit transfers to <n> bytes per second" << std::endl;
+        os << "    --source-failure-rate=<p>   emulate a flaky source: fail source ops with probability <p>" << std::endl;
+        os << "    --source-hang-file=<file>   emulate a hung source: source ops block while <file> exists" << std::endl;
+    }
+
+    static bool parseBool(const std::string& v)
+    {
+        if (v == "1" || v == "true" || v == "yes")
+            return true;
+        if (v == "0" || v == "false" || v == "no")
+            return false;
+        throw std::invalid_argument("expected 0 or 1");
+    }
+
+    // <class>:<bytes per second>[:<ops per second>]
+    void parseIoLimit(const std::string& v)
+    {
+        const auto first = v.find(':');
+        if (first == std::string::npos)
+            throw std::invalid_argument("expected <class>:<bytes>[:<ops>]");
+
+        const auto name = v.substr(0, first);
+        const auto second = v.find(':', first + 1);
+
+        IoScheduler::Limit limit;
+        limit.bandwidth_ = std::stoull(v.substr(first + 1, second == std::string::npos ? std::string::npos : second - first - 1));
+        if (second != std::string::npos)
+            limit.iops_ = std::stoull(v.substr(second + 1));
+
+        IoClass c;
+        if (name == "total")
+            ioTotal_ = limit;
+        else if (IoScheduler::parseClass(name, c))
+            ioLimits_[static_cast<std::size_t>(c)] = limit;
+        else
+            throw std::invalid_argument("unknown class '" + name + "'");
+    }
+
+    boost::filesystem::path traceFile_;
+    boost::filesystem::path prefetchFile_;
+    std::size_t prefetchWindow_ = 64;
+    std::vector<PolicyRule> policies_;
+    Logger::Level logLevel_ = Logger::Info;
+    uint32_t logRate_ = 100;
+    SlowSource::Settings slowSource_;
+    bool readWritePreload_ = false;
+    std::size_t copyThreads_ = 16;
+    std::size_t pushThreads_ = 4;
+    bool writeBack_ = false;
+    std::size_t replayThreads_ = 4;
+    DirtyBudget::Limit dirtyLimit_;
+    IoScheduler::Limit ioLimits_[IoScheduler::CLASS_COUNT];
+    IoScheduler::Limit ioTotal_;
+    DirectoryScanner::Settings scanner_;
+    ResilientSource::Settings resilience_;
+    SharedStore::Settings shared_;
+    IoEngine::Settings io_;
+    MissPipeline::Settings misses_;
+};
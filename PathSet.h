@@ -0,0 +1,271 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <functional>
+
+// Set of paths with lock-free and allocation-free lookups.
+//
+// Lookups probe an open addressing table without taking a lock; inserts and removals are
+// serialized by a mutex. Removal only clears the 'present_' flag of the node, the slot is
+// reclaimed when the table fills up: a new table is built from the nodes still present, at
+// twice their number at least, and published with a single store. The old table and the
+// removed nodes are freed once no lookup can still see them. Lookups announce themselves
+// on a counter of their own thread's shard, picked by the parity of a generation the
+// rebuild flips twice, waiting for each parity to drain (a two phase grace period).
+class PathSet
+{
+    struct Node
+    {
+        Node(uint64_t hash, const char* path, std::size_t size)
+            : hash_(hash)
+            , path_(path, size)
+            , present_(true)
+        {
+        }
+
+        bool matches(uint64_t hash, const char* path, std::size_t size) const
+        {
+            return hash_ == hash && path_.size() == size && memcmp(path_.data(), path, size) == 0;
+        }
+
+        const uint64_t hash_;
+        const std::string path_;
+        std::atomic<bool> present_;
+    };
+
+    struct Table
+    {
+        explicit Table(std::size_t size)
+            : mask_(size - 1)
+            , used_(0)
+            , slots_(new std::atomic<Node*>[size])
+        {
+            for (std::size_t i = 0; i < size; ++i)
+                slots_[i].store(nullptr, std::memory_order_relaxed);
+        }
+
+        const std::size_t mask_;
+        std::size_t used_;
+        const std::unique_ptr<std::atomic<Node*>[]> slots_;
+    };
+
+    // lookups in progress, padded to a cache line per shard
+    struct Readers
+    {
+        std::atomic<int64_t> count_{0};
+        char padding_[64 - sizeof(std::atomic<int64_t>)];
+    };
+
+public:
+    explicit PathSet(std::size_t capacity = 64 * 1024)
+        : capacity_(roundUp(capacity))
+        , table_(new Table(capacity_))
+        , generation_(0)
+    {
+    }
+
+    ~PathSet()
+    {
+        const std::unique_ptr<Table> table(table_.load(std::memory_order_relaxed));
+        for (std::size_t i = 0; i <= table->mask_; ++i)
+            delete table->slots_[i].load(std::memory_order_relaxed);
+    }
+
+    PathSet(const PathSet&) = delete;
+    PathSet& operator=(const PathSet&) = delete;
+
+    bool contains(const char* path, std::size_t size) const
+    {
+        const auto hash = fnv(path, size);
+        const Read read(*this);
+        const Table* table = table_.load(std::memory_order_seq_cst);
+        for (std::size_t i = hash & table->mask_, probes = 0; probes <= table->mask_; i = (i + 1) & table->mask_, ++probes)
+        {
+            const Node* node = table->slots_[i].load(std::memory_order_acquire);
+            if (!node)
+                return false;
+            if (node->matches(hash, path, size))
+                return node->present_.load(std::memory_order_acquire);
+        }
+        return false;
+    }
+
+    bool contains(const std::string& path) const
+    {
+        return contains(path.data(), path.size());
+    }
+
+    void insert(const char* path, std::size_t size)
+    {
+        const auto hash = fnv(path, size);
+        std::unique_lock<std::mutex> lock(lock_);
+
+        Table* table = table_.load(std::memory_order_relaxed);
+        if (Node* node = find(*table, hash, path, size))
+        {
+            node->present_.store(true, std::memory_order_release);
+            return;
+        }
+
+        if (table->used_ >= (table->mask_ + 1) / 2)
+            table = rebuild(*table);
+
+        place(*table, new Node(hash, path, size));
+    }
+
+    void insert(const std::string& path)
+    {
+        insert(path.data(), path.size());
+    }
+
+    void erase(const std::string& path)
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        if (Node* node = find(*table_.load(std::memory_order_relaxed), fnv(path.data(), path.size()), path.data(), path.size()))
+            node->present_.store(false, std::memory_order_release);
+    }
+
+    // erases the path and everything under it, walks the whole table
+    void eraseTree(const std::string& path)
+    {
+        erase(path);
+
+        const auto prefix = path + "/";
+        std::unique_lock<std::mutex> lock(lock_);
+        const Table* table = table_.load(std::memory_order_relaxed);
+        for (std::size_t i = 0; i <= table->mask_; ++i)
+        {
+            Node* node = table->slots_[i].load(std::memory_order_relaxed);
+            if (node && node->path_.compare(0, prefix.size(), prefix) == 0)
+                node->present_.store(false, std::memory_order_release);
+        }
+    }
+
+private:
+    static const std::size_t SHARDS = 64;
+
+    // keeps the table a lookup is using from being freed
+    class Read
+    {
+    public:
+        explicit Read(const PathSet& set)
+            : readers_(set.readers_[set.generation_.load(std::memory_order_seq_cst) & 1][shard()].count_)
+        {
+            readers_.fetch_add(1, std::memory_order_seq_cst);
+        }
+
+        ~Read()
+        {
+            readers_.fetch_sub(1, std::memory_order_release);
+        }
+
+    private:
+        std::atomic<int64_t>& readers_;
+    };
+
+    static std::size_t shard()
+    {
+        thread_local const std::size_t shard = std::hash<std::thread::id>()(std::this_thread::get_id()) % SHARDS;
+        return shard;
+    }
+
+    // called under the lock
+    static Node* find(const Table& table, uint64_t hash, const char* path, std::size_t size)
+    {
+        for (std::size_t i = hash & table.mask_, probes = 0; probes <= table.mask_; i = (i + 1) & table.mask_, ++probes)
+        {
+            Node* node = table.slots_[i].load(std::memory_order_relaxed);
+            if (!node)
+                return nullptr;
+            if (node->matches(hash, path, size))
+                return node;
+        }
+        return nullptr;
+    }
+
+    // called under the lock, the table has a free slot
+    static void place(Table& table, Node* node)
+    {
+        std::size_t i = node->hash_ & table.mask_;
+        while (table.slots_[i].load(std::memory_order_relaxed))
+            i = (i + 1) & table.mask_;
+
+        table.slots_[i].store(node, std::memory_order_release);
+        ++table.used_;
+    }
+
+    // replaces the table with one holding only the nodes still present, called under the lock
+    Table* rebuild(Table& old)
+    {
+        std::vector<Node*> present;
+        std::vector<Node*> removed;
+        for (std::size_t i = 0; i <= old.mask_; ++i)
+        {
+            if (Node* node = old.slots_[i].load(std::memory_order_relaxed))
+                (node->present_.load(std::memory_order_relaxed) ? present : removed).push_back(node);
+        }
+
+        Table* table = new Table(std::max(capacity_, roundUp(present.size() * 4)));
+        for (auto* node : present)
+            place(*table, node);
+
+        table_.store(table, std::memory_order_seq_cst);
+        synchronize();
+
+        delete &old;
+        for (auto* node : removed)
+            delete node;
+        return table;
+    }
+
+    // waits until every lookup started before the call is done
+    void synchronize()
+    {
+        for (int phase = 0; phase < 2; ++phase)
+        {
+            const auto generation = generation_.fetch_add(1, std::memory_order_seq_cst);
+            auto& readers = readers_[generation & 1];
+            for (std::size_t i = 0; i < SHARDS; ++i)
+            {
+                while (readers[i].count_.load(std::memory_order_acquire))
+                    std::this_thread::yield();
+            }
+        }
+    }
+
+    static std::size_t roundUp(std::size_t value)
+    {
+        std::size_t result = 16;
+        while (result < value)
+            result <<= 1;
+        return result;
+    }
+
+    static uint64_t fnv(const char* data, std::size_t size)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        for (std::size_t i = 0; i < size; ++i)
+        {
+            hash ^= static_cast<unsigned char>(data[i]);
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+private:
+    const std::size_t capacity_;
+
+    std::mutex lock_;
+    std::atomic<Table*> table_;
+
+    std::atomic<uint64_t> generation_;
+    mutable Readers readers_[2][SHARDS];
+};
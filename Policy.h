@@ -0,0 +1,295 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+
+#include <boost/optional.hpp>
+#include <boost/filesystem.hpp>
+
+// How a path is served, resolved from the rules of the policy file
+struct Policy
+{
+    int tree_ = -1;             // read-write subtree the path belongs to, -1 for read-only paths
+    bool cache_ = true;         // read-only paths: keep metadata and content in the cache
+    bool pinned_ = false;       // cached entries are kept as they are, never revalidated
+    uint32_t ttl_ = 0;          // read-only paths: seconds before cached entries are checked against the source, 0 is never
+    uint32_t readAhead_ = 0;    // files prefetched ahead of a matched access sequence
+
+    bool readWrite() const
+    {
+        return tree_ >= 0;
+    }
+};
+
+// Settings given for a path in the policy file, the ones left out are inherited from the parent.
+//
+// One rule per line, '#' starts a comment:
+//
+//     <path> [rw|ro] [cache|nocache] [pinned|unpinned] [ttl=<seconds>] [readahead=<files>]
+//
+// Paths are relative to the mount root. 'rw' starts a read-write subtree, which may not
+// contain read-only paths.
+struct PolicyRule
+{
+    std::string path_;
+    boost::optional<bool> readWrite_;
+    boost::optional<bool> cache_;
+    boost::optional<bool> pinned_;
+    boost::optional<uint32_t> ttl_;
+    boost::optional<uint32_t> readAhead_;
+
+    // throws std::invalid_argument naming the line on errors
+    static std::vector<PolicyRule> load(const boost::filesystem::path& file)
+    {
+        std::ifstream in(file.string());
+        if (!in)
+            throw std::invalid_argument("failed to open " + file.string());
+
+        std::vector<PolicyRule> rules;
+        std::string line;
+        for (std::size_t number = 1; std::getline(in, line); ++number)
+        {
+            line = line.substr(0, line.find('#'));
+
+            std::istringstream words(line);
+            PolicyRule rule;
+            if (!(words >> rule.path_))
+                continue;
+
+            try
+            {
+                rule.path_ = normalize(rule.path_);
+                for (std::string word; words >> word; )
+                    rule.set(word);
+            }
+            catch (const std::exception& e)
+            {
+                throw std::invalid_argument(file.string() + ":" + std::to_string(number) + ": " + e.what());
+            }
+            rules.push_back(rule);
+        }
+        return rules;
+    }
+
+    static std::string normalize(const std::string& path)
+    {
+        if (path.empty() || path[0] != '/')
+            throw std::invalid_argument("path '" + path + "' is not absolute");
+
+        std::string result;
+        std::size_t start = 0;
+        while (start < path.size())
+        {
+            auto end = path.find('/', start);
+            if (end == std::string::npos)
+                end = path.size();
+
+            const auto component = path.substr(start, end - start);
+            if (component == "." || component == "..")
+                throw std::invalid_argument("path '" + path + "' is not canonical");
+            if (!component.empty())
+                result += "/" + component;
+            start = end + 1;
+        }
+        return result.empty() ? "/" : result;
+    }
+
+private:
+    void set(const std::string& word)
+    {
+        const auto eq = word.find('=');
+        const auto name = word.substr(0, eq);
+        const auto value = eq == std::string::npos ? std::string() : word.substr(eq + 1);
+
+        if (word == "rw" || word == "ro")
+            readWrite_ = word == "rw";
+        else if (word == "cache" || word == "nocache")
+            cache_ = word == "cache";
+        else if (word == "pinned" || word == "unpinned")
+            pinned_ = word == "pinned";
+        else if (name == "ttl" && !value.empty())
+            ttl_ = static_cast<uint32_t>(std::stoul(value));
+        else if (name == "readahead" && !value.empty())
+            readAhead_ = static_cast<uint32_t>(std::stoul(value));
+        else
+            throw std::invalid_argument("unknown setting '" + word + "'");
+    }
+};
+
+// Policy rules compiled into a trie of path components, every node holding the policy
+// resolved for it, so looking a path up walks its components once without allocating and
+// takes the same time however many rules there are. Children of a node are stored next to
+// each other sorted by name and found with a binary search.
+//
+// Immutable once built, lookups need no locks.
+class PolicyTree
+{
+    struct Node
+    {
+        uint32_t name_;         // offset into names_
+        uint32_t size_;
+        uint32_t children_;     // index of the first child in nodes_
+        uint32_t count_;
+        Policy policy_;
+    };
+
+public:
+    // throws std::invalid_argument if the rules contradict each other
+    PolicyTree(const Policy& defaults, const std::vector<PolicyRule>& rules)
+    {
+        // a pointer based trie first, flattened breadth first so siblings end up adjacent
+        struct Builder
+        {
+            std::map<std::string, std::unique_ptr<Builder>> children_;
+            const PolicyRule* rule_ = nullptr;
+        };
+
+        Builder root;
+        for (const auto& rule : rules)
+        {
+            Builder* node = &root;
+            for (const auto& component : components(rule.path_))
+            {
+                auto& child = node->children_[component];
+                if (!child)
+                    child.reset(new Builder);
+                node = child.get();
+            }
+
+            // later rules for the same path override earlier ones
+            node->rule_ = &rule;
+        }
+
+        std::deque<std::pair<const Builder*, std::string>> queue;
+        nodes_.push_back(Node{0, 0, 0, 0, resolve(defaults, root.rule_, "/")});
+        queue.emplace_back(&root, "");
+
+        for (std::size_t index = 0; !queue.empty(); ++index)
+        {
+            const auto* builder = queue.front().first;
+            const auto path = queue.front().second;
+            queue.pop_front();
+
+            nodes_[index].children_ = static_cast<uint32_t>(nodes_.size());
+            nodes_[index].count_ = static_cast<uint32_t>(builder->children_.size());
+
+            for (const auto& child : builder->children_)
+            {
+                const auto childPath = path + "/" + child.first;
+                nodes_.push_back(Node{static_cast<uint32_t>(names_.size()), static_cast<uint32_t>(child.first.size()), 0, 0,
+                                      resolve(nodes_[index].policy_, child.second->rule_, childPath)});
+                names_ += child.first;
+                queue.emplace_back(child.second.get(), childPath);
+            }
+        }
+    }
+
+    const Policy& find(const char* path) const
+    {
+        const Node* node = &nodes_.front();
+        while (node->count_)
+        {
+            while (*path == '/')
+                ++path;
+            if (!*path)
+                break;
+
+            const char* end = strchrnul(path, '/');
+            const Node* next = child(*node, path, end - path);
+            if (!next)
+                break;
+
+            node = next;
+            path = end;
+        }
+        return node->policy_;
+    }
+
+    // roots of the read-write subtrees, indexed by Policy::tree_
+    const std::vector<std::string>& readWriteRoots() const
+    {
+        return roots_;
+    }
+
+private:
+    static std::vector<std::string> components(const std::string& path)
+    {
+        std::vector<std::string> result;
+        std::size_t start = 1;
+        while (start < path.size())
+        {
+            auto end = path.find('/', start);
+            if (end == std::string::npos)
+                end = path.size();
+            result.push_back(path.substr(start, end - start));
+            start = end + 1;
+        }
+        return result;
+    }
+
+    // applies the settings of the rule for 'path' to what the parent resolved to
+    Policy resolve(const Policy& parent, const PolicyRule* rule, const std::string& path)
+    {
+        Policy policy = parent;
+        if (!rule)
+            return policy;
+
+        if (rule->readWrite_)
+        {
+            if (!*rule->readWrite_ && parent.readWrite())
+                throw std::invalid_argument("'" + path + "' is read-only inside read-write subtree '" + roots_[parent.tree_] + "'");
+
+            if (*rule->readWrite_ && !parent.readWrite())
+            {
+                policy.tree_ = static_cast<int>(roots_.size());
+                roots_.push_back(path);
+            }
+        }
+
+        if (rule->cache_)
+            policy.cache_ = *rule->cache_;
+        if (rule->pinned_)
+            policy.pinned_ = *rule->pinned_;
+        if (rule->ttl_)
+            policy.ttl_ = *rule->ttl_;
+        if (rule->readAhead_)
+            policy.readAhead_ = *rule->readAhead_;
+        return policy;
+    }
+
+    const Node* child(const Node& parent, const char* name, std::size_t size) const
+    {
+        const auto first = nodes_.begin() + parent.children_;
+        const auto last = first + parent.count_;
+        const auto it = std::lower_bound(first, last, std::make_pair(name, size), [this](const Node& node, const std::pair<const char*, std::size_t>& key){
+            return compare(node, key.first, key.second) < 0;
+        });
+
+        if (it == last || compare(*it, name, size) != 0)
+            return nullptr;
+        return &*it;
+    }
+
+    // orders like std::string::compare, which sorted the children
+    int compare(const Node& node, const char* name, std::size_t size) const
+    {
+        const int res = memcmp(names_.data() + node.name_, name, std::min<std::size_t>(node.size_, size));
+        if (res)
+            return res;
+        return node.size_ < size ? -1 : node.size_ > size ? 1 : 0;
+    }
+
+private:
+    std::vector<Node> nodes_;
+    std::string names_;
+    std::vector<std::string> roots_;
+};
@@ -0,0 +1,211 @@
+#pragma once
+
+#include "Logger.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <boost/crc.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/unordered_set.hpp>
+
+// Append-only record of the cached files with changes not yet pushed to the source, so the
+// pushes pending when cachefs stopped are resumed on startup without comparing trees.
+//
+// A path is recorded as dirty on its first change and as clean once a push of it completed
+// with nothing written meanwhile, a failed push leaves it dirty. Records are written before
+// the change is acknowledged but not synced, which survives the process being killed. Once
+// the log is mostly clean records it is rewritten with just the dirty paths.
+//
+// Not thread safe, the owner serializes calls.
+class PushLog
+{
+public:
+    explicit PushLog(const boost::filesystem::path& dir)
+        : file_(dir / "pushes")
+        , records_(0)
+    {
+        boost::filesystem::create_directories(dir);
+
+        fd_ = ::open(file_.c_str(), O_RDWR | O_CREAT | O_APPEND, 0600);
+        if (fd_ == -1)
+            throw std::runtime_error("failed to open push log " + file_.string());
+
+        recover();
+    }
+
+    ~PushLog()
+    {
+        close(fd_);
+    }
+
+    // paths that were dirty when the log was last written
+    std::vector<std::string> dirty() const
+    {
+        return std::vector<std::string>(dirty_.begin(), dirty_.end());
+    }
+
+    void dirty(const std::string& path)
+    {
+        if (dirty_.insert(path).second)
+            append(Dirty, path);
+    }
+
+    // false if the path was not dirty
+    bool clean(const std::string& path)
+    {
+        if (!dirty_.erase(path))
+            return false;
+
+        append(Clean, path);
+        if (records_ > COMPACT_RECORDS && records_ > dirty_.size() * 4)
+            compact();
+        return true;
+    }
+
+private:
+    enum Type : uint8_t { Dirty, Clean };
+
+#pragma pack(push, 1)
+    struct Header
+    {
+        uint32_t crc_;          // of everything after this field, the path included
+        uint8_t type_;
+        uint16_t path_;
+    };
+#pragma pack(pop)
+
+    static void encode(Type type, const std::string& path, std::vector<char>& out)
+    {
+        Header h;
+        h.type_ = type;
+        h.path_ = static_cast<uint16_t>(path.size());
+
+        const auto start = out.size();
+        out.resize(start + sizeof(h));
+        out.insert(out.end(), path.begin(), path.end());
+
+        boost::crc_32_type crc;
+        crc.process_bytes(reinterpret_cast<const char*>(&h) + sizeof(h.crc_), sizeof(h) - sizeof(h.crc_));
+        crc.process_bytes(path.data(), path.size());
+        h.crc_ = crc.checksum();
+        memcpy(out.data() + start, &h, sizeof(h));
+    }
+
+    void append(Type type, const std::string& path)
+    {
+        std::vector<char> data;
+        encode(type, path, data);
+        ++records_;
+
+        if (!write(fd_, data))
+        {
+            LOG(Error) << "push log write of '" << path << "' failed: " << strerror(errno);
+        }
+    }
+
+    static bool write(int fd, const std::vector<char>& data)
+    {
+        std::size_t written = 0;
+        while (written < data.size())
+        {
+            const auto count = ::write(fd, data.data() + written, data.size() - written);
+            if (count < 0)
+                return false;
+            written += count;
+        }
+        return true;
+    }
+
+    void recover()
+    {
+        std::vector<char> data;
+        char chunk[64 * 1024];
+        ssize_t res;
+        off_t offset = 0;
+        while ((res = pread(fd_, chunk, sizeof(chunk), offset)) > 0)
+        {
+            data.insert(data.end(), chunk, chunk + res);
+            offset += res;
+        }
+
+        std::size_t pos = 0;
+        Header h;
+        while (pos + sizeof(h) <= data.size())
+        {
+            memcpy(&h, data.data() + pos, sizeof(h));
+            const auto size = sizeof(h) + h.path_;
+            if (pos + size > data.size())
+                break;
+
+            boost::crc_32_type crc;
+            crc.process_bytes(data.data() + pos + sizeof(h.crc_), size - sizeof(h.crc_));
+            if (crc.checksum() != h.crc_)
+                break;
+
+            const std::string path(data.data() + pos + sizeof(h), h.path_);
+            if (h.type_ == Dirty)
+                dirty_.insert(path);
+            else
+                dirty_.erase(path);
+
+            pos += size;
+            ++records_;
+        }
+
+        if (pos < data.size())
+        {
+            LOG(Warning) << "push log has " << data.size() - pos << " trailing bytes of a torn write, dropping them";
+            if (ftruncate(fd_, pos) == -1)
+            {
+                LOG(Error) << "failed to truncate push log: " << strerror(errno);
+            }
+        }
+
+        if (!dirty_.empty())
+        {
+            LOG(Info) << "push log has " << dirty_.size() << " files to push";
+        }
+    }
+
+    // rewrites the log with only the dirty paths, through a temp file so a crash keeps the old one
+    void compact()
+    {
+        std::vector<char> data;
+        for (const auto& path : dirty_)
+            encode(Dirty, path, data);
+
+        const auto temp = boost::filesystem::path(file_).concat(".tmp");
+        const int fd = ::open(temp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600);
+        if (fd == -1)
+        {
+            LOG(Error) << "push log compaction failed: " << strerror(errno);
+            return;
+        }
+
+        if (!write(fd, data) || fdatasync(fd) == -1 || ::rename(temp.c_str(), file_.c_str()) == -1)
+        {
+            LOG(Error) << "push log compaction failed: " << strerror(errno);
+            close(fd);
+            ::unlink(temp.c_str());
+            return;
+        }
+
+        close(fd_);
+        fd_ = fd;
+        records_ = dirty_.size();
+    }
+
+private:
+    static const std::size_t COMPACT_RECORDS = 4096;
+
+    const boost::filesystem::path file_;
+    int fd_;
+    std::size_t records_;
+    boost::unordered_set<std::string> dirty_;
+};
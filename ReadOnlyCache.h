@@ -1,6 +1,13 @@
 #pragma once
 
 #include "Logger.h"
+#include "Trace.h"
+#include "Stats.h"
+#include "Source.h"
+#include "Policy.h"
+#include "ControlDir.h"
+#include "SharedStore.h"
+#include "MissPipeline.h"
 
 #include <errno.h>
 #include <sys/stat.h>
@@ -13,6 +20,8 @@
 #include <memory>
 #include <vector>
 #include <mutex>
+#include <atomic>
+#include <functional>
 
 #include <boost/filesystem.hpp>
 #include <boost/shared_ptr.hpp>
@@ -23,14 +32,6 @@
 
 class ReadOnlyCache
 {
-    struct DirEntry
-    {
-        DirEntry(struct stat& in, const char* name) : stat_(in), name_(name) {}
-
-        struct stat stat_;
-        std::string name_;
-    };
-
     struct CacheEntry
     {
         typedef boost::shared_ptr<CacheEntry> Ptr;
@@ -39,6 +40,7 @@ class ReadOnlyCache
 
         boost::optional<int> checkResult_;
         struct stat stat_;
+        uint64_t checked_ = 0;      // when the source was last asked, for the revalidation ttl
 
         std::vector<char> link_;
         boost::optional<int> linkResult_;
@@ -47,6 +49,7 @@ class ReadOnlyCache
 
         std::vector<DirEntry> list_;
         boost::optional<int> listResult_;
+        std::atomic<bool> listed_{false};       // readable without the lock, for scans
     };
 
     typedef boost::unordered_map<boost::filesystem::path, CacheEntry::Ptr> CacheMap;
@@ -55,17 +58,27 @@ class ReadOnlyCache
 public:
     ReadOnlyCache(const boost::filesystem::path& src,
           const boost::filesystem::path& cache,
-          const boost::filesystem::path& readWrite)
+          const PolicyTree& policies,
+          const Source::Ptr& source,
+          SharedStore* shared = nullptr,
+          const MissPipeline::Settings& misses = MissPipeline::Settings())
         : src_(src)
         , cache_(cache)
-        , readWrite_(readWrite)
+        , temp_(cache / ".cachefs" / "tmp")
+        , policies_(policies)
+        , source_(source)
+        , shared_(shared)
+        , misses_(misses)
     {
+        boost::system::error_code ignore;
+        boost::filesystem::create_directories(temp_, ignore);
+
         //readCache();
     }
 
     void readCache()
     {
-        Logger::instance() << "reading cache from: " << cache_.string() << std::endl;
+        LOG(Info) << "reading cache from: " << cache_.string();
 
         boost::filesystem::recursive_directory_iterator it(cache_);
         boost::filesystem::recursive_directory_iterator end;
@@ -95,7 +108,7 @@ public:
                 list(path.c_str(), buffer, filler, 0, &info, fuse_readdir_flags());
         }
 
-        Logger::instance() << "read " << cacheMap_.size() << " items" << std::endl;
+        LOG(Info) << "read " << cacheMap_.size() << " items";
     }
 
     CacheEntry::Ptr get(const boost::filesystem::path& path)
@@ -105,60 +118,289 @@ public:
         if (it == cacheMap_.end())
         {
             it = cacheMap_.emplace(path, boost::make_shared<CacheEntry>()).first;
-            Logger::instance() << "MISS: " << path.string() << std::endl;
+            Stats::miss();
+            LOG(Debug) << "MISS: " << path.string();
         }
         return it->second;
     }
 
-    int ret(int res)
+    // copies the file into the cache unless it is already there, a miss runs in the pipeline
+    int fill(const char* path, const boost::filesystem::path& cached)
+    {
+        if (stored(path, cached))
+            return 0;
+
+        const std::string key(path);
+        return misses_.run(key, [this, key, cached](){
+            return load(key.c_str(), cached);
+        });
+    }
+
+    // where the cached content of a file lives
+    boost::filesystem::path content(const char* path) const
+    {
+        return shared_ ? shared_->object(path) : cache_ / path;
+    }
+
+    // drops what is cached for 'path' and everything under it, returns the number of entries dropped
+    // and calls 'dropped' for each of them
+    std::size_t invalidate(const std::string& path, const std::function<void(const std::string&)>& dropped)
     {
-        return res == -1 ? -errno : 0;
+        const auto prefix = path == "/" ? std::string("/") : path + "/";
+
+        std::size_t count = 0;
+        walk([&](const std::string& key, const CacheEntry&){
+            return key == path || key.compare(0, prefix.size(), prefix) == 0;
+        }, true, [&](const std::vector<boost::filesystem::path>& matches){
+            for (const auto& m : matches)
+            {
+                if (shared_)
+                    shared_->remove(m.c_str());
+                dropped(m.string());
+            }
+            count += matches.size();
+        });
+
+        // shared content goes with the entries above, files only other processes looked up stay
+        if (!shared_)
+            removeContent(path);
+        Stats::add(Stats::Invalidations, count);
+        return count;
+    }
+
+    // the cached directories whose listing is known
+    std::vector<std::string> directories()
+    {
+        std::vector<std::string> result;
+        walk([](const std::string&, const CacheEntry& entry){
+            return entry.listed_.load(std::memory_order_relaxed);
+        }, false, [&](const std::vector<boost::filesystem::path>& dirs){
+            for (const auto& d : dirs)
+                result.push_back(d.string());
+        });
+        return result;
+    }
+
+    // compares a listed directory with the source, and if its mtime or ctime moved, lists it again
+    // and drops the entries added, removed or replaced in it. Changes to the content of a file
+    // leave its directory alone, the ttl of a policy covers those. Returns true if it changed.
+    bool rescan(const std::string& dir, const std::function<void(const std::string&)>& dropped)
+    {
+        const auto& policy = policies_.find(dir.c_str());
+        if (policy.pinned_ || !policy.cache_)
+            return false;
+
+        CacheEntry::Ptr entry;
+        {
+            std::unique_lock<std::mutex> lock(cacheLock_);
+            const auto it = cacheMap_.find(dir);
+            if (it == cacheMap_.end())
+                return false;
+            entry = it->second;
+        }
+
+        struct stat st;
+        int res = source_->lstat(dir.c_str(), &st);
+        if (Source::unavailable(res))
+            return false;
+
+        {
+            std::unique_lock<std::mutex> lock(entry->lock_);
+            if (!entry->listed_)
+                return false;
+
+            // listed without a lookup first, which the kernel never does, take what is there now as the baseline
+            if (!entry->checkResult_)
+            {
+                entry->checkResult_ = res;
+                if (!res)
+                    entry->stat_ = st;
+                entry->checked_ = monotonicNanoseconds();
+                return false;
+            }
+            if (!res && !*entry->checkResult_ && sameTime(st.st_mtim, entry->stat_.st_mtim) && sameTime(st.st_ctim, entry->stat_.st_ctim))
+                return false;
+        }
+
+        std::vector<DirEntry> list;
+        if (!res)
+            res = source_->list(dir.c_str(), list);
+        if (Source::unavailable(res))
+            return false;
+        if (res || !S_ISDIR(st.st_mode))
+        {
+            // gone or replaced by something else
+            invalidate(dir, dropped);
+            return true;
+        }
+
+        // names whose entries are stale; a file is a single entry, a directory a whole subtree
+        std::vector<std::string> files;
+        std::vector<std::string> subtrees;
+        {
+            std::unique_lock<std::mutex> lock(entry->lock_);
+
+            boost::unordered_map<std::string, const struct stat*> before;
+            for (const auto& e : entry->list_)
+                before.emplace(e.name_, &e.stat_);
+
+            const auto base = dir == "/" ? std::string() : dir;
+            const auto stale = [&](const std::string& name, const struct stat& old){
+                (S_ISDIR(old.st_mode) ? subtrees : files).push_back(base + "/" + name);
+            };
+
+            for (const auto& e : list)
+            {
+                const auto it = before.find(e.name_);
+                if (it == before.end())
+                {
+                    // a cached negative lookup of the new name
+                    files.push_back(base + "/" + e.name_);
+                    continue;
+                }
+
+                if (it->second->st_ino != e.stat_.st_ino || (it->second->st_mode & S_IFMT) != (e.stat_.st_mode & S_IFMT))
+                    stale(e.name_, *it->second);
+                before.erase(it);
+            }
+
+            for (const auto& gone : before)
+                stale(gone.first, *gone.second);
+
+            entry->checkResult_ = 0;
+            entry->stat_ = st;
+            entry->checked_ = monotonicNanoseconds();
+            entry->accessMap_.clear();
+            entry->list_ = std::move(list);
+        }
+
+        std::size_t count = 0;
+        {
+            std::unique_lock<std::mutex> lock(cacheLock_);
+            for (const auto& f : files)
+                count += cacheMap_.erase(f);
+        }
+        for (const auto& f : files)
+        {
+            dropContent(f.c_str());
+            dropped(f);
+        }
+        Stats::add(Stats::Invalidations, count);
+
+        for (const auto& d : subtrees)
+            invalidate(d, dropped);
+
+        dropped(dir);
+        return true;
+    }
+
+    // queues the fill without waiting for it
+    void prefetch(const std::string& path)
+    {
+        struct stat st;
+        if (source_->lstat(path.c_str(), &st) || !S_ISREG(st.st_mode))
+            return;
+
+        const auto cached = content(path.c_str());
+        if (stored(path.c_str(), cached))
+            return;
+
+        misses_.post(path, [this, path, cached](){
+            return load(path.c_str(), cached);
+        });
+    }
+
+    // starts the miss workers, once mounted
+    void start()
+    {
+        misses_.start();
+    }
+
+    void collect(Stats::Snapshot& s) const
+    {
+        misses_.collect(s);
     }
 
     int getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
     {
-        const auto full = src_ / path;
+        const auto& policy = policies_.find(path);
+        if (!policy.cache_)
+            return source_->lstat(path, stbuf);
+
         const auto entry = get(path);
 
         std::unique_lock<std::mutex> lock(entry->lock_);
+        revalidate(path, *entry, policy);
         if (!entry->checkResult_)
-            entry->checkResult_ = lstat(full.c_str(), &entry->stat_);
+        {
+            // an unavailable source is no answer, ask again next time
+            const int res = source_->lstat(path, &entry->stat_);
+            if (Source::unavailable(res))
+                return res;
+
+            entry->checkResult_ = res;
+            entry->checked_ = monotonicNanoseconds();
+        }
 
         memcpy(stbuf, &entry->stat_, sizeof(*stbuf));
-        return ret(*entry->checkResult_);
+        return *entry->checkResult_;
     }
 
     int access(const char *path, int mask)
     {
-        const auto full = src_ / path;
+        const auto& policy = policies_.find(path);
+        if (!policy.cache_)
+            return source_->access(path, mask);
+
         const auto entry = get(path);
 
         std::unique_lock<std::mutex> lock(entry->lock_);
+        revalidate(path, *entry, policy);
         auto it = entry->accessMap_.find(mask);
         if (it == entry->accessMap_.end())
-            it = entry->accessMap_.emplace(mask, ::access(full.c_str(), mask)).first;
+        {
+            const int res = source_->access(path, mask);
+            if (Source::unavailable(res))
+                return res;
+            it = entry->accessMap_.emplace(mask, res).first;
+        }
 
-        return ret(it->second);
+        return it->second;
     }
 
     int readlink(const char *path, char *buf, size_t size)
     {
-        const auto full = src_ / path;
+        const auto& policy = policies_.find(path);
+        if (!policy.cache_)
+        {
+            const int res = source_->readlink(path, buf, size - 1);
+            if (res < 0)
+                return res;
+            buf[res] = '\0';
+            return 0;
+        }
+
         const auto entry = get(path);
 
         std::unique_lock<std::mutex> lock(entry->lock_);
+        revalidate(path, *entry, policy);
         if (!entry->linkResult_)
         {
             entry->link_.resize(size);
-            entry->linkResult_ = ::readlink(full.c_str(), entry->link_.data(), size - 1);
-            if (entry->linkResult_ != -1)
-                entry->link_.resize(*entry->linkResult_);
+            const int res = source_->readlink(path, entry->link_.data(), size - 1);
+            if (Source::unavailable(res))
+                return res;
+
+            entry->linkResult_ = res;
+            if (res >= 0)
+                entry->link_.resize(res);
         }
 
         int res = *entry->linkResult_;
-        if (res == -1)
-            return -errno;
+        if (res < 0)
+            return res;
 
+        res = std::min<int>(res, size - 1);
         memcpy(buf, entry->link_.data(), res);
 
         buf[res] = '\0';
@@ -172,45 +414,35 @@ public:
              struct fuse_file_info* fi,
              enum fuse_readdir_flags flags)
     {
-        const auto full = src_ / path;
+        const auto& policy = policies_.find(path);
+        if (!policy.cache_)
+        {
+            std::vector<DirEntry> entries;
+            const int res = source_->list(path, entries);
+            fill(entries, buf, filler);
+            return res;
+        }
+
         const auto entry = get(path);
 
+        std::unique_lock<std::mutex> lock(entry->lock_);
+        revalidate(path, *entry, policy);
         if (!entry->listResult_)
         {
-            DIR *dp;
-            struct dirent *de;
-
-            Logger::instance() << "LISTING " << full.string() << std::endl;
-
-            dp = opendir(full.c_str());
-            if (dp == NULL)
+            LOG(Debug) << "LISTING " << path;
+            const int res = source_->list(path, entry->list_);
+            if (Source::unavailable(res))
             {
-                entry->listResult_ = -errno;
+                entry->list_.clear();
+                return res;
             }
-            else
-            {
-                while ((de = readdir(dp)) != NULL) {
-                    struct stat st;
-                    memset(&st, 0, sizeof(st));
-                    st.st_ino = de->d_ino;
-                    st.st_mode = de->d_type << 12;
-
-                    entry->list_.emplace_back(DirEntry(st, de->d_name));
-                }
 
-                closedir(dp);
-            }
-
-            entry->listResult_ = 0;
+            entry->listResult_ = res;
+            entry->listed_ = !res;
         }
 
-        for (const auto& item : entry->list_)
-        {
-            if (filler(buf, item.name_.c_str(), &item.stat_, 0, static_cast<fuse_fill_dir_flags>(0)))
-                break;
-        }
-
-        return ret(*entry->listResult_);
+        fill(entry->list_, buf, filler);
+        return *entry->listResult_;
     }
 
     int mknod(const char *path, mode_t mode, dev_t rdev)
@@ -272,21 +504,42 @@ public:
         return -errno;
     }
 
-    int open(const char *path, struct fuse_file_info *fi)
+    int fallocate(const char *path, int mode, off_t offset, off_t length,
+                  struct fuse_file_info *fi)
     {
-        const auto cached = cache_ / path;
-        const auto full = src_ / path;
+        return -EROFS;
+    }
 
-        if (!boost::filesystem::exists(cached))
+    int open(const char *path, struct fuse_file_info *fi)
+    {
+        if (!policies_.find(path).cache_)
         {
-            Logger::instance() << "read-only copy '" << full.string() << "' -> '" << cached.string() << "'" << std::endl;
-            boost::filesystem::create_directories(cached.parent_path());
-            boost::filesystem::copy_file(full, cached);
+            // a private copy for every open, nothing to share
+            const int fd = misses_.run(std::string(), [this, path](){ return fetch(path); });
+            if (fd < 0)
+                return fd;
+
+            fi->fh = fd;
+            return 0;
         }
 
-        int res;
+        const auto cached = content(path);
+
+        int res = fill(path, cached);
+        if (res)
+            return res;
 
         res = ::open(cached.c_str(), fi->flags);
+        if (res == -1 && errno == ENOENT && shared_)
+        {
+            // evicted by another process in between
+            shared_->remove(path);
+            res = fill(path, cached);
+            if (res)
+                return res;
+            res = ::open(cached.c_str(), fi->flags);
+        }
+
         if (res == -1)
             return -errno;
 
@@ -297,30 +550,27 @@ public:
     int read(const char *path, char *buf, size_t size, off_t offset,
                         struct fuse_file_info *fi)
     {
-        const auto cached = cache_ / path;
-        const auto full = src_ / path;
-
-        if (!boost::filesystem::exists(cached))
-        {
-            Logger::instance() << "read-only copy '" << full.string() << "' -> '" << cached.string() << "'" << std::endl;
-            boost::filesystem::create_directories(cached.parent_path());
-            boost::filesystem::copy_file(full, cached);
-        }
-
         int fd;
-        int res;
+        if (fi == NULL)
+        {
+            fuse_file_info info = {};
+            info.flags = O_RDONLY;
+            const int res = open(path, &info);
+            if (res)
+                return res;
 
-        if(fi == NULL)
-            fd = ::open(cached.c_str(), O_RDONLY);
+            fd = info.fh;
+        }
         else
+        {
             fd = fi->fh;
+        }
 
-        if (fd == -1)
-            return -errno;
-
-        res = pread(fd, buf, size, offset);
+        int res = pread(fd, buf, size, offset);
         if (res == -1)
             res = -errno;
+        else
+            Stats::add(Stats::CacheBytes, res);
 
         if(fi == NULL)
             close(fd);
@@ -333,6 +583,11 @@ public:
         return -errno;
     }
 
+    int fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+    {
+        return 0;
+    }
+
     int release(const char *path, struct fuse_file_info *fi)
     {
         (void) path;
@@ -341,12 +596,240 @@ public:
     }
 
 
+private:
+    static void fill(const std::vector<DirEntry>& entries, void* buf, fuse_fill_dir_t filler)
+    {
+        for (const auto& item : entries)
+        {
+            if (filler(buf, item.name_.c_str(), &item.stat_, 0, static_cast<fuse_fill_dir_flags>(0)))
+                break;
+        }
+    }
+
+    // once the ttl of the policy passed, asks the source again and drops everything cached
+    // for the entry if it changed there, called under the entry lock
+    void revalidate(const char* path, CacheEntry& entry, const Policy& policy)
+    {
+        if (!policy.ttl_ || policy.pinned_ || !entry.checkResult_)
+            return;
+
+        const auto now = monotonicNanoseconds();
+        if (now - entry.checked_ < policy.ttl_ * 1000000000ull)
+            return;
+
+        struct stat st;
+        const int res = source_->lstat(path, &st);
+        entry.checked_ = now;
+
+        // what is cached is served as long as the source cannot tell otherwise
+        if (Source::unavailable(res) || (res == *entry.checkResult_ && (res || unchanged(st, entry.stat_))))
+            return;
+
+        LOG(Debug) << "'" << path << "' changed in the source, dropping it from the cache";
+        if (!*entry.checkResult_ && S_ISREG(entry.stat_.st_mode))
+            dropContent(path);
+
+        entry.checkResult_ = res;
+        entry.stat_ = st;
+        entry.accessMap_.clear();
+        entry.link_.clear();
+        entry.linkResult_.reset();
+        entry.list_.clear();
+        entry.listResult_.reset();
+        entry.listed_ = false;
+        Stats::add(Stats::Invalidations, 1);
+    }
+
+    static bool unchanged(const struct stat& a, const struct stat& b)
+    {
+        return
+            a.st_ino == b.st_ino && a.st_mode == b.st_mode && a.st_size == b.st_size &&
+            sameTime(a.st_mtim, b.st_mtim) && sameTime(a.st_ctim, b.st_ctim);
+    }
+
+    static bool sameTime(const struct timespec& a, const struct timespec& b)
+    {
+        return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+    }
+
+    // visits the whole map a slice of buckets at a time, so lookups are never held up for long;
+    // 'select' runs under the map lock, the keys it picks are passed to 'selected' after each
+    // slice and, with 'erase', dropped from the map
+    void walk(const std::function<bool(const std::string&, const CacheEntry&)>& select, bool erase,
+              const std::function<void(const std::vector<boost::filesystem::path>&)>& selected)
+    {
+        std::size_t bucket = 0;
+        std::size_t buckets = 0;
+        std::vector<boost::filesystem::path> matches;
+        while (true)
+        {
+            std::unique_lock<std::mutex> lock(cacheLock_);
+
+            // a rehash moved the entries around meanwhile, start over
+            if (buckets && buckets != cacheMap_.bucket_count())
+                bucket = 0;
+            buckets = cacheMap_.bucket_count();
+            if (bucket >= buckets)
+                break;
+
+            for (const auto end = std::min(buckets, bucket + WALK_SLICE); bucket < end; ++bucket)
+            {
+                for (auto it = cacheMap_.begin(bucket); it != cacheMap_.end(bucket); ++it)
+                {
+                    if (select(it->first.string(), *it->second))
+                        matches.push_back(it->first);
+                }
+            }
+
+            if (erase)
+            {
+                for (const auto& m : matches)
+                    cacheMap_.erase(m);
+            }
+            lock.unlock();
+
+            selected(matches);
+            matches.clear();
+        }
+    }
+
+    // copies the file into the cache unless it is already there, the copy becomes visible atomically
+    int load(const char* path, const boost::filesystem::path& cached)
+    {
+        if (shared_)
+        {
+            return shared_->fill(path, policies_.find(path).pinned_, [this, path](const boost::filesystem::path& temp){
+                return copy(path, temp);
+            });
+        }
+
+        if (boost::filesystem::exists(cached))
+            return 0;
+
+        const auto temp = cached.string() + ".cachefs-" + std::to_string(currentThreadId());
+
+        boost::system::error_code error;
+        boost::filesystem::create_directories(cached.parent_path(), error);
+        if (error)
+            return -error.value();
+
+        int res = copy(path, temp);
+        if (!res)
+        {
+            boost::filesystem::rename(temp, cached, error);
+            res = error ? -error.value() : 0;
+        }
+
+        if (res)
+            boost::filesystem::remove(temp, error);
+        return res;
+    }
+
+    // true if the content is cached, a hit
+    bool stored(const char* path, const boost::filesystem::path& cached) const
+    {
+        if (shared_)
+            return shared_->stored(path);
+
+        boost::system::error_code error;
+        return boost::filesystem::exists(cached, error);
+    }
+
+    // fetches a source file into 'local', counted as a fill
+    int copy(const char* path, const boost::filesystem::path& local)
+    {
+        LOG(Info) << "read-only copy '" << path << "' -> '" << local.string() << "'";
+
+        const int res = source_->fetch(path, local);
+        if (res)
+            return res;
+
+        boost::system::error_code error;
+        Stats::miss();
+        Stats::add(Stats::Fills, 1);
+        Stats::add(Stats::SourceBytes, boost::filesystem::file_size(local, error));
+        return 0;
+    }
+
+    void dropContent(const char* path)
+    {
+        if (shared_)
+        {
+            shared_->remove(path);
+            return;
+        }
+
+        boost::system::error_code ignore;
+        boost::filesystem::remove(cache_ / path, ignore);
+    }
+
+    // deletes the cached content under 'path', except for the read-write subtrees and the
+    // state of cachefs which share the cache directory
+    void removeContent(const std::string& path)
+    {
+        boost::system::error_code error;
+        const auto root = cache_ / path;
+        if (!boost::filesystem::is_directory(root, error))
+        {
+            boost::filesystem::remove(root, error);
+            return;
+        }
+
+        const auto base = cache_.string().size();
+        for (boost::filesystem::recursive_directory_iterator it(root, error), end; !error && it != end; it.increment(error))
+        {
+            const auto relative = it->path().string().substr(base);
+            if (ControlDir::owns(relative.c_str()) || policies_.find(relative.c_str()).readWrite())
+            {
+                it.no_push();
+                continue;
+            }
+
+            boost::system::error_code ignore;
+            if (boost::filesystem::is_regular_file(it->symlink_status(ignore)))
+                boost::filesystem::remove(it->path(), ignore);
+        }
+    }
+
+    // private copy of a file under a policy without caching, gone once the returned fd is closed
+    int fetch(const char* path)
+    {
+        const auto temp = temp_ / boost::filesystem::unique_path();
+
+        int res = source_->fetch(path, temp);
+        if (res)
+        {
+            ::unlink(temp.c_str());
+            return res;
+        }
+
+        const int fd = ::open(temp.c_str(), O_RDONLY);
+        res = fd == -1 ? -errno : fd;
+        ::unlink(temp.c_str());
+        if (fd == -1)
+            return res;
+
+        struct stat st;
+        Stats::miss();
+        Stats::add(Stats::SourceBytes, fstat(fd, &st) == 0 ? st.st_size : 0);
+        return fd;
+    }
+
 private:
     const boost::filesystem::path src_;
     const boost::filesystem::path cache_;
-    const boost::filesystem::path readWrite_;
+    const boost::filesystem::path temp_;
+    const PolicyTree& policies_;
+
+    const Source::Ptr source_;
+    SharedStore* const shared_;
+
+    static const std::size_t WALK_SLICE = 4096;
 
     CacheMap cacheMap_;
     std::mutex cacheLock_;
+
+    // last, its workers use everything above
+    MissPipeline misses_;
 };
 
@@ -1,7 +1,14 @@
 #pragma once
 
 #include "Background.h"
+#include "Journal.h"
+#include "FileHandle.h"
 #include "Logger.h"
+#include "Stats.h"
+#include "Source.h"
+#include "LazyTree.h"
+#include "Options.h"
+#include "Policy.h"
 
 #include <errno.h>
 #include <sys/stat.h>
@@ -14,75 +21,42 @@
 #include <memory>
 #include <vector>
 #include <mutex>
+#include <algorithm>
 
 #include <boost/filesystem.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/unordered_map.hpp>
-#include <boost/algorithm/string/replace.hpp>
 
 class ReadWriteCache
 {
 public:
     ReadWriteCache(const boost::filesystem::path& src,
           const boost::filesystem::path& cache,
-          const boost::filesystem::path& readWrite)
+          const PolicyTree& policies,
+          const Source::Ptr& source,
+          const Options& options)
         : src_(src)
         , cache_(cache)
-        , readWrite_(readWrite)
-        , sync_(src, cache)
+        , temp_(cache / ".cachefs" / "tmp")
+        , policies_(policies)
+        , source_(source)
+        , journal_(options.writeBack_ ? new Journal(source, cache / ".cachefs", options.replayThreads_) : nullptr)
+        , metadata_(journal_ ? std::make_shared<WriteBackSource>(source, *journal_) : source)
+        , sync_(source, cache, options.pushThreads_, journal_.get(), options.dirtyLimit_)
     {
-    }
-
-    void copyDirectoryRecursively(const boost::filesystem::path& sourceDir, const boost::filesystem::path& destinationDir)
-    {
-        namespace fs = boost::filesystem;
-
-        Logger::instance() << "read-write copy '" << sourceDir.string() << "' -> '" << destinationDir.string() << "'" << std::endl;
-
-        fs::create_directories(destinationDir);
-
-        boost::system::error_code ignore;
-
-        for (const auto& dirEnt : fs::recursive_directory_iterator{sourceDir})
-        {
-            const auto& path = dirEnt.path();
-            auto relativePathStr = path.string();
-            boost::replace_first(relativePathStr, sourceDir.string(), "");
-
-            const auto dst = destinationDir / relativePathStr;
-
-            const auto time = boost::filesystem::last_write_time(path);
-
-            fs::copy(path, dst);
-
-            boost::filesystem::last_write_time(dst, time, ignore);
-        }
-
-        Logger::instance() << "completed copy '" << sourceDir.string() << "' -> '" << destinationDir.string() << "'" << std::endl;
-    }
-
-    boost::filesystem::path ensureCacheExists(const char* path)
-    {
-        static std::mutex lock_;
-        std::unique_lock<std::mutex> lock(lock_);
-
-        const auto cached = cache_ / path;
-
-        auto dest = readWrite_.string();
-        boost::algorithm::replace_first(dest, src_.string(), cache_.string());
-
-        if (!boost::filesystem::exists(dest))
-            copyDirectoryRecursively(readWrite_, dest);
-
-        return cached;
+        for (const auto& root : policies.readWriteRoots())
+            trees_.emplace_back(new LazyTree(source, cache, root, options.readWritePreload_, options.copyThreads_, journal_.get()));
     }
 
     int getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
     {
-        const auto full = ensureCacheExists(path);
+        const auto& full = local(path);
+
+        int res = tree(path).parent(path);
+        if (res)
+            return res;
 
         (void) fi;
-        int res;
 
         res = lstat(full.c_str(), stbuf);
         if (res == -1)
@@ -93,9 +67,11 @@ public:
 
     int access(const char *path, int mask)
     {
-        const auto full = ensureCacheExists(path);
+        const auto& full = local(path);
 
-        int res;
+        int res = tree(path).parent(path);
+        if (res)
+            return res;
 
         res = ::access(full.c_str(), mask);
         if (res == -1)
@@ -106,9 +82,11 @@ public:
 
     int readlink(const char *path, char *buf, size_t size)
     {
-        const auto full = ensureCacheExists(path);
+        const auto& full = local(path);
 
-        int res;
+        int res = tree(path).parent(path);
+        if (res)
+            return res;
 
         res = ::readlink(full.c_str(), buf, size - 1);
         if (res == -1)
@@ -125,7 +103,11 @@ public:
              struct fuse_file_info* fi,
              enum fuse_readdir_flags flags)
     {
-        const auto full = ensureCacheExists(path);
+        const auto& full = local(path);
+
+        const int res = tree(path).directory(path);
+        if (res)
+            return res;
 
         DIR *dp;
         struct dirent *de;
@@ -153,9 +135,11 @@ public:
 
     int mknod(const char *path, mode_t mode, dev_t rdev)
     {
-        const auto full = ensureCacheExists(path);
+        const auto& full = local(path);
 
-        int res;
+        int res = tree(path).parent(path);
+        if (res)
+            return res;
 
         /* On Linux this could just be 'mknod(path, mode, rdev)' but this
            is more portable */
@@ -175,178 +159,303 @@ public:
 
     int mkdir(const char *path, mode_t mode)
     {
-        const auto full = ensureCacheExists(path);
-        const auto remote = src_ / path;
+        const auto& full = local(path);
+        auto& tree = this->tree(path);
 
-        int res;
+        int res = tree.parent(path);
+        if (res)
+            return res;
 
-        sync_.flush();
+        sync_.waitFor({ path });
 
         res = ::mkdir(full.c_str(), mode);
         if (res == -1)
             return -errno;
 
-        res = ::mkdir(remote.c_str(), mode);
-        if (res == -1)
-            return -errno;
+        tree.created(path);
 
-        return 0;
+        res = metadata_->mkdir(path, mode);
+        if (unjournaled(path, res))
+        {
+            ::rmdir(local(path).c_str());
+            tree.forget(path, true);
+        }
+        return res;
     }
 
     int unlink(const char *path)
     {
-        const auto full = ensureCacheExists(path);
-        const auto remote = src_ / path;
+        const auto& full = local(path);
+        auto& tree = this->tree(path);
 
-        int res;
+        int res = tree.parent(path);
+        if (res)
+            return res;
 
-        sync_.flush();
+        sync_.waitFor({ path });
 
-        res = ::unlink(full.c_str());
-        if (res == -1)
-            return -errno;
+        // with write-back the file is set aside until the unlink is journaled, so it can be put back
+        boost::filesystem::path aside;
+        if (journal_)
+        {
+            struct stat st;
+            if (::lstat(full.c_str(), &st) == -1)
+                return -errno;
+            if (S_ISDIR(st.st_mode))
+                return -EISDIR;
 
-        res = ::unlink(remote.c_str());
+            aside = temp_ / boost::filesystem::unique_path();
+            res = ::rename(full.c_str(), aside.c_str());
+        }
+        else
+        {
+            res = ::unlink(full.c_str());
+        }
         if (res == -1)
             return -errno;
 
-        return 0;
+        res = metadata_->unlink(path);
+        if (unjournaled(path, res))
+        {
+            ::rename(aside.c_str(), local(path).c_str());
+            return res;
+        }
+        if (journal_)
+            ::unlink(aside.c_str());
+
+        tree.forget(path, false);
+        sync_.forget(path);
+        return res;
     }
 
     int rmdir(const char *path)
     {
-        const auto full = ensureCacheExists(path);
-        const auto remote = src_ / path;
+        const auto& full = local(path);
+        auto& tree = this->tree(path);
 
-        int res;
+        int res = tree.directory(path);
+        if (res)
+            return res;
 
-        sync_.flush();
+        sync_.waitFor({ path });
 
-        res = ::rmdir(full.c_str());
-        if (res == -1)
+        struct stat st;
+        if (journal_ && ::lstat(full.c_str(), &st) == -1)
             return -errno;
 
-        res = ::rmdir(remote.c_str());
+        res = ::rmdir(full.c_str());
         if (res == -1)
             return -errno;
 
-        return 0;
+        tree.forget(path, true);
+
+        res = metadata_->rmdir(path);
+        if (unjournaled(path, res))
+        {
+            // it was empty, so the directory itself is all there is to restore
+            const auto& restored = local(path);
+            if (::mkdir(restored.c_str(), st.st_mode & 07777) == 0)
+            {
+                lchown(restored.c_str(), st.st_uid, st.st_gid);
+                tree.created(path);
+            }
+        }
+        return res;
     }
 
     int symlink(const char *from, const char *to)
     {
-        const auto full = ensureCacheExists(from);
+        const auto& full = local(from);
 
-        int res;
+        int res = tree(to).parent(to);
+        if (res)
+            return res;
 
-        sync_.flush();
+        sync_.waitFor({ to });
 
         res = ::symlink(full.c_str(), (cache_ / to).c_str());
         if (res == -1)
             return -errno;
 
-        res = ::symlink((src_ / from).c_str(), (src_ / to).c_str());
-        if (res == -1)
-            return -errno;
-
-        return 0;
+        res = metadata_->symlink((src_ / from).c_str(), to);
+        if (unjournaled(to, res))
+            ::unlink((cache_ / to).c_str());
+        return res;
     }
 
     int rename(const char *from, const char *to, unsigned int flags)
     {
-        const auto full = ensureCacheExists(from);
-
-        int res;
-
         if (flags)
             return -EINVAL;
 
-        sync_.flush();
+        if (policies_.find(from).tree_ != policies_.find(to).tree_)
+            return -EXDEV;
 
-        res = ::rename(full.c_str(), (cache_ / to).c_str());
-        if (res == -1)
-            return -errno;
+        const auto& full = local(from);
+        auto& tree = this->tree(from);
 
-        res = ::rename((src_ / from).c_str(), (src_ / to).c_str());
+        int res = tree.parent(from);
+        if (!res)
+            res = tree.parent(to);
+        if (res)
+            return res;
+
+        sync_.waitFor({ from, to });
+
+        // with write-back an entry replaced by the rename is kept until the rename is journaled
+        const auto target = cache_ / to;
+        struct stat replaced;
+        const bool replacing = journal_ && ::lstat(target.c_str(), &replaced) == 0;
+        boost::filesystem::path aside;
+        if (replacing && !S_ISDIR(replaced.st_mode))
+        {
+            aside = temp_ / boost::filesystem::unique_path();
+            if (::link(target.c_str(), aside.c_str()) == -1)
+                return -errno;
+        }
+
+        res = ::rename(full.c_str(), target.c_str());
         if (res == -1)
-            return -errno;
+        {
+            res = -errno;
+            if (!aside.empty())
+                ::unlink(aside.c_str());
+            return res;
+        }
 
-        return 0;
+        res = metadata_->rename(from, to);
+        if (unjournaled(from, res))
+        {
+            ::rename(target.c_str(), local(from).c_str());
+            if (!aside.empty())
+            {
+                ::rename(aside.c_str(), target.c_str());
+            }
+            else if (replacing && ::mkdir(target.c_str(), replaced.st_mode & 07777) == 0)
+            {
+                // only an empty directory can be replaced
+                lchown(target.c_str(), replaced.st_uid, replaced.st_gid);
+                tree.created(to);
+            }
+            return res;
+        }
+        if (!aside.empty())
+            ::unlink(aside.c_str());
+
+        struct stat st;
+        const bool directory = ::lstat(target.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+        tree.forget(from, directory);
+        tree.forget(to, directory);
+        sync_.renamed(from, to);
+        renamed(from, to);
+        return res;
     }
 
     int link(const char *from, const char *to)
     {
-        int res;
+        if (policies_.find(from).tree_ != policies_.find(to).tree_)
+            return -EXDEV;
 
-        sync_.flush();
+        // both names share the inode, so a stub has to be filled first
+        auto& tree = this->tree(from);
+        int res = tree.parent(from);
+        if (!res)
+            res = tree.parent(to);
+        if (!res)
+            res = tree.content(from);
+        if (res)
+            return res;
 
-        res = ::link((cache_ / from).c_str(), (cache_ / to).c_str());
-        if (res == -1)
-            return -errno;
+        sync_.waitFor({ from, to });
 
-        res = ::link((src_ / from).c_str(), (src_ / to).c_str());
+        res = ::link((cache_ / from).c_str(), (cache_ / to).c_str());
         if (res == -1)
             return -errno;
 
-        return 0;
+        res = metadata_->link(from, to);
+        if (unjournaled(to, res))
+            ::unlink((cache_ / to).c_str());
+        return res;
     }
 
     int chmod(const char *path, mode_t mode,
                          struct fuse_file_info *fi)
     {
-        const auto full = ensureCacheExists(path);
+        const auto& full = local(path);
+
+        int res = tree(path).parent(path);
+        if (res)
+            return res;
 
         (void) fi;
-        int res;
 
-        sync_.flush();
+        sync_.waitFor({ path });
 
-        res = ::chmod(full.c_str(), mode);
-        if (res == -1)
+        struct stat st;
+        if (journal_ && ::lstat(full.c_str(), &st) == -1)
             return -errno;
 
-        res = ::chmod((src_ / path).c_str(), mode);
+        res = ::chmod(full.c_str(), mode);
         if (res == -1)
             return -errno;
 
-        return 0;
+        res = metadata_->chmod(path, mode);
+        if (unjournaled(path, res))
+            ::chmod(local(path).c_str(), st.st_mode & 07777);
+        return res;
     }
 
     int chown(const char *path, uid_t uid, gid_t gid,
                          struct fuse_file_info *fi)
     {
-        const auto full = ensureCacheExists(path);
+        const auto& full = local(path);
+
+        int res = tree(path).parent(path);
+        if (res)
+            return res;
 
         (void) fi;
-        int res;
 
-        sync_.flush();
+        sync_.waitFor({ path });
 
-        res = lchown(full.c_str(), uid, gid);
-        if (res == -1)
+        struct stat st;
+        if (journal_ && ::lstat(full.c_str(), &st) == -1)
             return -errno;
 
-        res = lchown((src_ / path).c_str(), uid, gid);
+        res = lchown(full.c_str(), uid, gid);
         if (res == -1)
             return -errno;
 
-        return 0;
+        res = metadata_->chown(path, uid, gid);
+        if (unjournaled(path, res))
+            lchown(local(path).c_str(), st.st_uid, st.st_gid);
+        return res;
     }
 
     int truncate(const char *path, off_t size,
                             struct fuse_file_info *fi)
     {
-        const auto full = ensureCacheExists(path);
-
-        int res;
+        const auto& full = local(path);
 
+        int res = 0;
         if (fi != NULL)
-            res = ftruncate(fi->fh, size);
-        else
-            res = ::truncate(full.c_str(), size);
-        if (res == -1)
-            return -errno;
+        {
+            // writes before the truncate come first
+            flush(path, handle(fi));
+            res = ftruncate(handle(fi).fd(), size) == -1 ? -errno : 0;
+        }
+        else if (size == 0)
+        {
+            res = prepare(path, [&full](){ return ::truncate(full.c_str(), 0) == -1 ? -errno : 0; });
+        }
+        else if (!(res = prepare(path)))
+        {
+            res = ::truncate(full.c_str(), size) == -1 ? -errno : 0;
+        }
+        if (res)
+            return res;
 
+        sync_.resize(path, size);
         sync_.sync(path);
 
         return 0;
@@ -355,57 +464,90 @@ public:
     int create(const char *path, mode_t mode,
                           struct fuse_file_info *fi)
     {
-        const auto full = ensureCacheExists(path);
-
-        int res;
-
-        sync_.flush();
+        const auto& full = local(path);
 
-        res = ::open(full.c_str(), fi->flags, mode);
-        if (res == -1)
-            return -errno;
+        // with write-back a file this creates is removed again if the create cannot be journaled
+        bool created = false;
+        int fd = -1;
+        const auto openFile = [this, &full, &fd, &created, path, fi, mode](){
+            sync_.waitFor({ path });
+            struct stat st;
+            created = journal_ && ::lstat(full.c_str(), &st) == -1;
+            fd = ::open(full.c_str(), fi->flags, mode);
+            return fd == -1 ? -errno : 0;
+        };
+
+        // a stub opened with O_TRUNC is owned rather than fetched, once the open emptied it
+        int res = (fi->flags & O_TRUNC) ? prepare(path, openFile) : prepare(path);
+        if (!res && fd == -1)
+            res = openFile();
+        if (res)
+        {
+            if (fd != -1)
+                close(fd);
+            return res;
+        }
 
-        fi->fh = res;
+        std::unique_ptr<FileHandle> handle(new FileHandle(fd, path));
+        if (fi->flags & O_TRUNC)
+            sync_.resize(path, 0);
 
-        res = ::open((src_ / path).c_str(), fi->flags, mode);
-        if (res == -1)
+        res = metadata_->create(path, fi->flags, mode);
+        if (unjournaled(path, res) && created)
         {
-            close(fi->fh);
-            fi->fh = 0;
-            return -errno;
+            ::unlink(local(path).c_str());
+            this->tree(path).forget(path, false);
+            sync_.forget(path);
         }
+        if (res)
+            return res;
 
-        close(res);
-
+        fi->fh = reinterpret_cast<uint64_t>(handle.release());
         return 0;
     }
 
     int open(const char *path, struct fuse_file_info *fi)
     {
-        const auto full = ensureCacheExists(path);
+        const auto& full = local(path);
+
+        int fd = -1;
+        const auto openFile = [&full, &fd, fi](){
+            fd = ::open(full.c_str(), fi->flags);
+            return fd == -1 ? -errno : 0;
+        };
+
+        int res = (fi->flags & O_TRUNC) ? prepare(path, openFile) : prepare(path);
+        if (!res && fd == -1)
+            res = openFile();
+        if (res)
+        {
+            if (fd != -1)
+                close(fd);
+            return res;
+        }
 
-        int res;
+        if (fi->flags & O_TRUNC)
+            sync_.resize(path, 0);
 
-        res = ::open(full.c_str(), fi->flags);
-        if (res == -1)
-            return -errno;
-
-        fi->fh = res;
+        fi->fh = reinterpret_cast<uint64_t>(new FileHandle(fd, path));
         return 0;
     }
 
     int read(const char *path, char *buf, size_t size, off_t offset,
                         struct fuse_file_info *fi)
     {
-        const auto full = ensureCacheExists(path);
+        const auto& full = local(path);
 
         int fd;
         int res;
 
+        if (fi == NULL && (res = prepare(path)))
+            return res;
+
         if(fi == NULL)
             fd = ::open(full.c_str(), O_RDONLY);
         else
-            fd = fi->fh;
+            fd = handle(fi).fd();
 
         if (fd == -1)
             return -errno;
@@ -423,16 +565,18 @@ public:
     int write(const char *path, const char *buf, size_t size,
                          off_t offset, struct fuse_file_info *fi)
     {
-        const auto full = ensureCacheExists(path);
+        const auto& full = local(path);
 
         int fd;
         int res;
 
-        (void) fi;
+        if (fi == NULL && (res = prepare(path)))
+            return res;
+
         if(fi == NULL)
             fd = ::open(full.c_str(), O_WRONLY);
         else
-            fd = fi->fh;
+            fd = handle(fi).fd();
 
         if (fd == -1)
             return -errno;
@@ -440,43 +584,254 @@ public:
         res = pwrite(fd, buf, size, offset);
         if (res == -1)
             res = -errno;
+        else
+            Stats::add(Stats::WrittenBytes, res);
 
         if(fi == NULL)
+        {
             close(fd);
-
-        std::unique_lock<std::mutex> lock(mutex_);
-        writtenFiles_.emplace(fd);
+            if (res > 0)
+            {
+                sync_.write(path, offset, res);
+                sync_.sync(path);
+            }
+        }
+        else if (res > 0)
+        {
+            written(path, handle(fi), offset, res);
+        }
 
         return res;
     }
 
-    int release(const char *path, struct fuse_file_info *fi)
+    int fallocate(const char *path, int mode, off_t offset, off_t length,
+                  struct fuse_file_info *fi)
     {
-        (void) path;
-        close(fi->fh);
+        const auto& full = local(path);
 
-        std::unique_lock<std::mutex> lock(mutex_);
-        const auto it = writtenFiles_.find(fi->fh);
-        if (it != writtenFiles_.end())
+        int fd;
+        int res;
+
+        if (mode)
+            return -EOPNOTSUPP;
+
+        if (fi == NULL && (res = prepare(path)))
+            return res;
+
+        if(fi == NULL)
+            fd = ::open(full.c_str(), O_WRONLY);
+        else
+            fd = handle(fi).fd();
+
+        if (fd == -1)
+            return -errno;
+
+        res = -posix_fallocate(fd, offset, length);
+
+        if(fi == NULL)
+            close(fd);
+
+        if (res)
+            return res;
+
+        // the allocated range reads as zeros past the old end of the file, and a patch has to say so
+        if (fi == NULL)
         {
-            writtenFiles_.erase(it);
-            lock.unlock();
+            sync_.write(path, offset, length);
+            sync_.sync(path);
+        }
+        else
+        {
+            written(path, handle(fi), offset, length);
+        }
+
+        return 0;
+    }
+
+    // returns once the changes made so far are on the source and synced there
+    int fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+    {
+        (void) fi;
+
+        // writes through any handle of the file count, not just this one
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            const auto it = writers_.find(path);
+            if (it != writers_.end())
+            {
+                for (auto* h : it->second)
+                    flush(path, *h);
+            }
+        }
+
+        int res = sync_.fsync(path, isdatasync != 0);
+        if (!res && journal_)
+            journal_->waitFor(path);
+        return res;
+    }
 
+    int release(const char *path, struct fuse_file_info *fi)
+    {
+        std::unique_ptr<FileHandle> h(&handle(fi));
+        if (h->written())
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                auto& handles = writers_[h->path()];
+                handles.erase(std::find(handles.begin(), handles.end(), h.get()));
+                if (handles.empty())
+                    writers_.erase(h->path());
+            }
+
+            flush(path, *h);
             sync_.sync(path);
         }
 
         return 0;
     }
 
+    // replays the journal and resumes the pushes left in the push log, once mounted
+    void start()
+    {
+        if (journal_)
+            journal_->start();
+        sync_.start();
+    }
+
+    void collect(Stats::Snapshot& s)
+    {
+        sync_.collect(s);
+        if (journal_)
+            journal_->collect(s);
+    }
+
+    void flush()
+    {
+        sync_.flush();
+    }
+
+    DirtyBudget& budget()
+    {
+        return sync_.budget();
+    }
+
+private:
+    static FileHandle& handle(struct fuse_file_info *fi)
+    {
+        return *reinterpret_cast<FileHandle*>(fi->fh);
+    }
+
+    // true if the op failed to be journaled after it was done in the cache, which has to undo it:
+    // the cache must never hold a change the source is not going to get
+    bool unjournaled(const char* path, int res)
+    {
+        if (!res || !journal_)
+            return false;
+
+        LOG(Error) << "failed to journal an operation on '" << path << "', undoing it: " << strerror(-res);
+        return true;
+    }
+
+    // records a write through a handle, which needs no lock shared with other handles
+    void written(const char* path, FileHandle& h, off_t offset, off_t size)
+    {
+        sync_.reserve(h.write(offset, size));
+
+        // the first write makes the handle visible to fsync through other handles
+        if (h.mark())
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            writers_[h.path()].push_back(&h);
+        }
+
+        if (sync_.pressure())
+        {
+            flush(path, h);
+
+            // bytes reserved by other handles can only be pushed once handed over
+            sync_.throttle(path, [this](){ flushAll(); });
+        }
+    }
+
+    // hands the changes of every written handle to the background sync
+    void flushAll()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (const auto& handles : writers_)
+        {
+            for (auto* h : handles.second)
+                flush(handles.first.c_str(), *h);
+        }
+    }
+
+    // hands the changes collected by the handle to the background sync
+    void flush(const char* path, FileHandle& h)
+    {
+        Dirty changes;
+        off_t charged = 0;
+        if (h.take(changes, charged))
+            sync_.write(path, changes, charged);
+    }
+
+    // keeps the handles written under 'from' findable under their new name
+    void renamed(const char* from, const char* to)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        const auto it = writers_.find(from);
+        if (it == writers_.end())
+            return;
+
+        auto handles = std::move(it->second);
+        writers_.erase(it);
+        for (auto* h : handles)
+            h->rename(to);
+
+        auto& target = writers_[to];
+        target.insert(target.end(), handles.begin(), handles.end());
+    }
+
+    // lazy tree of the read-write subtree 'path' is in, only those paths are routed here
+    LazyTree& tree(const char* path)
+    {
+        return *trees_[policies_.find(path).tree_];
+    }
+
+    // cached counterpart of 'path' in a per-thread buffer, valid until the next call on the thread
+    const std::string& local(const char* path) const
+    {
+        thread_local std::string buffer;
+        buffer.assign(cache_.string()).append(path);
+        return buffer;
+    }
+
+    // materializes the file for opening; a file emptied by 'truncate' is owned without fetching
+    int prepare(const char* path, const LazyTree::Truncate& truncate = LazyTree::Truncate())
+    {
+        auto& tree = this->tree(path);
+        int res = tree.parent(path);
+        if (res)
+            return res;
+
+        return truncate ? tree.own(path, truncate) : tree.content(path);
+    }
 
 private:
     const boost::filesystem::path src_;
     const boost::filesystem::path cache_;
-    const boost::filesystem::path readWrite_;
+    const boost::filesystem::path temp_;
+    const PolicyTree& policies_;
+
+    const Source::Ptr source_;
+    // with write-back metadata operations go to the journal rather than straight to the source
+    const std::unique_ptr<Journal> journal_;
+    const Source::Ptr metadata_;
 
+    std::vector<std::unique_ptr<LazyTree>> trees_;
     BackgroundSync sync_;
 
+    // handles that have been written, by their path; only the first write through a handle,
+    // releases, renames, fsyncs and writers held at the dirty limit touch it
     std::mutex mutex_;
-    std::set<uint64_t> writtenFiles_;
+    boost::unordered_map<std::string, std::vector<FileHandle*>> writers_;
 };
 
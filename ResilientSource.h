@@ -0,0 +1,503 @@
+#pragma once
+
+#include "Source.h"
+#include "ThreadPool.h"
+#include "Logger.h"
+#include "Trace.h"
+#include "Stats.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+
+#include <boost/filesystem.hpp>
+#include <boost/unordered_map.hpp>
+
+// Keeps a hanging or failing source from taking the whole file system down with it.
+//
+// Every op runs on a pool of threads of its own while the caller waits up to a timeout,
+// -ETIMEDOUT after that. Transfers are not timed out unless asked to: how long a big file
+// takes over a slow link says nothing about the source being gone. A syscall stuck on a
+// dead share cannot be cancelled, so a timed out op is abandoned: it keeps its thread, works
+// on copies of its arguments and its results are thrown away. A fetch goes to a file of its
+// own, renamed into place by the caller, and a path with an abandoned push still running is
+// not pushed again meanwhile. Once the path is unlinked, renamed or its directory removed,
+// the abandoned push is cancelled, it no longer puts its stale content in place.
+//
+// Consecutive timeouts and outage errors (see Source::unavailable) trip a circuit breaker.
+// While it is open every op fails at once with -EHOSTDOWN, so misses come back quickly and
+// whatever is cached keeps being served. After a cooldown a single probe is let through,
+// its success closes the breaker. Background work that can wait for the source calls
+// 'hold' rather than failing over and over.
+//
+// The pool is created by 'start' once mounted, ops run on the calling thread before that.
+// A full pool queue fails the op with -EAGAIN rather than waiting past the timeout, and
+// workers still stuck at destruction are left behind so that unmounting does not hang.
+class ResilientSource : public Source
+{
+public:
+    struct Settings
+    {
+        std::chrono::milliseconds timeout_{10000};          // metadata ops, 0 disables the layer
+        std::chrono::milliseconds transferTimeout_{0};      // fetch, push, patch and fsync, 0 lets them take as long as they need
+        std::size_t threads_ = 32;
+        uint32_t failures_ = 5;                             // consecutive failures tripping the breaker
+        std::chrono::milliseconds cooldown_{5000};          // before a probe is let through
+
+        bool enabled() const
+        {
+            return timeout_.count() > 0;
+        }
+    };
+
+    ResilientSource(const Source::Ptr& source, const Settings& settings)
+        : source_(source)
+        , settings_(settings)
+        , state_(Closed)
+        , failures_(0)
+        , reopen_(0)
+        , trips_(0)
+        , timeouts_(0)
+        , rejected_(0)
+        , full_(0)
+        , abandoned_(std::make_shared<Abandoned>())
+        , pool_(nullptr)
+    {
+    }
+
+    ~ResilientSource()
+    {
+        std::unique_ptr<ThreadPool> pool(pool_.load());
+        if (!pool)
+            return;
+
+        if (const auto stuck = abandoned_->stuck_.load())
+        {
+            LOG(Warning) << "leaving " << stuck << " stuck source operations behind";
+            pool->detach();
+            pool.release();
+        }
+    }
+
+    // starts the pool, called once mounted
+    void start()
+    {
+        if (!pool_.load())
+            pool_.store(new ThreadPool(settings_.threads_, QUEUE_LIMIT));
+    }
+
+    int lstat(const char* path, struct stat* st) override
+    {
+        const auto out = std::make_shared<struct stat>();
+        const int res = call(settings_.timeout_, [source = source_, path = std::string(path), out](){
+            return source->lstat(path.c_str(), out.get());
+        });
+        if (!res)
+            *st = *out;
+        return res;
+    }
+
+    int access(const char* path, int mask) override
+    {
+        return call(settings_.timeout_, [source = source_, path = std::string(path), mask](){
+            return source->access(path.c_str(), mask);
+        });
+    }
+
+    int readlink(const char* path, char* buf, size_t size) override
+    {
+        const auto out = std::make_shared<std::vector<char>>(size);
+        const int res = call(settings_.timeout_, [source = source_, path = std::string(path), out](){
+            return source->readlink(path.c_str(), out->data(), out->size());
+        });
+        if (res > 0)
+            memcpy(buf, out->data(), res);
+        return res;
+    }
+
+    int list(const char* path, std::vector<DirEntry>& entries) override
+    {
+        const auto out = std::make_shared<std::vector<DirEntry>>();
+        const int res = call(settings_.timeout_, [source = source_, path = std::string(path), out](){
+            return source->list(path.c_str(), *out);
+        });
+        if (!res)
+            entries.insert(entries.end(), out->begin(), out->end());
+        return res;
+    }
+
+    int fetch(const char* path, const boost::filesystem::path& local) override
+    {
+        const auto temp = boost::filesystem::unique_path(local.string() + ".%%%%%%%%");
+        int res = call(settings_.transferTimeout_, [source = source_, path = std::string(path), temp](){
+            return source->fetch(path.c_str(), temp);
+        }, [temp](){
+            boost::system::error_code ignore;
+            boost::filesystem::remove(temp, ignore);
+        });
+
+        boost::system::error_code error;
+        if (!res)
+        {
+            boost::filesystem::rename(temp, local, error);
+            res = error ? -error.value() : 0;
+        }
+        if (res)
+            boost::filesystem::remove(temp, error);
+        return res;
+    }
+
+    int push(const boost::filesystem::path& local, const char* path, struct stat* pushed, const Cancelled&) override
+    {
+        const auto out = std::make_shared<struct stat>();
+        const int res = call(settings_.transferTimeout_, [source = source_, path = std::string(path), local, out, abandoned = abandoned_](){
+            return source->push(local, path.c_str(), out.get(), [abandoned, path](){ return cancelled(*abandoned, path); });
+        }, Late(), path);
+        if (!res)
+            *pushed = *out;
+        return res;
+    }
+
+    int patch(const boost::filesystem::path& local, const char* path, const std::vector<Extent>& extents, off_t shrink,
+              struct stat* pushed, const Cancelled&) override
+    {
+        const auto out = std::make_shared<struct stat>();
+        const int res = call(settings_.transferTimeout_, [source = source_, path = std::string(path), local, extents, shrink, out,
+                                                          abandoned = abandoned_](){
+            return source->patch(local, path.c_str(), extents, shrink, out.get(), [abandoned, path](){ return cancelled(*abandoned, path); });
+        }, Late(), path);
+        if (!res)
+            *pushed = *out;
+        return res;
+    }
+
+    int fsync(const char* path, bool data) override
+    {
+        return call(settings_.transferTimeout_, [source = source_, path = std::string(path), data](){
+            return source->fsync(path.c_str(), data);
+        });
+    }
+
+    int mkdir(const char* path, mode_t mode) override
+    {
+        return call(settings_.timeout_, [source = source_, path = std::string(path), mode](){
+            return source->mkdir(path.c_str(), mode);
+        });
+    }
+
+    int unlink(const char* path) override
+    {
+        cancel(path);
+        return call(settings_.timeout_, [source = source_, path = std::string(path)](){
+            return source->unlink(path.c_str());
+        });
+    }
+
+    int rmdir(const char* path) override
+    {
+        cancel(path);
+        return call(settings_.timeout_, [source = source_, path = std::string(path)](){
+            return source->rmdir(path.c_str());
+        });
+    }
+
+    int symlink(const char* target, const char* path) override
+    {
+        return call(settings_.timeout_, [source = source_, target = std::string(target), path = std::string(path)](){
+            return source->symlink(target.c_str(), path.c_str());
+        });
+    }
+
+    int rename(const char* from, const char* to) override
+    {
+        cancel(from);
+        cancel(to);
+        return call(settings_.timeout_, [source = source_, from = std::string(from), to = std::string(to)](){
+            return source->rename(from.c_str(), to.c_str());
+        });
+    }
+
+    int link(const char* from, const char* to) override
+    {
+        return call(settings_.timeout_, [source = source_, from = std::string(from), to = std::string(to)](){
+            return source->link(from.c_str(), to.c_str());
+        });
+    }
+
+    int chmod(const char* path, mode_t mode) override
+    {
+        return call(settings_.timeout_, [source = source_, path = std::string(path), mode](){
+            return source->chmod(path.c_str(), mode);
+        });
+    }
+
+    int chown(const char* path, uid_t uid, gid_t gid) override
+    {
+        return call(settings_.timeout_, [source = source_, path = std::string(path), uid, gid](){
+            return source->chown(path.c_str(), uid, gid);
+        });
+    }
+
+    int create(const char* path, int flags, mode_t mode) override
+    {
+        return call(settings_.timeout_, [source = source_, path = std::string(path), flags, mode](){
+            return source->create(path.c_str(), flags, mode);
+        });
+    }
+
+    // waits until the breaker lets ops through again, at most for one cooldown
+    void hold() override
+    {
+        std::unique_lock<std::mutex> lock(breakerLock_);
+        const auto deadline = std::chrono::steady_clock::now() + settings_.cooldown_;
+        while (state_ != Closed && !(state_ == Open && monotonicNanoseconds() >= reopen_))
+        {
+            if (held_.wait_until(lock, deadline) == std::cv_status::timeout)
+                break;
+        }
+    }
+
+    void collect(Stats::Snapshot& s) const
+    {
+        {
+            std::unique_lock<std::mutex> lock(breakerLock_);
+            s.gauges_.emplace_back("source_available", state_ == Closed ? 1 : 0);
+        }
+        s.gauges_.emplace_back("source_trips", trips_.load(std::memory_order_relaxed));
+        s.gauges_.emplace_back("source_timeouts", timeouts_.load(std::memory_order_relaxed));
+        s.gauges_.emplace_back("source_rejected", rejected_.load(std::memory_order_relaxed));
+        s.gauges_.emplace_back("source_queue_full", full_.load(std::memory_order_relaxed));
+        s.gauges_.emplace_back("source_stuck", abandoned_->stuck_.load(std::memory_order_relaxed));
+    }
+
+private:
+    enum State { Closed, Open, Probing };
+
+    typedef std::function<int()> Op;
+    typedef std::function<void()> Late;
+
+    // shared by the caller and the pool thread running the op
+    struct Call
+    {
+        std::mutex lock_;
+        std::condition_variable cond_;
+        bool running_ = false;
+        bool done_ = false;
+        bool abandoned_ = false;
+        int result_ = 0;
+    };
+
+    // what an abandoned op touches once it finishes, it may outlive this object
+    struct Abandoned
+    {
+        std::mutex lock_;
+        std::condition_variable done_;
+        boost::unordered_map<std::string, bool> guarded_;  // paths of abandoned pushes, true once cancelled
+        std::atomic<uint64_t> stuck_{0};
+    };
+
+    // runs 'op' on the pool; 'late' cleans up after an abandoned op once it finishes, ops
+    // with a 'guard' wait for an abandoned op with the same guard to finish first
+    int call(std::chrono::milliseconds timeout, const Op& op, const Late& late = Late(), const std::string& guard = std::string())
+    {
+        bool probe = false;
+        if (!admit(probe))
+        {
+            ++rejected_;
+            return -EHOSTDOWN;
+        }
+
+        ThreadPool* const pool = pool_.load();
+        if (!pool)
+        {
+            const int res = op();
+            report(unavailable(res), probe);
+            return res;
+        }
+
+        const auto abandoned = abandoned_;
+        if (!guard.empty())
+        {
+            // the abandoned op is as good as a timeout of this one if it does not finish in time
+            std::unique_lock<std::mutex> lock(abandoned->lock_);
+            if (!wait(abandoned->done_, lock, timeout, [&abandoned, &guard](){ return !abandoned->guarded_.count(guard); }))
+            {
+                lock.unlock();
+                ++timeouts_;
+                report(true, probe);
+                return -ETIMEDOUT;
+            }
+        }
+
+        const auto call = std::make_shared<Call>();
+        const bool queued = pool->trySubmit([abandoned, call, op, late, guard](){
+            {
+                std::unique_lock<std::mutex> lock(call->lock_);
+                if (call->abandoned_)
+                    return;
+                call->running_ = true;
+            }
+
+            const int res = op();
+
+            std::unique_lock<std::mutex> lock(call->lock_);
+            call->result_ = res;
+            call->done_ = true;
+            if (!call->abandoned_)
+            {
+                call->cond_.notify_all();
+                return;
+            }
+            lock.unlock();
+
+            LOG(Info) << "timed out source operation finished: " << (res < 0 ? strerror(-res) : "success");
+            if (late)
+                late();
+            if (!guard.empty())
+            {
+                std::unique_lock<std::mutex> guardLock(abandoned->lock_);
+                abandoned->guarded_.erase(guard);
+                abandoned->done_.notify_all();
+            }
+            --abandoned->stuck_;
+        });
+
+        if (!queued)
+        {
+            // every thread is stuck and the queue behind them is full, waiting would not help
+            ++full_;
+            report(true, probe);
+            return -EAGAIN;
+        }
+
+        std::unique_lock<std::mutex> lock(call->lock_);
+        if (!wait(call->cond_, lock, timeout, [&call](){ return call->done_; }))
+        {
+            call->abandoned_ = true;
+            if (call->running_)
+            {
+                ++abandoned->stuck_;
+                // before the op can see it is abandoned, so it is released after being taken
+                if (!guard.empty())
+                {
+                    std::unique_lock<std::mutex> guardLock(abandoned->lock_);
+                    abandoned->guarded_.emplace(guard, false);
+                }
+            }
+            lock.unlock();
+
+            ++timeouts_;
+            LOG(Warning) << "source operation timed out after " << timeout.count() << "ms";
+            report(true, probe);
+            return -ETIMEDOUT;
+        }
+
+        const int res = call->result_;
+        lock.unlock();
+
+        report(unavailable(res), probe);
+        return res;
+    }
+
+    // waits until 'done', at most for 'timeout' unless that is 0; false if it timed out
+    template <typename Predicate>
+    static bool wait(std::condition_variable& cond, std::unique_lock<std::mutex>& lock, std::chrono::milliseconds timeout, Predicate done)
+    {
+        if (timeout.count() > 0)
+            return cond.wait_for(lock, timeout, done);
+
+        cond.wait(lock, done);
+        return true;
+    }
+
+    // keeps an abandoned push of the path, or of anything under it, from putting its content in place
+    void cancel(const std::string& path)
+    {
+        std::unique_lock<std::mutex> lock(abandoned_->lock_);
+        for (auto& g : abandoned_->guarded_)
+        {
+            if (g.first.compare(0, path.size(), path) == 0 && (g.first.size() == path.size() || g.first[path.size()] == '/'))
+                g.second = true;
+        }
+    }
+
+    static bool cancelled(Abandoned& abandoned, const std::string& path)
+    {
+        std::unique_lock<std::mutex> lock(abandoned.lock_);
+        const auto it = abandoned.guarded_.find(path);
+        return it != abandoned.guarded_.end() && it->second;
+    }
+
+    // false if the op has to fail right away, 'probe' is set for the one let through an open breaker
+    bool admit(bool& probe)
+    {
+        std::unique_lock<std::mutex> lock(breakerLock_);
+        if (state_ == Closed)
+            return true;
+
+        if (state_ == Open && monotonicNanoseconds() >= reopen_)
+        {
+            state_ = Probing;
+            probe = true;
+            return true;
+        }
+        return false;
+    }
+
+    void report(bool failed, bool probe)
+    {
+        std::unique_lock<std::mutex> lock(breakerLock_);
+        if (!failed)
+        {
+            if (state_ != Closed)
+            {
+                LOG(Info) << "source is available again";
+            }
+            state_ = Closed;
+            failures_ = 0;
+            held_.notify_all();
+            return;
+        }
+
+        ++failures_;
+        if (probe || (state_ == Closed && failures_ >= settings_.failures_))
+        {
+            if (state_ == Closed)
+            {
+                ++trips_;
+                LOG(Error) << "source unavailable after " << failures_ << " failures, serving from the cache only";
+            }
+            state_ = Open;
+            reopen_ = monotonicNanoseconds() + std::chrono::duration_cast<std::chrono::nanoseconds>(settings_.cooldown_).count();
+            held_.notify_all();
+        }
+    }
+
+private:
+    static const std::size_t QUEUE_LIMIT = 4096;
+
+    const Source::Ptr source_;
+    const Settings settings_;
+
+    mutable std::mutex breakerLock_;
+    std::condition_variable held_;
+    State state_;
+    uint32_t failures_;
+    uint64_t reopen_;
+
+    std::atomic<uint64_t> trips_;
+    std::atomic<uint64_t> timeouts_;
+    std::atomic<uint64_t> rejected_;
+    std::atomic<uint64_t> full_;
+
+    const std::shared_ptr<Abandoned> abandoned_;
+
+    // set by 'start', leaked by the destructor if some of its threads are stuck
+    std::atomic<ThreadPool*> pool_;
+};
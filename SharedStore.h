@@ -0,0 +1,537 @@
+#pragma once
+
+#include "Logger.h"
+#include "Stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <atomic>
+#include <functional>
+#include <stdexcept>
+
+#include <boost/filesystem.hpp>
+
+// Read-only content shared by all cachefs processes of a host mounting the same source, so
+// each file is fetched and stored once however many mounts read it.
+//
+// Files are stored under a hash of their path in 'objects', and an index of them (size, last
+// use, pinned) lives in a file mapped by every process and guarded by a robust process shared
+// mutex, so a process dying while holding it does not wedge the others. The index is rebuilt
+// from the objects when it is created.
+//
+// A fill takes an flock on a lock file of its object: one process (or thread) fetches, the
+// others wait on the lock and find the object indexed once they get it. Once the stored bytes
+// exceed the size limit, whoever filled last evicts the least recently used objects it
+// samples until they are back under 90% of the limit. Pinned objects are never evicted.
+// An object evicted while open stays readable through the open descriptor.
+class SharedStore
+{
+public:
+    typedef std::function<int(const boost::filesystem::path&)> Fetch;
+
+    struct Settings
+    {
+        boost::filesystem::path dir_;   // empty keeps the content private to the process
+        uint64_t size_ = 0;             // bytes stored at most, 0 is unlimited
+        uint64_t entries_ = 1 << 20;    // index slots, fixed once the index is created
+    };
+
+    // throws std::runtime_error if the store cannot be set up
+    explicit SharedStore(const Settings& settings)
+        : settings_(settings)
+        , objects_(settings.dir_ / "objects")
+        , fd_(-1)
+        , map_(nullptr)
+        , size_(0)
+        , header_(nullptr)
+        , slots_(nullptr)
+        , waits_(0)
+    {
+        boost::system::error_code error;
+        boost::filesystem::create_directories(objects_, error);
+        if (error)
+            throw std::runtime_error("failed to create " + objects_.string() + ": " + error.message());
+
+        const auto index = settings.dir_ / "index";
+        fd_ = ::open(index.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd_ == -1)
+            throw std::runtime_error("failed to open " + index.string() + ": " + strerror(errno));
+
+        // whoever comes first creates the index, the others wait for it
+        flock(fd_, LOCK_EX);
+        try
+        {
+            attach();
+        }
+        catch (...)
+        {
+            flock(fd_, LOCK_UN);
+            detach();
+            throw;
+        }
+        flock(fd_, LOCK_UN);
+
+        // the limit may be lower than what other processes left
+        evict();
+
+        LOG(Info) << "shared cache " << settings.dir_.string() << ": " << header_->entries_ << " files, "
+                  << header_->bytes_ << " bytes";
+    }
+
+    ~SharedStore()
+    {
+        detach();
+    }
+
+    boost::filesystem::path object(const char* path) const
+    {
+        return object(key(path));
+    }
+
+    // true if the content of 'path' is stored, marking it used
+    bool stored(const char* path)
+    {
+        return touch(key(path));
+    }
+
+    // makes sure the content of 'path' is stored, calling 'fetch' to copy it into a temp file
+    // unless it is there already or another process fetches it meanwhile
+    int fill(const char* path, bool pinned, const Fetch& fetch)
+    {
+        const auto k = key(path);
+        if (touch(k))
+            return 0;
+
+        const auto object = this->object(k);
+        boost::system::error_code error;
+        boost::filesystem::create_directories(object.parent_path(), error);
+        if (error)
+            return -error.value();
+
+        const auto lockFile = object.string() + ".lock";
+        int fd = -1;
+        while (true)
+        {
+            fd = ::open(lockFile.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if (fd == -1)
+                return -errno;
+
+            while (flock(fd, LOCK_EX) == -1 && errno == EINTR)
+                ;
+
+            // the one before us removes the lock file when done, a new one has to be locked then
+            struct stat locked, current;
+            if (fstat(fd, &locked) == 0 && ::stat(lockFile.c_str(), &current) == 0 && locked.st_ino == current.st_ino)
+                break;
+            close(fd);
+        }
+
+        int res = 0;
+        if (touch(k))
+        {
+            ++waits_;
+        }
+        else
+        {
+            const auto temp = object.string() + ".tmp";
+            res = fetch(temp);
+            if (!res && ::rename(temp.c_str(), object.c_str()) == -1)
+                res = -errno;
+
+            struct stat st;
+            if (!res && ::stat(object.c_str(), &st) == -1)
+                res = -errno;
+
+            if (res)
+                ::unlink(temp.c_str());
+            else
+                insert(k, st.st_size, pinned);
+        }
+
+        ::unlink(lockFile.c_str());
+        close(fd);
+
+        if (!res)
+            evict();
+        return res;
+    }
+
+    // drops the content of 'path', a no-op unless it is stored
+    void remove(const char* path)
+    {
+        const auto k = key(path);
+        {
+            Guard guard(*header_);
+            Slot* slot = find(k);
+            if (!slot)
+                return;
+            erase(*slot);
+        }
+        ::unlink(object(k).c_str());
+    }
+
+    void collect(Stats::Snapshot& s) const
+    {
+        {
+            Guard guard(*header_);
+            s.gauges_.emplace_back("shared_bytes", header_->bytes_);
+            s.gauges_.emplace_back("shared_files", header_->entries_);
+            s.gauges_.emplace_back("shared_evictions", header_->evictions_);
+        }
+        s.gauges_.emplace_back("shared_waits", waits_.load(std::memory_order_relaxed));
+    }
+
+private:
+    static const uint64_t MAGIC = 0x3178646e49736663ull;  // "cfsIndx1"
+    static const uint64_t EMPTY = 0;
+    static const uint64_t DELETED = 1;
+    static const uint64_t PINNED = 1;
+    static const std::size_t SAMPLES = 16;
+
+    struct Slot
+    {
+        uint64_t key_;      // EMPTY, DELETED or the hash of a path
+        uint64_t size_;
+        uint64_t used_;     // wall clock, the monotonic one is per boot and the index outlives it
+        uint64_t flags_;
+    };
+
+    struct Header
+    {
+        uint64_t magic_;
+        uint64_t capacity_;
+        pthread_mutex_t lock_;
+        uint64_t bytes_;
+        uint64_t entries_;
+        uint64_t deleted_;
+        uint64_t evictions_;
+    };
+
+    static const std::size_t SLOTS_OFFSET = (sizeof(Header) + 63) / 64 * 64;
+
+    class Guard
+    {
+    public:
+        explicit Guard(Header& header)
+            : lock_(header.lock_)
+        {
+            // a process died holding it, at worst the counters are off by its last update
+            if (pthread_mutex_lock(&lock_) == EOWNERDEAD)
+                pthread_mutex_consistent(&lock_);
+        }
+
+        ~Guard()
+        {
+            pthread_mutex_unlock(&lock_);
+        }
+
+    private:
+        pthread_mutex_t& lock_;
+    };
+
+    // called with the index file locked
+    void attach()
+    {
+        struct stat st;
+        if (fstat(fd_, &st) == -1)
+            throw std::runtime_error(std::string("failed to stat the shared index: ") + strerror(errno));
+
+        bool create = static_cast<std::size_t>(st.st_size) < SLOTS_OFFSET;
+        if (!create)
+        {
+            Header header;
+            if (pread(fd_, &header, sizeof(header), 0) != sizeof(header))
+                throw std::runtime_error(std::string("failed to read the shared index: ") + strerror(errno));
+            create = header.magic_ != MAGIC || static_cast<uint64_t>(st.st_size) != SLOTS_OFFSET + header.capacity_ * sizeof(Slot);
+            if (!create)
+                map(st.st_size);
+        }
+
+        if (!create)
+            return;
+
+        const uint64_t capacity = std::max<uint64_t>(settings_.entries_, 1024);
+        const std::size_t size = SLOTS_OFFSET + capacity * sizeof(Slot);
+        if (ftruncate(fd_, 0) == -1 || ftruncate(fd_, size) == -1)
+            throw std::runtime_error(std::string("failed to size the shared index: ") + strerror(errno));
+        map(size);
+
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&header_->lock_, &attr);
+        pthread_mutexattr_destroy(&attr);
+        header_->capacity_ = capacity;
+
+        rebuild();
+
+        std::atomic_thread_fence(std::memory_order_release);
+        header_->magic_ = MAGIC;
+        msync(map_, SLOTS_OFFSET, MS_SYNC);
+    }
+
+    void map(std::size_t size)
+    {
+        map_ = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (map_ == MAP_FAILED)
+        {
+            map_ = nullptr;
+            throw std::runtime_error(std::string("failed to map the shared index: ") + strerror(errno));
+        }
+        size_ = size;
+        header_ = static_cast<Header*>(map_);
+        slots_ = reinterpret_cast<Slot*>(static_cast<char*>(map_) + SLOTS_OFFSET);
+    }
+
+    void detach()
+    {
+        if (map_)
+            munmap(map_, size_);
+        if (fd_ != -1)
+            close(fd_);
+        map_ = nullptr;
+        fd_ = -1;
+    }
+
+    // indexes the objects already stored, called while creating the index
+    void rebuild()
+    {
+        boost::system::error_code error;
+        for (boost::filesystem::recursive_directory_iterator it(objects_, error), end; !error && it != end; it.increment(error))
+        {
+            const auto name = it->path().filename().string();
+            if (it->path().extension() == ".tmp")
+            {
+                // left by a process that died while fetching
+                boost::system::error_code ignore;
+                boost::filesystem::remove(it->path(), ignore);
+                continue;
+            }
+
+            // objects/<2 hex digits>/<14 hex digits>
+            const auto hex = it->path().parent_path().filename().string() + name;
+            char* last = nullptr;
+            const uint64_t k = strtoull(hex.c_str(), &last, 16);
+            struct stat st;
+            if (hex.size() != 16 || *last || k <= DELETED || ::stat(it->path().c_str(), &st) == -1 || !S_ISREG(st.st_mode))
+                continue;
+
+            if (header_->entries_ + 1 >= header_->capacity_ * 9 / 10)
+                break;
+            store(k, st.st_size, 0, static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000ull + st.st_mtim.tv_nsec);
+        }
+    }
+
+    // FNV-1a, stable across builds and processes unlike std::hash
+    static uint64_t key(const char* path)
+    {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (; *path; ++path)
+            hash = (hash ^ static_cast<unsigned char>(*path)) * 0x100000001b3ull;
+        return hash > DELETED ? hash : hash + 2;
+    }
+
+    boost::filesystem::path object(uint64_t k) const
+    {
+        char name[17];
+        snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(k));
+        return objects_ / std::string(name, 2) / std::string(name + 2, 14);
+    }
+
+    static uint64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // true if stored, marking it used
+    bool touch(uint64_t k)
+    {
+        Guard guard(*header_);
+        Slot* slot = find(k);
+        if (!slot)
+            return false;
+
+        slot->used_ = now();
+        return true;
+    }
+
+    void insert(uint64_t k, uint64_t size, bool pinned)
+    {
+        std::vector<uint64_t> victims;
+        {
+            Guard guard(*header_);
+
+            // a full index evicts by count, however few bytes are stored
+            while (header_->entries_ + 1 >= header_->capacity_ * 9 / 10)
+            {
+                const uint64_t victim = evictOne();
+                if (victim == EMPTY)
+                    break;
+                victims.push_back(victim);
+            }
+
+            if (header_->deleted_ > header_->capacity_ / 8)
+                compact();
+
+            if (header_->entries_ + 1 < header_->capacity_)
+                store(k, size, pinned ? PINNED : 0, now());
+            else
+                LOG(Warning) << "shared cache index is full of pinned files, not indexing another one";
+        }
+
+        for (const auto victim : victims)
+            ::unlink(object(victim).c_str());
+    }
+
+    // needs a free slot, called under the lock
+    void store(uint64_t k, uint64_t size, uint64_t flags, uint64_t used)
+    {
+        if (Slot* slot = find(k))
+        {
+            header_->bytes_ += size - slot->size_;
+            slot->size_ = size;
+            slot->flags_ |= flags;
+            slot->used_ = used;
+            return;
+        }
+
+        const uint64_t capacity = header_->capacity_;
+        for (uint64_t i = k % capacity; ; i = (i + 1) % capacity)
+        {
+            Slot& slot = slots_[i];
+            if (slot.key_ != EMPTY && slot.key_ != DELETED)
+                continue;
+
+            if (slot.key_ == DELETED)
+                --header_->deleted_;
+            slot = Slot{k, size, used, flags};
+            header_->bytes_ += size;
+            ++header_->entries_;
+            return;
+        }
+    }
+
+    // called under the lock
+    Slot* find(uint64_t k)
+    {
+        const uint64_t capacity = header_->capacity_;
+        for (uint64_t i = k % capacity, n = 0; n < capacity; i = (i + 1) % capacity, ++n)
+        {
+            Slot& slot = slots_[i];
+            if (slot.key_ == k)
+                return &slot;
+            if (slot.key_ == EMPTY)
+                return nullptr;
+        }
+        return nullptr;
+    }
+
+    // called under the lock
+    void erase(Slot& slot)
+    {
+        header_->bytes_ -= std::min(slot.size_, header_->bytes_);
+        --header_->entries_;
+        ++header_->deleted_;
+        slot = Slot{DELETED, 0, 0, 0};
+    }
+
+    // drops the deleted slots, which only ever make probing longer; called under the lock
+    void compact()
+    {
+        std::vector<Slot> live;
+        live.reserve(header_->entries_);
+        for (uint64_t i = 0; i < header_->capacity_; ++i)
+        {
+            if (slots_[i].key_ != EMPTY && slots_[i].key_ != DELETED)
+                live.push_back(slots_[i]);
+        }
+
+        memset(slots_, 0, header_->capacity_ * sizeof(Slot));
+        header_->bytes_ = 0;
+        header_->entries_ = 0;
+        header_->deleted_ = 0;
+        for (const auto& slot : live)
+            store(slot.key_, slot.size_, slot.flags_, slot.used_);
+    }
+
+    // the least recently used of a sample of unpinned objects, removed from the index; EMPTY if
+    // there is nothing to evict. Slots are placed by hash, so the ones following a random start
+    // make a random sample. Called under the lock.
+    uint64_t evictOne()
+    {
+        thread_local std::mt19937_64 random(std::random_device{}());
+
+        const uint64_t capacity = header_->capacity_;
+        const uint64_t start = random() % capacity;
+        Slot* oldest = nullptr;
+        std::size_t sampled = 0;
+        for (uint64_t n = 0; sampled < SAMPLES && n < capacity; ++n)
+        {
+            Slot& slot = slots_[(start + n) % capacity];
+            if (slot.key_ == EMPTY || slot.key_ == DELETED || (slot.flags_ & PINNED))
+                continue;
+
+            ++sampled;
+            if (!oldest || slot.used_ < oldest->used_)
+                oldest = &slot;
+        }
+
+        if (!oldest)
+            return EMPTY;
+
+        const uint64_t victim = oldest->key_;
+        erase(*oldest);
+        ++header_->evictions_;
+        return victim;
+    }
+
+    void evict()
+    {
+        if (!settings_.size_)
+            return;
+
+        std::vector<uint64_t> victims;
+        {
+            Guard guard(*header_);
+            if (header_->bytes_ <= settings_.size_)
+                return;
+
+            while (header_->bytes_ > settings_.size_ / 10 * 9)
+            {
+                const uint64_t victim = evictOne();
+                if (victim == EMPTY)
+                    break;
+                victims.push_back(victim);
+            }
+        }
+
+        LOG(Debug) << "evicted " << victims.size() << " files from the shared cache";
+        for (const auto victim : victims)
+            ::unlink(object(victim).c_str());
+    }
+
+private:
+    const Settings settings_;
+    const boost::filesystem::path objects_;
+
+    int fd_;
+    void* map_;
+    std::size_t size_;
+    Header* header_;
+    Slot* slots_;
+
+    std::atomic<uint64_t> waits_;   // fills satisfied by someone else's fetch
+};
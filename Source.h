@@ -0,0 +1,729 @@
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+
+#include <boost/filesystem.hpp>
+
+#include "Dirty.h"
+#include "Logger.h"
+#include "IoEngine.h"
+
+struct DirEntry
+{
+    DirEntry(struct stat& in, const char* name) : stat_(in), name_(name) {}
+
+    struct stat stat_;
+    std::string name_;
+};
+
+// Everything cachefs does with the source tree goes through this interface. Paths are
+// relative to the source root (as FUSE passes them), results are 0 or -errno.
+class Source
+{
+public:
+    typedef std::shared_ptr<Source> Ptr;
+    // asked by a push right before it puts its content in place, true once it must not any more
+    typedef std::function<bool()> Cancelled;
+
+    virtual ~Source() {}
+
+    virtual int lstat(const char* path, struct stat* st) = 0;
+    virtual int access(const char* path, int mask) = 0;
+    // returns the length of the link target, which is not zero terminated
+    virtual int readlink(const char* path, char* buf, size_t size) = 0;
+    virtual int list(const char* path, std::vector<DirEntry>& entries) = 0;
+
+    // copies the source file to a local one, replacing it
+    virtual int fetch(const char* path, const boost::filesystem::path& local) = 0;
+    // replaces the source file with a local one atomically, creating missing parent directories;
+    // 'pushed' gets the stat of the file put in place, before anybody else could change it;
+    // -ECANCELED with nothing changed if 'cancelled' (which may be empty) says so at the last moment
+    virtual int push(const boost::filesystem::path& local, const char* path, struct stat* pushed, const Cancelled& cancelled) = 0;
+    // updates an existing source file atomically: cuts it to 'shrink' (unless it is -1), copies
+    // the 'extents' of the local file over and sets the size to the local one; the rest as above
+    virtual int patch(const boost::filesystem::path& local, const char* path, const std::vector<Extent>& extents, off_t shrink,
+                      struct stat* pushed, const Cancelled& cancelled) = 0;
+    // makes the source file durable, only its data (and size) if 'data' is set
+    virtual int fsync(const char* path, bool data) = 0;
+
+    virtual int mkdir(const char* path, mode_t mode) = 0;
+    virtual int unlink(const char* path) = 0;
+    virtual int rmdir(const char* path) = 0;
+    virtual int symlink(const char* target, const char* path) = 0;
+    virtual int rename(const char* from, const char* to) = 0;
+    virtual int link(const char* from, const char* to) = 0;
+    virtual int chmod(const char* path, mode_t mode) = 0;
+    virtual int chown(const char* path, uid_t uid, gid_t gid) = 0;
+    virtual int create(const char* path, int flags, mode_t mode) = 0;
+
+    // blocks while the source is known to be unreachable, for work that can wait for it
+    virtual void hold() {}
+
+    // errors saying the source could not be reached rather than answering, never cached
+    static bool unavailable(int res)
+    {
+        switch (-res)
+        {
+        case EIO:
+        case ETIMEDOUT:
+        case EHOSTDOWN:
+        case EHOSTUNREACH:
+        case ENETDOWN:
+        case ENETUNREACH:
+        case ENOTCONN:
+        case ECONNRESET:
+        case ECONNABORTED:
+            return true;
+        }
+        return false;
+    }
+};
+
+// Source tree on a locally mounted file system (which may well be a network share).
+//
+// Pushes are written to a hidden temp file next to the target and renamed over it, so readers
+// of the source never see a partial file. Large files are copied in chunks, each one synced
+// and checkpointed in an xattr of the local file, and a push of an unchanged local file
+// continues an interrupted one from the last checkpoint, as long as neither the temp file
+// nor the target changed since. The temp file of a target that is unlinked or renamed is
+// removed just before it, so a push finishing meanwhile either lands first or fails, and
+// rmdir sweeps the ones left in an otherwise empty directory. Patches
+// are applied to a copy of the target in the same temp file (a reflink where the file system
+// has them) and renamed over it the same way.
+class LocalSource : public Source
+{
+public:
+    LocalSource(const boost::filesystem::path& root, const IoEngine::Ptr& engine = std::make_shared<IoEngine>(IoEngine::Settings()))
+        : root_(root)
+        , engine_(engine)
+    {
+    }
+
+    int lstat(const char* path, struct stat* st) override
+    {
+        return ret(::lstat(full(path).c_str(), st));
+    }
+
+    int access(const char* path, int mask) override
+    {
+        return ret(::access(full(path).c_str(), mask));
+    }
+
+    int readlink(const char* path, char* buf, size_t size) override
+    {
+        const int res = ::readlink(full(path).c_str(), buf, size);
+        return res == -1 ? -errno : res;
+    }
+
+    int list(const char* path, std::vector<DirEntry>& entries) override
+    {
+        DIR* dp = opendir(full(path).c_str());
+        if (dp == NULL)
+            return -errno;
+
+        struct dirent* de;
+        while ((de = readdir(dp)) != NULL)
+        {
+            if (strncmp(de->d_name, TEMP_PREFIX, strlen(TEMP_PREFIX)) == 0)
+                continue;
+
+            struct stat st;
+            memset(&st, 0, sizeof(st));
+            st.st_ino = de->d_ino;
+            st.st_mode = de->d_type << 12;
+
+            entries.emplace_back(DirEntry(st, de->d_name));
+        }
+
+        closedir(dp);
+        return 0;
+    }
+
+    int fetch(const char* path, const boost::filesystem::path& local) override
+    {
+        if (!engine_->enabled())
+            return copy(full(path), local);
+
+        const int in = ::open(full(path).c_str(), O_RDONLY);
+        if (in == -1)
+            return -errno;
+
+        struct stat st;
+        int res = fstat(in, &st) == -1 ? -errno : 0;
+        const int out = res ? -1 : ::open(local.c_str(), O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+        if (!res && out == -1)
+            res = -errno;
+
+        if (!res)
+            res = engine_->copy(in, out, 0, st.st_size);
+
+        close(in);
+        if (out != -1 && close(out) == -1 && !res)
+            res = -errno;
+        return res;
+    }
+
+    int push(const boost::filesystem::path& local, const char* path, struct stat* pushed, const Cancelled& cancelled) override
+    {
+        const auto target = full(path);
+        try
+        {
+            if (!boost::filesystem::exists(target.parent_path()))
+                boost::filesystem::create_directories(target.parent_path());
+        }
+        catch (const boost::filesystem::filesystem_error& e)
+        {
+            return e.code().value() ? -e.code().value() : -EIO;
+        }
+
+        const int in = ::open(local.c_str(), O_RDONLY);
+        if (in == -1)
+            return -errno;
+
+        const int res = publish(in, local, tempFile(target), target, pushed, cancelled);
+        close(in);
+        return res;
+    }
+
+    int patch(const boost::filesystem::path& local, const char* path, const std::vector<Extent>& extents, off_t shrink,
+              struct stat* pushed, const Cancelled& cancelled) override
+    {
+        const auto target = full(path);
+        const auto temp = tempFile(target);
+
+        const int in = ::open(local.c_str(), O_RDONLY);
+        if (in == -1)
+            return -errno;
+
+        const int original = ::open(target.c_str(), O_RDONLY);
+        if (original == -1)
+        {
+            const int res = -errno;
+            close(in);
+            return res;
+        }
+
+        struct stat st;
+        struct stat existing;
+        int out = -1;
+        int res = 0;
+        if (fstat(in, &st) == -1 || fstat(original, &existing) == -1)
+            res = -errno;
+        else if ((out = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, existing.st_mode & 07777)) == -1)
+            res = -errno;
+
+        // the untouched prefix of the target, all of it unless the file was cut
+        const off_t keep = shrink >= 0 ? std::min<off_t>(shrink, existing.st_size) : existing.st_size;
+        if (!res && ioctl(out, FICLONE, original) == -1)
+            res = engine_->copy(original, out, 0, keep);
+        if (!res && ftruncate(out, keep) == -1)
+            res = -errno;
+
+        for (auto it = extents.begin(); !res && it != extents.end(); ++it)
+            res = engine_->copy(in, out, it->first, std::min<off_t>(it->second, st.st_size), true);
+
+        if (!res && ftruncate(out, st.st_size) == -1)
+            res = -errno;
+
+        // keep the owner of the file being replaced
+        if (!res && (existing.st_uid != geteuid() || existing.st_gid != getegid()))
+            fchown(out, existing.st_uid, existing.st_gid);
+
+        if (!res && fstat(out, pushed) == -1)
+            res = -errno;
+
+        close(in);
+        close(original);
+        if (out != -1 && close(out) == -1 && !res)
+            res = -errno;
+
+        if (!res && cancelled && cancelled())
+            res = -ECANCELED;
+        if (!res && ::rename(temp.c_str(), target.c_str()) == -1)
+            res = -errno;
+
+        // unlike a push, a patch starts over every time
+        if (res && out != -1)
+            ::unlink(temp.c_str());
+        return res;
+    }
+
+    int fsync(const char* path, bool data) override
+    {
+        const int fd = ::open(full(path).c_str(), O_RDONLY);
+        if (fd == -1)
+            return -errno;
+
+        const int res = (data ? ::fdatasync(fd) : ::fsync(fd)) == -1 ? -errno : 0;
+        close(fd);
+        return res;
+    }
+
+    int mkdir(const char* path, mode_t mode) override
+    {
+        return ret(::mkdir(full(path).c_str(), mode));
+    }
+
+    int unlink(const char* path) override
+    {
+        const auto target = full(path);
+        // first, a push renaming its temp file over the target after this fails
+        discard(target);
+        return ret(::unlink(target.c_str()));
+    }
+
+    int rmdir(const char* path) override
+    {
+        const auto dir = full(path);
+        const int res = sweep(dir);
+        return res ? res : ret(::rmdir(dir.c_str()));
+    }
+
+    int symlink(const char* target, const char* path) override
+    {
+        return ret(::symlink(target, full(path).c_str()));
+    }
+
+    int rename(const char* from, const char* to) override
+    {
+        const auto source = full(from);
+        const auto target = full(to);
+        // a push of either name in progress is for content that is not going to be there any more
+        discard(source);
+        discard(target);
+        return ret(::rename(source.c_str(), target.c_str()));
+    }
+
+    int link(const char* from, const char* to) override
+    {
+        return ret(::link(full(from).c_str(), full(to).c_str()));
+    }
+
+    int chmod(const char* path, mode_t mode) override
+    {
+        return ret(::chmod(full(path).c_str(), mode));
+    }
+
+    int chown(const char* path, uid_t uid, gid_t gid) override
+    {
+        return ret(::lchown(full(path).c_str(), uid, gid));
+    }
+
+    int create(const char* path, int flags, mode_t mode) override
+    {
+        const int fd = ::open(full(path).c_str(), flags, mode);
+        if (fd == -1)
+            return -errno;
+
+        close(fd);
+        return 0;
+    }
+
+private:
+    // hides pushes in progress from listings
+    static constexpr const char* TEMP_PREFIX = ".cachefs-push.";
+    // "<size> <mtime sec> <mtime nsec> <offset>" of the local file whose push got to <offset>,
+    // followed by "<inode>" of the temp file and "<size> <mtime sec> <mtime nsec>" of the
+    // target the push started over (all -1 if there was none)
+    static constexpr const char* XATTR_PROGRESS = "user.cachefs.push";
+    static const off_t CHUNK = 16 * 1024 * 1024;
+
+    boost::filesystem::path full(const char* path) const
+    {
+        return root_ / path;
+    }
+
+    static boost::filesystem::path tempFile(const boost::filesystem::path& target)
+    {
+        auto name = target.filename().string();
+        if (name.size() + strlen(TEMP_PREFIX) > NAME_MAX)
+            name = std::to_string(std::hash<std::string>()(name));
+        return target.parent_path() / (TEMP_PREFIX + name);
+    }
+
+    // removes the temp file of a push to 'target', the checkpoint pointing at it no longer matches
+    static void discard(const boost::filesystem::path& target)
+    {
+        const auto temp = tempFile(target);
+        if (::unlink(temp.c_str()) == 0)
+        {
+            LOG(Debug) << "removed unfinished push '" << temp.string() << "'";
+        }
+    }
+
+    // removes the temp files left in 'dir' by failed pushes, unless it holds anything else
+    static int sweep(const boost::filesystem::path& dir)
+    {
+        DIR* dp = opendir(dir.c_str());
+        if (dp == NULL)
+            return -errno;
+
+        std::vector<std::string> temps;
+        int res = 0;
+        struct dirent* de;
+        while (!res && (de = readdir(dp)) != NULL)
+        {
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+                continue;
+            if (strncmp(de->d_name, TEMP_PREFIX, strlen(TEMP_PREFIX)) == 0)
+                temps.emplace_back(de->d_name);
+            else
+                res = -ENOTEMPTY;
+        }
+        closedir(dp);
+
+        for (auto it = temps.begin(); !res && it != temps.end(); ++it)
+        {
+            if (::unlink((dir / *it).c_str()) == -1 && errno != ENOENT)
+                res = -errno;
+        }
+        return res;
+    }
+
+    int publish(int in, const boost::filesystem::path& local, const boost::filesystem::path& temp, const boost::filesystem::path& target,
+                struct stat* pushed, const Cancelled& cancelled)
+    {
+        struct stat st;
+        if (fstat(in, &st) == -1)
+            return -errno;
+
+        // what the push goes over, a change in between makes the temp file useless
+        struct stat existing;
+        if (::stat(target.c_str(), &existing) == -1)
+        {
+            memset(&existing, 0, sizeof(existing));
+            existing.st_size = -1;
+            existing.st_mtim.tv_sec = -1;
+            existing.st_mtim.tv_nsec = -1;
+        }
+
+        const off_t offset = resumable(local, st, temp, existing);
+        if (offset)
+        {
+            LOG(Info) << "resuming push of '" << target.string() << "' at " << offset << " of " << st.st_size << " bytes";
+        }
+
+        const int out = ::open(temp.c_str(), O_WRONLY | O_CREAT | (offset ? 0 : O_TRUNC), st.st_mode & 07777);
+        if (out == -1)
+            return -errno;
+
+        struct stat partial;
+        int res = fstat(out, &partial) == -1 ? -errno : 0;
+        for (off_t chunk = offset; !res && chunk < st.st_size; chunk += CHUNK)
+        {
+            const auto end = std::min<off_t>(chunk + CHUNK, st.st_size);
+            res = engine_->copy(in, out, chunk, end);
+
+            // a checkpoint only counts once the data before it is on disk
+            if (!res && end < st.st_size)
+            {
+                if (fdatasync(out) == -1)
+                    res = -errno;
+                else
+                    checkpoint(local, st, end, partial, existing);
+            }
+        }
+
+        if (!res && ftruncate(out, st.st_size) == -1)
+            res = -errno;
+
+        // keep the owner of the file being replaced
+        if (!res && existing.st_size != -1 && (existing.st_uid != st.st_uid || existing.st_gid != st.st_gid))
+            fchown(out, existing.st_uid, existing.st_gid);
+
+        if (!res && fstat(out, pushed) == -1)
+            res = -errno;
+
+        if (close(out) == -1 && !res)
+            res = -errno;
+
+        // the content is not wanted any more, nor is the temp file to resume it from
+        if (!res && cancelled && cancelled())
+        {
+            ::unlink(temp.c_str());
+            return -ECANCELED;
+        }
+
+        if (!res && ::rename(temp.c_str(), target.c_str()) == -1)
+            res = -errno;
+
+        // a failure keeps the temp file and the checkpoint for the next attempt
+        if (!res)
+            removexattr(local.c_str(), XATTR_PROGRESS);
+        return res;
+    }
+
+    // where a push of 'local' over 'existing' can continue, 0 unless the temp file is the one
+    // checkpointed, still has its prefix and the target did not change since
+    static off_t resumable(const boost::filesystem::path& local, const struct stat& st, const boost::filesystem::path& temp, const struct stat& existing)
+    {
+        char value[256] = {};
+        if (getxattr(local.c_str(), XATTR_PROGRESS, value, sizeof(value) - 1) <= 0)
+            return 0;
+
+        long long size = 0, sec = 0, offset = 0, inode = 0, targetSize = 0, targetSec = 0;
+        long nsec = 0, targetNsec = 0;
+        if (sscanf(value, "%lld %lld %ld %lld %lld %lld %lld %ld", &size, &sec, &nsec, &offset,
+                   &inode, &targetSize, &targetSec, &targetNsec) != 8)
+            return 0;
+
+        if (size != st.st_size || sec != st.st_mtim.tv_sec || nsec != st.st_mtim.tv_nsec)
+            return 0;
+
+        if (targetSize != existing.st_size || targetSec != existing.st_mtim.tv_sec || targetNsec != existing.st_mtim.tv_nsec)
+            return 0;
+
+        struct stat partial;
+        if (::stat(temp.c_str(), &partial) == -1 || static_cast<long long>(partial.st_ino) != inode || partial.st_size < offset)
+            return 0;
+
+        return offset;
+    }
+
+    static void checkpoint(const boost::filesystem::path& local, const struct stat& st, off_t offset,
+                           const struct stat& temp, const struct stat& existing)
+    {
+        char value[256];
+        const int size = snprintf(value, sizeof(value), "%lld %lld %ld %lld %lld %lld %lld %ld",
+                                  static_cast<long long>(st.st_size),
+                                  static_cast<long long>(st.st_mtim.tv_sec),
+                                  static_cast<long>(st.st_mtim.tv_nsec),
+                                  static_cast<long long>(offset),
+                                  static_cast<long long>(temp.st_ino),
+                                  static_cast<long long>(existing.st_size),
+                                  static_cast<long long>(existing.st_mtim.tv_sec),
+                                  static_cast<long>(existing.st_mtim.tv_nsec));
+        setxattr(local.c_str(), XATTR_PROGRESS, value, size, 0);
+    }
+
+    static int ret(int res)
+    {
+        return res == -1 ? -errno : 0;
+    }
+
+    static int copy(const boost::filesystem::path& from, const boost::filesystem::path& to)
+    {
+        try
+        {
+            boost::filesystem::copy_file(from, to, boost::filesystem::copy_option::overwrite_if_exists);
+            return 0;
+        }
+        catch (const boost::filesystem::filesystem_error& e)
+        {
+            return e.code().value() ? -e.code().value() : -EIO;
+        }
+    }
+
+private:
+    const boost::filesystem::path root_;
+    const IoEngine::Ptr engine_;
+};
+
+// Stand-in for a remote source: wraps another source and adds per-op latency,
+// a bandwidth limit for data transfers, random failures and hangs.
+//
+// The bandwidth is that of one link shared by all transfers: each one books the time its
+// bytes take on the link after whatever was booked before it, and waits until that is over,
+// so N concurrent transfers take N times as long as one.
+class SlowSource : public Source
+{
+public:
+    struct Settings
+    {
+        std::chrono::microseconds latency_{0};
+        uint64_t bandwidth_ = 0;        // bytes per second, 0 is unlimited
+        double failureRate_ = 0;        // probability of an op failing with 'failureError_'
+        int failureError_ = EIO;
+        boost::filesystem::path hangFile_;  // ops hang while this file exists
+
+        bool enabled() const
+        {
+            return latency_.count() || bandwidth_ || failureRate_ > 0 || !hangFile_.empty();
+        }
+    };
+
+    SlowSource(const Source::Ptr& source, const Settings& settings)
+        : source_(source)
+        , settings_(settings)
+        , linkFree_(std::chrono::steady_clock::now())
+    {
+    }
+
+    int lstat(const char* path, struct stat* st) override
+    {
+        return delay() ? fail() : source_->lstat(path, st);
+    }
+
+    int access(const char* path, int mask) override
+    {
+        return delay() ? fail() : source_->access(path, mask);
+    }
+
+    int readlink(const char* path, char* buf, size_t size) override
+    {
+        return delay() ? fail() : source_->readlink(path, buf, size);
+    }
+
+    int list(const char* path, std::vector<DirEntry>& entries) override
+    {
+        return delay() ? fail() : source_->list(path, entries);
+    }
+
+    int fetch(const char* path, const boost::filesystem::path& local) override
+    {
+        if (delay())
+            return fail();
+
+        const int res = source_->fetch(path, local);
+        if (!res)
+            transfer(local);
+        return res;
+    }
+
+    int push(const boost::filesystem::path& local, const char* path, struct stat* pushed, const Cancelled& cancelled) override
+    {
+        if (delay())
+            return fail();
+
+        transfer(local);
+        return source_->push(local, path, pushed, cancelled);
+    }
+
+    int patch(const boost::filesystem::path& local, const char* path, const std::vector<Extent>& extents, off_t shrink,
+              struct stat* pushed, const Cancelled& cancelled) override
+    {
+        if (delay())
+            return fail();
+
+        uint64_t bytes = 0;
+        for (const auto& e : extents)
+            bytes += e.second - e.first;
+        transfer(bytes);
+        return source_->patch(local, path, extents, shrink, pushed, cancelled);
+    }
+
+    int fsync(const char* path, bool data) override
+    {
+        return delay() ? fail() : source_->fsync(path, data);
+    }
+
+    int mkdir(const char* path, mode_t mode) override
+    {
+        return delay() ? fail() : source_->mkdir(path, mode);
+    }
+
+    int unlink(const char* path) override
+    {
+        return delay() ? fail() : source_->unlink(path);
+    }
+
+    int rmdir(const char* path) override
+    {
+        return delay() ? fail() : source_->rmdir(path);
+    }
+
+    int symlink(const char* target, const char* path) override
+    {
+        return delay() ? fail() : source_->symlink(target, path);
+    }
+
+    int rename(const char* from, const char* to) override
+    {
+        return delay() ? fail() : source_->rename(from, to);
+    }
+
+    int link(const char* from, const char* to) override
+    {
+        return delay() ? fail() : source_->link(from, to);
+    }
+
+    int chmod(const char* path, mode_t mode) override
+    {
+        return delay() ? fail() : source_->chmod(path, mode);
+    }
+
+    int chown(const char* path, uid_t uid, gid_t gid) override
+    {
+        return delay() ? fail() : source_->chown(path, uid, gid);
+    }
+
+    int create(const char* path, int flags, mode_t mode) override
+    {
+        return delay() ? fail() : source_->create(path, flags, mode);
+    }
+
+private:
+    // sleeps for the configured latency and returns true if the op has to fail
+    bool delay()
+    {
+        boost::system::error_code ignore;
+        while (!settings_.hangFile_.empty() && boost::filesystem::exists(settings_.hangFile_, ignore))
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+        if (settings_.latency_.count())
+            std::this_thread::sleep_for(settings_.latency_);
+
+        if (settings_.failureRate_ <= 0)
+            return false;
+
+        thread_local std::mt19937 random(std::random_device{}());
+        return std::uniform_real_distribution<double>(0, 1)(random) < settings_.failureRate_;
+    }
+
+    int fail() const
+    {
+        return -settings_.failureError_;
+    }
+
+    void transfer(const boost::filesystem::path& local)
+    {
+        if (!settings_.bandwidth_)
+            return;
+
+        boost::system::error_code ignore;
+        const auto size = boost::filesystem::file_size(local, ignore);
+        if (size != static_cast<uintmax_t>(-1))
+            transfer(size);
+    }
+
+    void transfer(uint64_t bytes)
+    {
+        if (!settings_.bandwidth_)
+            return;
+
+        const std::chrono::microseconds duration(bytes * 1000000 / settings_.bandwidth_);
+        std::chrono::steady_clock::time_point done;
+        {
+            // an idle link does not bank time for later bursts
+            std::unique_lock<std::mutex> lock(linkLock_);
+            linkFree_ = std::max(linkFree_, std::chrono::steady_clock::now()) + duration;
+            done = linkFree_;
+        }
+        std::this_thread::sleep_until(done);
+    }
+
+private:
+    const Source::Ptr source_;
+    const Settings settings_;
+
+    std::mutex linkLock_;
+    std::chrono::steady_clock::time_point linkFree_;     // when the transfers booked so far are done
+};
@@ -0,0 +1,449 @@
+#pragma once
+
+#include "Trace.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+// Log-linear latency histogram in the spirit of HDR histograms: every power of two
+// is split into 8 linear sub-buckets, which keeps relative error under 12.5%.
+class Histogram
+{
+public:
+    static const std::size_t SUB_BITS = 3;
+    static const std::size_t SUB_COUNT = 1 << SUB_BITS;
+    static const std::size_t BUCKETS = 41 * SUB_COUNT;
+
+    Histogram()
+    {
+        for (auto& b : buckets_)
+            b.store(0, std::memory_order_relaxed);
+    }
+
+    static std::size_t index(uint64_t value)
+    {
+        if (value < SUB_COUNT)
+            return static_cast<std::size_t>(value);
+
+        const std::size_t exp = 63 - __builtin_clzll(value);
+        const std::size_t sub = (value >> (exp - SUB_BITS)) & (SUB_COUNT - 1);
+        return std::min(BUCKETS - 1, (exp - SUB_BITS + 1) * SUB_COUNT + sub);
+    }
+
+    // lowest value falling into the bucket
+    static uint64_t value(std::size_t index)
+    {
+        if (index < SUB_COUNT)
+            return index;
+
+        const std::size_t exp = index / SUB_COUNT + SUB_BITS - 1;
+        return (uint64_t(1) << exp) | (uint64_t(index % SUB_COUNT) << (exp - SUB_BITS));
+    }
+
+    // single writer per histogram, so a relaxed load/store pair is enough
+    void add(uint64_t value)
+    {
+        auto& bucket = buckets_[index(value)];
+        bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    void merge(std::vector<uint64_t>& out) const
+    {
+        out.resize(BUCKETS);
+        for (std::size_t i = 0; i < BUCKETS; ++i)
+            out[i] += buckets_[i].load(std::memory_order_relaxed);
+    }
+
+    // adds the counts of another histogram, by the single writer of this one
+    void fold(const Histogram& other)
+    {
+        for (std::size_t i = 0; i < BUCKETS; ++i)
+        {
+            auto& bucket = buckets_[i];
+            bucket.store(bucket.load(std::memory_order_relaxed) + other.buckets_[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+    }
+
+private:
+    std::atomic<uint64_t> buckets_[BUCKETS];
+};
+
+class Stats
+{
+public:
+    enum Tree { ReadOnly, ReadWrite, TREE_COUNT };
+
+    enum Counter
+    {
+        CacheBytes,     // bytes served to readers from the cache
+        SourceBytes,    // bytes fetched from the source
+        Fills,          // files copied from the source into the cache
+        WrittenBytes,   // bytes written into the read-write tree
+        PushedBytes,    // bytes pushed back to the source
+        Pushes,         // files pushed back to the source
+        DeltaPushes,    // pushes that sent only the dirty extents
+        Invalidations,  // cached entries dropped because the source changed
+        COUNTER_COUNT
+    };
+
+    static const std::size_t OP_COUNT = static_cast<std::size_t>(TraceOp::Fsync) + 1;
+
+    struct Summary
+    {
+        uint64_t count_ = 0;
+        uint64_t sum_ = 0;
+        uint64_t max_ = 0;
+        std::vector<uint64_t> buckets_;
+
+        // fills count and sum from the merged buckets
+        void total()
+        {
+            for (std::size_t i = 0; i < buckets_.size(); ++i)
+            {
+                count_ += buckets_[i];
+                sum_ += buckets_[i] * Histogram::value(i);
+            }
+            if (!max_)
+            {
+                for (std::size_t i = buckets_.size(); i-- > 0; )
+                    if (buckets_[i])
+                    {
+                        max_ = Histogram::value(i + 1 < Histogram::BUCKETS ? i + 1 : i);
+                        break;
+                    }
+            }
+        }
+
+        uint64_t percentile(double p) const
+        {
+            const uint64_t rank = static_cast<uint64_t>(p * count_ / 100.0 + 0.5);
+            uint64_t seen = 0;
+            for (std::size_t i = 0; i < buckets_.size(); ++i)
+            {
+                seen += buckets_[i];
+                if (seen >= rank && seen)
+                    return std::min(max_, Histogram::value(i + 1 < Histogram::BUCKETS ? i + 1 : i));
+            }
+            return max_;
+        }
+    };
+
+    struct Snapshot
+    {
+        Summary latency_[OP_COUNT][TREE_COUNT][2];
+        uint64_t counters_[COUNTER_COUNT] = {};
+        std::vector<std::pair<std::string, uint64_t>> gauges_;
+        // latencies of background work reported by collectors
+        std::vector<std::pair<std::string, Summary>> distributions_;
+    };
+
+    typedef std::function<void(Snapshot&)> Collector;
+
+    static Stats& instance()
+    {
+        static Stats stats;
+        return stats;
+    }
+
+    // marks the current operation as a cache miss
+    static void miss()
+    {
+        missFlag() = true;
+    }
+
+    static void add(Counter counter, uint64_t value)
+    {
+        auto& c = local().counters_[counter];
+        c.store(c.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    // measures the operation for as long as it lives
+    class Scope
+    {
+    public:
+        Scope(TraceOp op, Tree tree)
+            : op_(op)
+            , tree_(tree)
+            , start_(monotonicNanoseconds())
+        {
+            missFlag() = false;
+        }
+
+        ~Scope()
+        {
+            const auto elapsed = monotonicNanoseconds() - start_;
+            auto& t = local();
+            t.latency_[static_cast<std::size_t>(op_)][tree_][missFlag() ? 1 : 0].add(elapsed);
+
+            auto& max = t.max_[static_cast<std::size_t>(op_)][tree_][missFlag() ? 1 : 0];
+            if (elapsed > max.load(std::memory_order_relaxed))
+                max.store(elapsed, std::memory_order_relaxed);
+        }
+
+    private:
+        const TraceOp op_;
+        const Tree tree_;
+        const uint64_t start_;
+    };
+
+    // components outside of the per-thread data (queues etc) report their state through collectors
+    std::size_t addCollector(const Collector& collector)
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        collectors_.emplace(++lastCollector_, collector);
+        return lastCollector_;
+    }
+
+    void removeCollector(std::size_t id)
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        collectors_.erase(id);
+    }
+
+    Snapshot snapshot()
+    {
+        Snapshot result;
+
+        std::unique_lock<std::mutex> lock(lock_);
+        std::vector<const ThreadStats*> threads(threads_.begin(), threads_.end());
+        threads.push_back(&retired_);
+        for (const auto* t : threads)
+        {
+            for (std::size_t op = 0; op < OP_COUNT; ++op)
+                for (std::size_t tree = 0; tree < TREE_COUNT; ++tree)
+                    for (std::size_t miss = 0; miss < 2; ++miss)
+                    {
+                        auto& s = result.latency_[op][tree][miss];
+                        t->latency_[op][tree][miss].merge(s.buckets_);
+                        s.max_ = std::max(s.max_, t->max_[op][tree][miss].load(std::memory_order_relaxed));
+                    }
+
+            for (std::size_t c = 0; c < COUNTER_COUNT; ++c)
+                result.counters_[c] += t->counters_[c].load(std::memory_order_relaxed);
+        }
+
+        for (const auto& collector : collectors_)
+            collector.second(result);
+        lock.unlock();
+
+        for (auto& op : result.latency_)
+            for (auto& tree : op)
+                for (auto& s : tree)
+                    s.total();
+
+        return result;
+    }
+
+    static std::string text(const Snapshot& s)
+    {
+        std::ostringstream os;
+        os << "counters:" << std::endl;
+        for (std::size_t c = 0; c < COUNTER_COUNT; ++c)
+            os << "  " << std::left << std::setw(24) << counterName(c) << s.counters_[c] << std::endl;
+        for (const auto& g : s.gauges_)
+            os << "  " << std::left << std::setw(24) << g.first << g.second << std::endl;
+
+        os << "latency (us):" << std::endl;
+        os << "  " << std::left << std::setw(12) << "op" << std::setw(6) << "tree" << std::setw(8) << "result"
+           << std::right << std::setw(10) << "count" << std::setw(10) << "avg" << std::setw(10) << "p50"
+           << std::setw(10) << "p99" << std::setw(10) << "p999" << std::setw(10) << "max" << std::endl;
+
+        forEach(s, [&os](std::size_t op, std::size_t tree, std::size_t miss, const Summary& v){
+            os << "  " << std::left << std::setw(12) << opName(op) << std::setw(6) << (tree == ReadWrite ? "rw" : "ro")
+               << std::setw(8) << (miss ? "miss" : "hit") << std::right
+               << std::setw(10) << v.count_
+               << std::setw(10) << v.sum_ / v.count_ / 1000
+               << std::setw(10) << v.percentile(50) / 1000
+               << std::setw(10) << v.percentile(99) / 1000
+               << std::setw(10) << v.percentile(99.9) / 1000
+               << std::setw(10) << v.max_ / 1000 << std::endl;
+        });
+
+        for (const auto& d : s.distributions_)
+        {
+            const auto& v = d.second;
+            os << "  " << std::left << std::setw(26) << d.first << std::right
+               << std::setw(10) << v.count_
+               << std::setw(10) << (v.count_ ? v.sum_ / v.count_ / 1000 : 0)
+               << std::setw(10) << v.percentile(50) / 1000
+               << std::setw(10) << v.percentile(99) / 1000
+               << std::setw(10) << v.percentile(99.9) / 1000
+               << std::setw(10) << v.max_ / 1000 << std::endl;
+        }
+
+        return os.str();
+    }
+
+    static std::string json(const Snapshot& s)
+    {
+        std::ostringstream os;
+        os << "{\"counters\":{";
+        for (std::size_t c = 0; c < COUNTER_COUNT; ++c)
+            os << (c ? "," : "") << "\"" << counterName(c) << "\":" << s.counters_[c];
+        for (const auto& g : s.gauges_)
+            os << ",\"" << g.first << "\":" << g.second;
+        os << "},\"latency_ns\":[";
+
+        bool first = true;
+        forEach(s, [&os, &first](std::size_t op, std::size_t tree, std::size_t miss, const Summary& v){
+            os << (first ? "" : ",")
+               << "{\"op\":\"" << opName(op) << "\",\"tree\":\"" << (tree == ReadWrite ? "rw" : "ro")
+               << "\",\"result\":\"" << (miss ? "miss" : "hit") << "\""
+               << ",\"count\":" << v.count_
+               << ",\"sum\":" << v.sum_
+               << ",\"p50\":" << v.percentile(50)
+               << ",\"p90\":" << v.percentile(90)
+               << ",\"p99\":" << v.percentile(99)
+               << ",\"p999\":" << v.percentile(99.9)
+               << ",\"max\":" << v.max_ << "}";
+            first = false;
+        });
+
+        os << "],\"background_ns\":{";
+        for (std::size_t i = 0; i < s.distributions_.size(); ++i)
+        {
+            const auto& v = s.distributions_[i].second;
+            os << (i ? "," : "") << "\"" << s.distributions_[i].first << "\":{"
+               << "\"count\":" << v.count_
+               << ",\"sum\":" << v.sum_
+               << ",\"p50\":" << v.percentile(50)
+               << ",\"p99\":" << v.percentile(99)
+               << ",\"p999\":" << v.percentile(99.9)
+               << ",\"max\":" << v.max_ << "}";
+        }
+        os << "}}" << std::endl;
+        return os.str();
+    }
+
+    static const char* opName(std::size_t op)
+    {
+        static const char* names[] = {
+            "path", "getattr", "access", "readlink", "list", "mknod", "mkdir", "unlink", "rmdir", "symlink",
+            "rename", "link", "chmod", "chown", "truncate", "create", "open", "read", "write", "release",
+            "fallocate", "fsync"
+        };
+        static_assert(sizeof(names) / sizeof(names[0]) == OP_COUNT, "op names are out of date");
+        return names[op];
+    }
+
+    static const char* counterName(std::size_t counter)
+    {
+        static const char* names[] = { "cache_bytes", "source_bytes", "fills", "written_bytes", "pushed_bytes", "pushes", "delta_pushes", "invalidations" };
+        static_assert(sizeof(names) / sizeof(names[0]) == COUNTER_COUNT, "counter names are out of date");
+        return names[counter];
+    }
+
+private:
+    struct ThreadStats
+    {
+        ThreadStats()
+        {
+            for (auto& c : counters_)
+                c.store(0, std::memory_order_relaxed);
+            for (auto& op : max_)
+                for (auto& tree : op)
+                    for (auto& m : tree)
+                        m.store(0, std::memory_order_relaxed);
+        }
+
+        // adds the numbers of another block, by the single writer of this one
+        void fold(const ThreadStats& other)
+        {
+            for (std::size_t op = 0; op < OP_COUNT; ++op)
+                for (std::size_t tree = 0; tree < TREE_COUNT; ++tree)
+                    for (std::size_t miss = 0; miss < 2; ++miss)
+                    {
+                        latency_[op][tree][miss].fold(other.latency_[op][tree][miss]);
+                        const auto max = other.max_[op][tree][miss].load(std::memory_order_relaxed);
+                        if (max > max_[op][tree][miss].load(std::memory_order_relaxed))
+                            max_[op][tree][miss].store(max, std::memory_order_relaxed);
+                    }
+
+            for (std::size_t c = 0; c < COUNTER_COUNT; ++c)
+                counters_[c].store(counters_[c].load(std::memory_order_relaxed) + other.counters_[c].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+
+        Histogram latency_[OP_COUNT][TREE_COUNT][2];
+        std::atomic<uint64_t> max_[OP_COUNT][TREE_COUNT][2];
+        std::atomic<uint64_t> counters_[COUNTER_COUNT];
+    };
+
+    // registers the block of a thread on first use and retires it when the thread exits
+    class Registration
+    {
+    public:
+        Registration()
+            : stats_(instance().registerThread())
+        {
+        }
+
+        ~Registration()
+        {
+            instance().retireThread(stats_);
+        }
+
+        ThreadStats& stats() const
+        {
+            return *stats_;
+        }
+
+    private:
+        ThreadStats* const stats_;
+    };
+
+    template<typename Callback>
+    static void forEach(const Snapshot& s, const Callback& callback)
+    {
+        for (std::size_t op = 0; op < OP_COUNT; ++op)
+            for (std::size_t tree = 0; tree < TREE_COUNT; ++tree)
+                for (std::size_t miss = 0; miss < 2; ++miss)
+                    if (s.latency_[op][tree][miss].count_)
+                        callback(op, tree, miss, s.latency_[op][tree][miss]);
+    }
+
+    static bool& missFlag()
+    {
+        thread_local bool flag = false;
+        return flag;
+    }
+
+    // per-thread block, its numbers go to the retired ones when the thread exits
+    static ThreadStats& local()
+    {
+        thread_local const Registration registration;
+        return registration.stats();
+    }
+
+    ThreadStats* registerThread()
+    {
+        std::unique_ptr<ThreadStats> stats(new ThreadStats());
+        std::unique_lock<std::mutex> lock(lock_);
+        threads_.push_back(stats.get());
+        return stats.release();
+    }
+
+    void retireThread(ThreadStats* stats)
+    {
+        const std::unique_ptr<ThreadStats> owned(stats);
+        std::unique_lock<std::mutex> lock(lock_);
+        retired_.fold(*stats);
+        threads_.erase(std::find(threads_.begin(), threads_.end(), stats));
+    }
+
+private:
+    std::mutex lock_;
+    std::vector<ThreadStats*> threads_;
+    // the numbers of threads that exited
+    ThreadStats retired_;
+    std::map<std::size_t, Collector> collectors_;
+    std::size_t lastCollector_ = 0;
+};
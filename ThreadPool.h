@@ -0,0 +1,141 @@
+#pragma once
+
+#include "Logger.h"
+
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+// Fixed number of workers draining a bounded queue. 'submit' blocks while the queue is
+// full, except when called from one of the workers: a task fanning out more tasks must
+// not wait for a slot only the workers themselves could free.
+class ThreadPool
+{
+public:
+    typedef std::function<void()> Task;
+
+    ThreadPool(std::size_t threads, std::size_t limit)
+        : limit_(limit ? limit : 1)
+        , active_(0)
+        , running_(true)
+    {
+        for (std::size_t i = 0; i < (threads ? threads : 1); ++i)
+            workers_.emplace_back(std::bind(&ThreadPool::worker, this));
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            running_ = false;
+        }
+        cond_.notify_all();
+        for (auto& w : workers_)
+            w.join();
+    }
+
+    void submit(Task task)
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        if (current() != this)
+        {
+            while (queue_.size() >= limit_)
+                idle_.wait(lock);
+        }
+
+        queue_.push_back(std::move(task));
+        cond_.notify_one();
+    }
+
+    // false instead of waiting if the queue is full
+    bool trySubmit(Task task)
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        if (queue_.size() >= limit_ && current() != this)
+            return false;
+
+        queue_.push_back(std::move(task));
+        cond_.notify_one();
+        return true;
+    }
+
+    // stops taking tasks and lets the workers go without joining them, for workers that may
+    // be stuck for good; the pool must then be leaked, the workers still use it
+    void detach()
+    {
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            running_ = false;
+            queue_.clear();
+        }
+        cond_.notify_all();
+        for (auto& w : workers_)
+            w.detach();
+        workers_.clear();
+    }
+
+    // waits until the queue is empty and no task is running
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        while (!queue_.empty() || active_)
+            idle_.wait(lock);
+    }
+
+private:
+    static ThreadPool*& current()
+    {
+        thread_local ThreadPool* pool = nullptr;
+        return pool;
+    }
+
+    void worker()
+    {
+        current() = this;
+
+        std::unique_lock<std::mutex> lock(lock_);
+        while (true)
+        {
+            while (queue_.empty() && running_)
+                cond_.wait(lock);
+
+            if (queue_.empty())
+                break;
+
+            Task task = std::move(queue_.front());
+            queue_.pop_front();
+            ++active_;
+            idle_.notify_all();
+            lock.unlock();
+
+            try
+            {
+                task();
+            }
+            catch (const std::exception& e)
+            {
+                LOG(Error) << "pool task failed: " << e.what();
+            }
+
+            lock.lock();
+            --active_;
+            idle_.notify_all();
+        }
+    }
+
+private:
+    const std::size_t limit_;
+
+    std::mutex lock_;
+    std::condition_variable cond_;
+    std::condition_variable idle_;
+    std::deque<Task> queue_;
+    std::size_t active_;
+    bool running_;
+
+    std::vector<std::thread> workers_;
+};
@@ -0,0 +1,417 @@
+#pragma once
+
+#include "Logger.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+#include <boost/filesystem.hpp>
+#include <boost/unordered_map.hpp>
+
+enum class TraceOp : uint8_t
+{
+    Path,  // defines path id, followed by 'size' bytes of the path itself
+    Getattr,
+    Access,
+    Readlink,
+    List,
+    Mknod,
+    Mkdir,
+    Unlink,
+    Rmdir,
+    Symlink,
+    Rename,
+    Link,
+    Chmod,
+    Chown,
+    Truncate,
+    Create,
+    Open,
+    Read,
+    Write,
+    Release,
+    Fallocate,
+    Fsync
+};
+
+// Records are written in blocks of one thread each, so the file is ordered by time only
+// within a thread. Path ids are per thread as well: a Path record precedes the first use of
+// its id by the same thread.
+#pragma pack(push, 1)
+struct TraceRecord
+{
+    uint64_t time_;     // nanoseconds since the recorder was started
+    uint64_t offset_;
+    uint64_t size_;
+    uint32_t path_;
+    uint16_t thread_;
+    TraceOp op_;
+};
+#pragma pack(pop)
+
+inline uint16_t currentThreadId()
+{
+    static std::atomic<uint16_t> counter(0);
+    thread_local const uint16_t id = counter++;
+    return id;
+}
+
+inline uint64_t monotonicNanoseconds()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+// Appends every op to a buffer of the calling thread, which is written out once it holds
+// FLUSH_SIZE bytes; recording takes no lock shared with other threads. The buffers of
+// threads that exited are written and dropped when another buffer is, and whatever is
+// left when the recorder goes away.
+class TraceRecorder
+{
+    struct Buffer
+    {
+        std::mutex lock_;
+        std::vector<char> data_;
+        boost::unordered_map<std::string, uint32_t> ids_;
+    };
+
+public:
+    TraceRecorder(const boost::filesystem::path& file)
+        : fd_(::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644))
+        , start_(monotonicNanoseconds())
+        , id_(++lastId())
+    {
+        if (fd_ == -1)
+            throw std::runtime_error("failed to open trace file: " + file.string());
+    }
+
+    ~TraceRecorder()
+    {
+        // nothing is recorded any more
+        std::unique_lock<std::mutex> lock(lock_);
+        for (const auto& buffer : buffers_)
+        {
+            std::unique_lock<std::mutex> bufferLock(buffer->lock_);
+            write(buffer->data_);
+        }
+        close(fd_);
+    }
+
+    void record(TraceOp op, const char* path, uint64_t offset = 0, uint64_t size = 0)
+    {
+        TraceRecord rec;
+        rec.time_ = monotonicNanoseconds() - start_;
+        rec.offset_ = offset;
+        rec.size_ = size;
+        rec.thread_ = currentThreadId();
+        rec.op_ = op;
+
+        std::vector<char> full;
+        {
+            auto& buffer = local();
+            std::unique_lock<std::mutex> lock(buffer.lock_);
+            rec.path_ = pathId(buffer, path, rec);
+            append(buffer, rec);
+
+            if (buffer.data_.size() < FLUSH_SIZE)
+                return;
+
+            full.swap(buffer.data_);
+            buffer.data_.reserve(FLUSH_SIZE * 2);
+        }
+        flush(full);
+    }
+
+private:
+    // the buffer of the calling thread, registered on its first op
+    Buffer& local()
+    {
+        struct Owned
+        {
+            uint64_t recorder_ = 0;
+            std::shared_ptr<Buffer> buffer_;
+        };
+
+        // a thread outliving a recorder gets a new buffer from the next one
+        thread_local Owned owned;
+        if (owned.recorder_ != id_)
+        {
+            owned.buffer_ = std::make_shared<Buffer>();
+            owned.buffer_->data_.reserve(FLUSH_SIZE * 2);
+            owned.recorder_ = id_;
+
+            std::unique_lock<std::mutex> lock(lock_);
+            buffers_.push_back(owned.buffer_);
+        }
+        return *owned.buffer_;
+    }
+
+    // called with the lock of the buffer
+    static uint32_t pathId(Buffer& buffer, const char* path, const TraceRecord& rec)
+    {
+        auto it = buffer.ids_.find(path);
+        if (it != buffer.ids_.end())
+            return it->second;
+
+        const auto id = static_cast<uint32_t>(buffer.ids_.size());
+        buffer.ids_.emplace(path, id);
+
+        TraceRecord def = rec;
+        def.op_ = TraceOp::Path;
+        def.path_ = id;
+        def.offset_ = 0;
+        def.size_ = strlen(path);
+        append(buffer, def);
+        buffer.data_.insert(buffer.data_.end(), path, path + def.size_);
+        return id;
+    }
+
+    static void append(Buffer& buffer, const TraceRecord& rec)
+    {
+        const auto data = reinterpret_cast<const char*>(&rec);
+        buffer.data_.insert(buffer.data_.end(), data, data + sizeof(rec));
+    }
+
+    // writes the content of a full buffer
+    void flush(std::vector<char>& data)
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        write(data);
+
+        // buffers only the registry holds belong to threads that exited
+        buffers_.erase(std::remove_if(buffers_.begin(), buffers_.end(), [this](const std::shared_ptr<Buffer>& b){
+            if (b.use_count() != 1)
+                return false;
+
+            // nobody else takes the lock, it orders the last op of the thread before the write
+            std::unique_lock<std::mutex> bufferLock(b->lock_);
+            write(b->data_);
+            return true;
+        }), buffers_.end());
+    }
+
+    // called with the lock
+    void write(std::vector<char>& data)
+    {
+        std::size_t written = 0;
+        while (written < data.size())
+        {
+            const auto res = ::write(fd_, data.data() + written, data.size() - written);
+            if (res <= 0)
+                break;
+            written += res;
+        }
+        data.clear();
+    }
+
+    static std::atomic<uint64_t>& lastId()
+    {
+        static std::atomic<uint64_t> id(0);
+        return id;
+    }
+
+private:
+    static const std::size_t FLUSH_SIZE = 64 * 1024;
+
+    const int fd_;
+    const uint64_t start_;
+    const uint64_t id_;
+
+    // writes to the file and the registry of buffers
+    std::mutex lock_;
+    std::vector<std::shared_ptr<Buffer>> buffers_;
+};
+
+// Reads a recorded trace and returns the order in which files were first opened
+inline std::vector<std::string> readTraceSequence(const boost::filesystem::path& file)
+{
+    std::vector<std::string> sequence;
+
+    const int fd = ::open(file.c_str(), O_RDONLY);
+    if (fd == -1)
+        return sequence;
+
+    std::vector<char> data;
+    char chunk[64 * 1024];
+    ssize_t res;
+    while ((res = ::read(fd, chunk, sizeof(chunk))) > 0)
+        data.insert(data.end(), chunk, chunk + res);
+    close(fd);
+
+    // path ids are per thread, opens are put back in time order across threads
+    std::map<std::pair<uint16_t, uint32_t>, std::string> paths;
+    std::vector<std::pair<uint64_t, std::string>> opens;
+
+    std::size_t pos = 0;
+    while (pos + sizeof(TraceRecord) <= data.size())
+    {
+        TraceRecord rec;
+        memcpy(&rec, data.data() + pos, sizeof(rec));
+        pos += sizeof(rec);
+
+        const auto key = std::make_pair(rec.thread_, rec.path_);
+        if (rec.op_ == TraceOp::Path)
+        {
+            if (rec.size_ > data.size() - pos)
+                break;
+
+            paths[key].assign(data.data() + pos, rec.size_);
+            pos += rec.size_;
+        }
+        else if (rec.op_ == TraceOp::Open)
+        {
+            const auto it = paths.find(key);
+            if (it != paths.end())
+                opens.emplace_back(rec.time_, it->second);
+        }
+    }
+
+    std::stable_sort(opens.begin(), opens.end(), [](const std::pair<uint64_t, std::string>& a, const std::pair<uint64_t, std::string>& b){
+        return a.first < b.first;
+    });
+
+    std::set<std::string> seen;
+    for (const auto& open : opens)
+    {
+        if (seen.insert(open.second).second)
+            sequence.push_back(open.second);
+    }
+
+    return sequence;
+}
+
+// Follows live opens against a recorded sequence and fetches the files that historically come next,
+// from the thread spawned by 'start'
+class Prefetcher
+{
+public:
+    typedef std::function<void(const std::string&)> Fetch;
+
+    Prefetcher(const boost::filesystem::path& trace, const Fetch& fetch)
+        : sequence_(readTraceSequence(trace))
+        , fetch_(fetch)
+        , running_(true)
+    {
+        for (std::size_t i = 0; i < sequence_.size(); ++i)
+            positions_.emplace(sequence_[i], i);
+
+        LOG(Info) << "prefetch sequence of " << sequence_.size() << " files loaded from " << trace.string();
+    }
+
+    ~Prefetcher()
+    {
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            running_ = false;
+        }
+        cond_.notify_all();
+        if (worker_.joinable())
+            worker_.join();
+    }
+
+    void start()
+    {
+        if (!worker_.joinable())
+            worker_ = std::thread(std::bind(&Prefetcher::worker, this));
+    }
+
+    // 'window' is the number of files to fetch ahead of the opened one
+    void onOpen(const char* path, std::size_t window)
+    {
+        const auto it = positions_.find(path);
+        if (it == positions_.end())
+            return;
+
+        const auto pos = it->second;
+
+        std::unique_lock<std::mutex> lock(lock_);
+        if (matched_ && pos > cursor_ && pos <= cursor_ + SLACK)
+        {
+            ++matched_;
+        }
+        else if (!matched_ || pos > cursor_ + SLACK || pos + SLACK < cursor_)
+        {
+            // a new run of the sequence (or a jump inside it)
+            matched_ = 1;
+            issued_ = pos;
+        }
+
+        if (pos > cursor_ || matched_ == 1)
+            cursor_ = pos;
+
+        if (matched_ < THRESHOLD)
+            return;
+
+        const auto end = std::min(sequence_.size(), cursor_ + window + 1);
+        for (auto i = std::max(issued_, cursor_) + 1; i < end; ++i)
+            queue_.push_back(i);
+
+        issued_ = std::max(issued_, end - 1);
+        cond_.notify_all();
+    }
+
+private:
+    void worker()
+    {
+        while (true)
+        {
+            std::size_t pos;
+            {
+                std::unique_lock<std::mutex> lock(lock_);
+                while (queue_.empty() && running_)
+                    cond_.wait(lock);
+
+                if (!running_)
+                    break;
+
+                pos = queue_.front();
+                queue_.pop_front();
+            }
+
+            try
+            {
+                fetch_(sequence_[pos]);
+            }
+            catch (const std::exception& e)
+            {
+                LOG(Warning) << "prefetch of '" << sequence_[pos] << "' failed: " << e.what();
+            }
+        }
+    }
+
+private:
+    // number of consecutive sequence hits required before fetching ahead
+    static const std::size_t THRESHOLD = 2;
+    // how far a live open may skip ahead and still be treated as following the sequence
+    static const std::size_t SLACK = 8;
+
+    const std::vector<std::string> sequence_;
+    const Fetch fetch_;
+
+    boost::unordered_map<std::string, std::size_t> positions_;
+
+    std::mutex lock_;
+    std::condition_variable cond_;
+    std::deque<std::size_t> queue_;
+    std::size_t cursor_ = 0;
+    std::size_t issued_ = 0;
+    std::size_t matched_ = 0;
+    bool running_;
+
+    std::thread worker_;
+};
@@ -0,0 +1,247 @@
+#pragma once
+
+#include "Logger.h"
+#include "Stats.h"
+#include "Source.h"
+#include "ThreadPool.h"
+#include "IoScheduler.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+
+#include <boost/filesystem.hpp>
+
+// Copies a source directory tree into the cache with a bounded pool of workers, so a large
+// tree costs its transfer time rather than the sum of per-file round trips.
+//
+// The tree is walked first, every directory listed and every entry stat'ed concurrently,
+// creating local directories and symlinks on the way. Then the regular files are fetched
+// concurrently through temp files, and directory modes and times are restored last (deepest
+// first) since creating entries changes them. Entries that already exist locally are kept,
+// so an interrupted copy can simply be run again. Its source traffic is scheduled as preload.
+class TreeCopier
+{
+public:
+    // called for every copied directory once everything under it is in place
+    typedef std::function<void(const boost::filesystem::path&)> Done;
+
+    TreeCopier(const Source::Ptr& source, const boost::filesystem::path& temp, std::size_t threads, const Done& done = Done())
+        : source_(source)
+        , temp_(temp)
+        , threads_(threads)
+        , done_(done)
+        , error_(0)
+        , bytes_(0)
+    {
+    }
+
+    int copy(const std::string& dir, const boost::filesystem::path& dest)
+    {
+        LOG(Info) << "read-write copy '" << dir << "' -> '" << dest.string() << "' with " << threads_ << " threads";
+        Stats::miss();
+
+        const IoScheduler::Scope scope(IoClass::Preload);
+        const auto start = monotonicNanoseconds();
+
+        struct stat st;
+        int res = source_->lstat(dir.c_str(), &st);
+        if (res)
+            return res;
+
+        res = makeDirectory(dest, st);
+        if (res)
+            return res;
+
+        {
+            ThreadPool pool(threads_, threads_ * 4);
+
+            directories_.push_back(Entry{dir, dest, st});
+            pool.submit([this, &pool, dir, dest](){
+                const IoScheduler::Scope scope(IoClass::Preload);
+                walk(pool, dir, dest);
+            });
+            pool.wait();
+
+            if (!error_)
+            {
+                for (const auto& file : files_)
+                    pool.submit([this, &file](){
+                        const IoScheduler::Scope scope(IoClass::Preload);
+                        fetch(file);
+                    });
+                pool.wait();
+            }
+        }
+
+        if (error_)
+            return error_;
+
+        // deepest directories first, so restoring the times of a child does not touch its parent's again
+        std::sort(directories_.begin(), directories_.end(), [](const Entry& l, const Entry& r){
+            return l.path_.size() > r.path_.size();
+        });
+        for (const auto& d : directories_)
+        {
+            ::chmod(d.local_.c_str(), d.stat_.st_mode & 07777);
+            setTimes(d.local_, d.stat_);
+            if (done_)
+                done_(d.local_);
+        }
+
+        LOG(Info) << "completed copy '" << dir << "': " << directories_.size() << " directories, " << files_.size()
+                  << " files, " << bytes_.load() << " bytes in " << (monotonicNanoseconds() - start) / 1000000 << " ms";
+        return 0;
+    }
+
+private:
+    struct Entry
+    {
+        std::string path_;
+        boost::filesystem::path local_;
+        struct stat stat_;
+    };
+
+    void walk(ThreadPool& pool, const std::string& dir, const boost::filesystem::path& dest)
+    {
+        if (error_)
+            return;
+
+        std::vector<DirEntry> entries;
+        int res = source_->list(dir.c_str(), entries);
+        if (res)
+            return fail(res, dir);
+
+        for (const auto& entry : entries)
+        {
+            if (entry.name_ == "." || entry.name_ == "..")
+                continue;
+
+            const auto path = dir + "/" + entry.name_;
+            const auto local = dest / entry.name_;
+            pool.submit([this, &pool, path, local](){
+                const IoScheduler::Scope scope(IoClass::Preload);
+                visit(pool, path, local);
+            });
+        }
+    }
+
+    void visit(ThreadPool& pool, const std::string& path, const boost::filesystem::path& local)
+    {
+        if (error_)
+            return;
+
+        struct stat st;
+        int res = source_->lstat(path.c_str(), &st);
+        if (res == -ENOENT)
+            return;
+        if (res)
+            return fail(res, path);
+
+        if (S_ISDIR(st.st_mode))
+        {
+            res = makeDirectory(local, st);
+            if (res)
+                return fail(res, path);
+
+            {
+                std::unique_lock<std::mutex> lock(lock_);
+                directories_.push_back(Entry{path, local, st});
+            }
+            walk(pool, path, local);
+            return;
+        }
+
+        // anything existing locally is newer than the source
+        struct stat existing;
+        if (::lstat(local.c_str(), &existing) == 0)
+            return;
+
+        if (S_ISLNK(st.st_mode))
+        {
+            std::vector<char> target(st.st_size + 1);
+            res = source_->readlink(path.c_str(), target.data(), target.size());
+            if (res >= 0)
+                res = ::symlink(std::string(target.data(), res).c_str(), local.c_str()) == -1 ? -errno : 0;
+            if (res && res != -EEXIST)
+                return fail(res, path);
+
+            const struct timespec times[2] = { st.st_atim, st.st_mtim };
+            utimensat(AT_FDCWD, local.c_str(), times, AT_SYMLINK_NOFOLLOW);
+        }
+        else if (S_ISREG(st.st_mode))
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            files_.push_back(Entry{path, local, st});
+        }
+    }
+
+    void fetch(const Entry& file)
+    {
+        if (error_)
+            return;
+
+        const auto temp = temp_ / boost::filesystem::unique_path();
+        int res = source_->fetch(file.path_.c_str(), temp);
+        if (!res)
+        {
+            ::chmod(temp.c_str(), file.stat_.st_mode & 07777);
+            setTimes(temp, file.stat_);
+            baseline::save(temp, file.stat_);
+            if (::rename(temp.c_str(), file.local_.c_str()) == -1)
+                res = -errno;
+        }
+
+        if (res)
+        {
+            ::unlink(temp.c_str());
+            return fail(res, file.path_);
+        }
+
+        bytes_ += file.stat_.st_size;
+        Stats::add(Stats::Fills, 1);
+        Stats::add(Stats::SourceBytes, file.stat_.st_size);
+    }
+
+    static int makeDirectory(const boost::filesystem::path& local, const struct stat& st)
+    {
+        // writable until the copy is done, the real mode is restored at the end
+        if (::mkdir(local.c_str(), (st.st_mode & 07777) | S_IRWXU) == -1 && errno != EEXIST)
+            return -errno;
+        return 0;
+    }
+
+    static void setTimes(const boost::filesystem::path& local, const struct stat& st)
+    {
+        const struct timespec times[2] = { st.st_atim, st.st_mtim };
+        utimensat(AT_FDCWD, local.c_str(), times, AT_SYMLINK_NOFOLLOW);
+    }
+
+    void fail(int error, const std::string& path)
+    {
+        LOG(Error) << "copy of '" << path << "' failed: " << strerror(-error);
+
+        int expected = 0;
+        error_.compare_exchange_strong(expected, error);
+    }
+
+private:
+    const Source::Ptr source_;
+    const boost::filesystem::path temp_;
+    const std::size_t threads_;
+    const Done done_;
+
+    std::atomic<int> error_;
+    std::atomic<uint64_t> bytes_;
+
+    std::mutex lock_;
+    std::vector<Entry> directories_;
+    std::vector<Entry> files_;
+};
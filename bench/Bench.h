@@ -0,0 +1,227 @@
+#pragma once
+
+#include "Cache.h"
+#include "Stats.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <thread>
+#include <memory>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+
+#include <boost/filesystem.hpp>
+
+namespace bench
+{
+
+struct Config
+{
+    std::vector<unsigned> threads_ = { 1, 2, 4, 8 };
+    std::size_t files_ = 2000;
+    std::size_t filesPerDir_ = 100;
+    std::size_t fileSize_ = 16 * 1024;
+    std::size_t iterations_ = 20000;
+    std::string filter_;
+    std::string out_;
+
+    // cachefs options, e.g. --source-latency-us to measure against a slow source
+    Options options_;
+};
+
+// Source, cache and read-write directories in a private temp dir, populated with
+// 'files_' regular files spread over directories of 'filesPerDir_' files each.
+class Fixture
+{
+public:
+    Fixture(const Config& config)
+        : config_(config)
+        , root_(boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("cachefs-bench-%%%%-%%%%"))
+        , src_(root_ / "src")
+        , cache_(root_ / "cache")
+        , readWrite_(src_ / "rw")
+    {
+        boost::filesystem::create_directories(readWrite_);
+        boost::filesystem::create_directories(cache_);
+
+        const std::vector<char> data(config.fileSize_, 'x');
+        for (std::size_t i = 0; i < config.files_; ++i)
+        {
+            paths_.push_back(file("", i));
+            populate(src_ / paths_.back(), data);
+
+            rwPaths_.push_back(file("/rw", i));
+            populate(src_ / rwPaths_.back(), data);
+        }
+
+        for (std::size_t i = 0; i < config.files_; i += config.filesPerDir_)
+            dirs_.push_back("/dir" + std::to_string(i / config.filesPerDir_));
+    }
+
+    ~Fixture()
+    {
+        boost::system::error_code ignore;
+        boost::filesystem::remove_all(root_, ignore);
+    }
+
+    // a fresh Cache over an empty cache directory
+    std::unique_ptr<Cache> mount()
+    {
+        return mount(config_.options_);
+    }
+
+    std::unique_ptr<Cache> mount(const Options& options)
+    {
+        boost::filesystem::remove_all(cache_);
+        boost::filesystem::create_directories(cache_);
+        std::unique_ptr<Cache> cache(new Cache(src_, cache_, readWrite_, options));
+        cache->start();
+        return cache;
+    }
+
+    const std::vector<std::string>& paths() const { return paths_; }
+    const std::vector<std::string>& rwPaths() const { return rwPaths_; }
+    const std::vector<std::string>& dirs() const { return dirs_; }
+    const boost::filesystem::path& source() const { return src_; }
+    const boost::filesystem::path& cache() const { return cache_; }
+
+private:
+    std::string file(const std::string& prefix, std::size_t i) const
+    {
+        return prefix + "/dir" + std::to_string(i / config_.filesPerDir_) + "/file" + std::to_string(i);
+    }
+
+    static void populate(const boost::filesystem::path& path, const std::vector<char>& data)
+    {
+        boost::filesystem::create_directories(path.parent_path());
+        const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1 || ::write(fd, data.data(), data.size()) != static_cast<ssize_t>(data.size()))
+            throw std::runtime_error("failed to populate " + path.string());
+        close(fd);
+    }
+
+private:
+    const Config config_;
+    const boost::filesystem::path root_;
+    const boost::filesystem::path src_;
+    const boost::filesystem::path cache_;
+    const boost::filesystem::path readWrite_;
+
+    std::vector<std::string> paths_;
+    std::vector<std::string> rwPaths_;
+    std::vector<std::string> dirs_;
+};
+
+struct Result
+{
+    std::string case_;
+    unsigned threads_ = 0;
+    uint64_t ops_ = 0;
+    uint64_t errors_ = 0;
+    double seconds_ = 0;
+    Stats::Summary latency_;
+};
+
+// Runs 'op' on 'threads' threads, each for 'opsPerThread' iterations, timing every call.
+// 'op' gets the thread index and the iteration and returns the FUSE style result.
+// 'finish' runs on the calling thread after all workers are done and is included in the total time.
+inline Result run(const std::string& name,
+                  unsigned threads,
+                  std::size_t opsPerThread,
+                  const std::function<int(unsigned, std::size_t)>& op,
+                  const std::function<void()>& finish = std::function<void()>())
+{
+    std::vector<std::unique_ptr<Histogram>> histograms;
+    std::vector<uint64_t> errors(threads);
+    // the histogram only knows the bucket of the slowest op
+    std::vector<uint64_t> maxima(threads);
+    for (unsigned t = 0; t < threads; ++t)
+        histograms.emplace_back(new Histogram());
+
+    const auto start = monotonicNanoseconds();
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t)
+    {
+        workers.emplace_back([&, t](){
+            for (std::size_t i = 0; i < opsPerThread; ++i)
+            {
+                const auto begin = monotonicNanoseconds();
+                if (op(t, i) < 0)
+                    ++errors[t];
+                const auto elapsed = monotonicNanoseconds() - begin;
+                histograms[t]->add(elapsed);
+                maxima[t] = std::max(maxima[t], elapsed);
+            }
+        });
+    }
+
+    for (auto& w : workers)
+        w.join();
+
+    if (finish)
+        finish();
+
+    Result result;
+    result.case_ = name;
+    result.threads_ = threads;
+    result.ops_ = threads * opsPerThread;
+    result.seconds_ = (monotonicNanoseconds() - start) / 1e9;
+
+    for (unsigned t = 0; t < threads; ++t)
+    {
+        histograms[t]->merge(result.latency_.buckets_);
+        result.errors_ += errors[t];
+        result.latency_.max_ = std::max(result.latency_.max_, maxima[t]);
+    }
+
+    for (std::size_t i = 0; i < result.latency_.buckets_.size(); ++i)
+    {
+        const auto count = result.latency_.buckets_[i];
+        if (!count)
+            continue;
+        result.latency_.count_ += count;
+        result.latency_.sum_ += count * Histogram::value(i);
+    }
+
+    return result;
+}
+
+// one JSON object per line, so results can be appended to a history file and diffed
+inline std::string json(const Result& r)
+{
+    char buffer[512];
+    snprintf(buffer, sizeof(buffer),
+             "{\"case\":\"%s\",\"threads\":%u,\"ops\":%llu,\"errors\":%llu,\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+             "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}",
+             r.case_.c_str(), r.threads_,
+             static_cast<unsigned long long>(r.ops_),
+             static_cast<unsigned long long>(r.errors_),
+             r.seconds_,
+             r.seconds_ > 0 ? r.ops_ / r.seconds_ : 0.0,
+             static_cast<unsigned long long>(r.latency_.percentile(50)),
+             static_cast<unsigned long long>(r.latency_.percentile(99)),
+             static_cast<unsigned long long>(r.latency_.percentile(99.9)),
+             static_cast<unsigned long long>(r.latency_.max_));
+    return buffer;
+}
+
+inline void report(std::ostream& human, std::ostream& machine, const Result& r)
+{
+    machine << json(r) << std::endl;
+
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "%-28s threads %2u  %10.0f ops/s  p50 %8.1f us  p99 %8.1f us%s",
+             r.case_.c_str(), r.threads_,
+             r.seconds_ > 0 ? r.ops_ / r.seconds_ : 0.0,
+             r.latency_.percentile(50) / 1000.0,
+             r.latency_.percentile(99) / 1000.0,
+             r.errors_ ? "  (errors)" : "");
+    human << buffer << std::endl;
+}
+
+} // namespace bench
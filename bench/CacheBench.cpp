@@ -0,0 +1,373 @@
+#include "Bench.h"
+
+#include <fstream>
+#include <sstream>
+
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/classification.hpp>
+
+using namespace bench;
+
+namespace
+{
+
+int filler(void*, const char*, const struct stat*, off_t, enum fuse_fill_dir_flags)
+{
+    return 0;
+}
+
+int openRead(Cache& cache, const std::string& path, std::vector<char>& buffer)
+{
+    fuse_file_info fi = {};
+    fi.flags = O_RDONLY;
+    int res = cache.open(path.c_str(), &fi);
+    if (res)
+        return res;
+
+    off_t offset = 0;
+    while ((res = cache.read(path.c_str(), buffer.data(), buffer.size(), offset, &fi)) > 0)
+        offset += res;
+
+    cache.release(path.c_str(), &fi);
+    return res;
+}
+
+// slice of the file list owned by a thread, so cold cases never touch the same file twice;
+// at most 'iterations_' files, like the warm cases
+std::size_t slice(const Fixture& fixture, const Config& config, unsigned threads)
+{
+    return std::min(fixture.paths().size() / threads, config.iterations_);
+}
+
+Result getattrHit(Fixture& fixture, const Config& config, unsigned threads)
+{
+    const auto cache = fixture.mount();
+    struct stat st;
+    for (const auto& p : fixture.paths())
+        cache->getattr(p.c_str(), &st, nullptr);
+
+    const auto& paths = fixture.paths();
+    return run("getattr_hit", threads, config.iterations_, [&](unsigned t, std::size_t i){
+        struct stat st;
+        return cache->getattr(paths[(i + t * 7919) % paths.size()].c_str(), &st, nullptr);
+    });
+}
+
+Result getattrMiss(Fixture& fixture, const Config& config, unsigned threads)
+{
+    const auto cache = fixture.mount();
+    const auto& paths = fixture.paths();
+    const auto count = slice(fixture, config, threads);
+    return run("getattr_miss", threads, count, [&](unsigned t, std::size_t i){
+        struct stat st;
+        return cache->getattr(paths[t * count + i].c_str(), &st, nullptr);
+    });
+}
+
+Result list(Fixture& fixture, const Config& config, unsigned threads)
+{
+    const auto cache = fixture.mount();
+    for (const auto& d : fixture.dirs())
+        cache->list(d.c_str(), nullptr, filler, 0, nullptr, fuse_readdir_flags());
+
+    const auto& dirs = fixture.dirs();
+    return run("list", threads, config.iterations_, [&](unsigned t, std::size_t i){
+        return cache->list(dirs[(i + t) % dirs.size()].c_str(), nullptr, filler, 0, nullptr, fuse_readdir_flags());
+    });
+}
+
+Result openReadCold(Fixture& fixture, const Config& config, unsigned threads)
+{
+    const auto cache = fixture.mount();
+    const auto& paths = fixture.paths();
+    const auto count = slice(fixture, config, threads);
+    std::vector<std::vector<char>> buffers(threads, std::vector<char>(128 * 1024));
+    return run("open_read_cold", threads, count, [&](unsigned t, std::size_t i){
+        return openRead(*cache, paths[t * count + i], buffers[t]);
+    });
+}
+
+Result openReadWarm(Fixture& fixture, const Config& config, unsigned threads)
+{
+    const auto cache = fixture.mount();
+    const auto& paths = fixture.paths();
+    std::vector<std::vector<char>> buffers(threads, std::vector<char>(128 * 1024));
+    for (const auto& p : paths)
+        openRead(*cache, p, buffers.front());
+
+    return run("open_read_warm", threads, std::min(config.iterations_, paths.size()), [&](unsigned t, std::size_t i){
+        return openRead(*cache, paths[(i + t * 7919) % paths.size()], buffers[t]);
+    });
+}
+
+// read-write subtree, materialized before the measurement
+Result readWriteGetattr(Fixture& fixture, const Config& config, unsigned threads)
+{
+    const auto cache = fixture.mount();
+    const auto& paths = fixture.rwPaths();
+    struct stat st;
+    for (const auto& p : paths)
+        cache->getattr(p.c_str(), &st, nullptr);
+
+    return run("rw_getattr", threads, config.iterations_, [&](unsigned t, std::size_t i){
+        struct stat st;
+        return cache->getattr(paths[(i + t * 7919) % paths.size()].c_str(), &st, nullptr);
+    });
+}
+
+Result readWriteRead(Fixture& fixture, const Config& config, unsigned threads)
+{
+    const auto cache = fixture.mount();
+    const auto& paths = fixture.rwPaths();
+    std::vector<std::vector<char>> buffers(threads, std::vector<char>(128 * 1024));
+    for (const auto& p : paths)
+        openRead(*cache, p, buffers.front());
+
+    return run("rw_read", threads, std::min(config.iterations_, paths.size()), [&](unsigned t, std::size_t i){
+        return openRead(*cache, paths[(i + t * 7919) % paths.size()], buffers[t]);
+    });
+}
+
+// copy of the whole read-write subtree on first access, 'threads' is the number of copy threads
+Result readWritePreload(Fixture& fixture, const Config& config, unsigned threads)
+{
+    Options options = config.options_;
+    options.readWritePreload_ = true;
+    options.copyThreads_ = threads;
+
+    const auto cache = fixture.mount(options);
+    const auto& paths = fixture.rwPaths();
+    auto result = run("rw_preload", 1, 1, [&](unsigned, std::size_t){
+        struct stat st;
+        return cache->getattr(paths.front().c_str(), &st, nullptr);
+    });
+    result.threads_ = threads;
+    return result;
+}
+
+Result writeReleaseSync(Fixture& fixture, const Config& config, unsigned threads)
+{
+    const auto cache = fixture.mount();
+    const auto& paths = fixture.rwPaths();
+    const auto count = slice(fixture, config, threads);
+    const std::vector<char> data(4096, 'y');
+
+    // materializes the read-write tree outside of the measurement
+    struct stat st;
+    cache->getattr(paths.front().c_str(), &st, nullptr);
+
+    return run("write_release_sync", threads, count, [&](unsigned t, std::size_t i){
+        const auto& path = paths[t * count + i];
+        fuse_file_info fi = {};
+        fi.flags = O_WRONLY;
+        int res = cache->open(path.c_str(), &fi);
+        if (res)
+            return res;
+
+        res = cache->write(path.c_str(), data.data(), data.size(), 0, &fi);
+        cache->release(path.c_str(), &fi);
+        return res;
+    }, [&](){
+        cache->flush();
+    });
+}
+
+// the way editors save, as the background sync sees it: a temp file written and renamed over
+// the target, which still has unpushed changes (a failed push keeps them); nothing is pushed,
+// so every byte and file counted against the dirty budget has to be returned once the files
+// are removed, anything left counts as an error
+Result syncRenameOver(Fixture& fixture, const Config& config, unsigned threads)
+{
+    BackgroundSync sync(std::make_shared<LocalSource>(fixture.source()), fixture.cache(), 1, nullptr, DirtyBudget::Limit());
+    const auto& paths = fixture.rwPaths();
+    const auto count = slice(fixture, config, threads);
+
+    auto result = run("sync_rename_over", threads, count, [&](unsigned t, std::size_t i){
+        const auto& path = paths[t * count + i];
+        const auto temp = path + ".tmp";
+        sync.write(path.c_str(), 0, 4096);
+        sync.write(temp.c_str(), 0, 4096);
+        sync.renamed(temp.c_str(), path.c_str());
+        return 0;
+    }, [&](){
+        for (std::size_t i = 0; i < threads * count; ++i)
+            sync.forget(paths[i].c_str());
+    });
+
+    Stats::Snapshot s;
+    sync.budget().collect(s);
+    for (const auto& g : s.gauges_)
+    {
+        if ((g.first == "dirty_bytes" || g.first == "dirty_files") && g.second)
+        {
+            std::cerr << "sync_rename_over: " << g.first << " is " << g.second << " after the files are gone" << std::endl;
+            ++result.errors_;
+        }
+    }
+    return result;
+}
+
+// writes into files held open by every thread, the dirty tracking on the write path
+Result readWriteWrite(Fixture& fixture, const Config& config, unsigned threads)
+{
+    const auto cache = fixture.mount();
+    const auto& paths = fixture.rwPaths();
+    const std::vector<char> data(4096, 'z');
+
+    struct stat st;
+    cache->getattr(paths.front().c_str(), &st, nullptr);
+
+    std::vector<fuse_file_info> files(threads);
+    for (unsigned t = 0; t < threads; ++t)
+    {
+        files[t].flags = O_WRONLY;
+        if (cache->open(paths[t % paths.size()].c_str(), &files[t]))
+            throw std::runtime_error("failed to open " + paths[t % paths.size()]);
+    }
+
+    auto result = run("rw_write", threads, config.iterations_, [&](unsigned t, std::size_t i){
+        const auto offset = static_cast<off_t>((i % 256) * data.size());
+        const int res = cache->write(paths[t % paths.size()].c_str(), data.data(), data.size(), offset, &files[t]);
+        return res < 0 ? res : 0;
+    });
+
+    for (unsigned t = 0; t < threads; ++t)
+        cache->release(paths[t % paths.size()].c_str(), &files[t]);
+    cache->flush();
+    return result;
+}
+
+// cold fills through the io_uring engine keeping 'depth' blocks in flight, 0 is the blocking copy;
+// depths only make a difference with large files, e.g. --files=64 --file-size=67108864
+std::function<Result(Fixture&, const Config&, unsigned)> fill(uint32_t depth)
+{
+    return [depth](Fixture& fixture, const Config& config, unsigned threads){
+        Options options = config.options_;
+        options.io_.depth_ = depth;
+
+        const auto cache = fixture.mount(options);
+        const auto& paths = fixture.paths();
+        const auto count = slice(fixture, config, threads);
+        return run("fill_qd" + std::to_string(depth), threads, count, [&](unsigned t, std::size_t i){
+            fuse_file_info fi = {};
+            fi.flags = O_RDONLY;
+            const int res = cache->open(paths[t * count + i].c_str(), &fi);
+            if (!res)
+                cache->release(paths[t * count + i].c_str(), &fi);
+            return res;
+        });
+    };
+}
+
+struct Case
+{
+    const char* name_;
+    std::function<Result(Fixture&, const Config&, unsigned)> run_;
+};
+
+const Case CASES[] = {
+    { "getattr_hit", getattrHit },
+    { "getattr_miss", getattrMiss },
+    { "list", list },
+    { "open_read_cold", openReadCold },
+    { "open_read_warm", openReadWarm },
+    { "rw_getattr", readWriteGetattr },
+    { "rw_read", readWriteRead },
+    { "rw_preload", readWritePreload },
+    { "write_release_sync", writeReleaseSync },
+    { "rw_write", readWriteWrite },
+    { "sync_rename_over", syncRenameOver },
+    { "fill_qd0", fill(0) },
+    { "fill_qd1", fill(1) },
+    { "fill_qd4", fill(4) },
+    { "fill_qd16", fill(16) },
+    { "fill_qd64", fill(64) },
+};
+
+void usage()
+{
+    std::cerr << "usage: cachefs_bench [--threads=1,2,4,8] [--files=N] [--file-size=BYTES] [--iterations=N] [--filter=SUBSTR] [--out=FILE] [cachefs options]" << std::endl;
+    std::cerr << "cases:";
+    for (const auto& c : CASES)
+        std::cerr << " " << c.name_;
+    std::cerr << std::endl;
+    Options().usage(std::cerr);
+}
+
+bool parse(int argc, char* argv[], Config& config)
+{
+    if (!config.options_.parse(argc, argv))
+        return false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        const auto eq = arg.find('=');
+        if (eq == std::string::npos)
+            return false;
+
+        const auto name = arg.substr(0, eq);
+        const auto value = arg.substr(eq + 1);
+        if (name == "--threads")
+        {
+            std::vector<std::string> items;
+            boost::algorithm::split(items, value, boost::algorithm::is_any_of(","));
+            config.threads_.clear();
+            for (const auto& item : items)
+                config.threads_.push_back(std::stoul(item));
+        }
+        else if (name == "--files")
+            config.files_ = std::stoul(value);
+        else if (name == "--file-size")
+            config.fileSize_ = std::stoul(value);
+        else if (name == "--iterations")
+            config.iterations_ = std::stoul(value);
+        else if (name == "--filter")
+            config.filter_ = value;
+        else if (name == "--out")
+            config.out_ = value;
+        else
+            return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    Config config;
+    try
+    {
+        if (!parse(argc, argv, config))
+        {
+            usage();
+            return 1;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        usage();
+        return 1;
+    }
+
+    Logger::setLevel(Logger::Warning);
+    Logger::start();
+
+    std::ofstream file;
+    if (!config.out_.empty())
+        file.open(config.out_, std::ios::app);
+    std::ostream& machine = config.out_.empty() ? std::cout : file;
+
+    Fixture fixture(config);
+    for (const auto& c : CASES)
+    {
+        if (!config.filter_.empty() && std::string(c.name_).find(config.filter_) == std::string::npos)
+            continue;
+
+        for (const auto threads : config.threads_)
+            report(std::cerr, machine, c.run_(fixture, config, threads));
+    }
+
+    return 0;
+}
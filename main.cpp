@@ -70,6 +70,9 @@ static void *xmp_init(fuse_conn_info *conn,
     cfg->attr_timeout = 0;
     cfg->negative_timeout = 0;
 
+    Logger::start();
+    cache_->start();
+    cache_->mounted(fuse_get_context()->fuse);
     return NULL;
 }
 
@@ -208,40 +211,14 @@ static int xmp_release(const char *path, struct fuse_file_info *fi)
 static int xmp_fsync(const char *path, int isdatasync,
                      struct fuse_file_info *fi)
 {
-    /* Just a stub.	 This method is optional and can safely be left
-       unimplemented */
-
-    (void) path;
-    (void) isdatasync;
-    (void) fi;
-    return 0;
+    return cache_->fsync(path, isdatasync, fi);
 }
 
 #ifdef HAVE_POSIX_FALLOCATE
 static int xmp_fallocate(const char *path, int mode,
 			off_t offset, off_t length, struct fuse_file_info *fi)
 {
-	int fd;
-	int res;
-
-	(void) fi;
-
-	if (mode)
-		return -EOPNOTSUPP;
-
-	if(fi == NULL)
-		fd = open(path, O_WRONLY);
-	else
-		fd = fi->fh;
-
-	if (fd == -1)
-		return -errno;
-
-	res = -posix_fallocate(fd, offset, length);
-
-	if(fi == NULL)
-		close(fd);
-	return res;
+	return cache_->fallocate(path, mode, offset, length, fi);
 }
 #endif
 
@@ -323,10 +300,21 @@ int main(int argc, char *argv[])
 
     umask(0);
 
-    if (argc < 5)
+    Options options;
+    if (!options.parse(argc, argv))
+        return 1;
+
+    Logger::setLevel(options.logLevel_);
+    Logger::setRateLimit(options.logRate_);
+
+    // with a policy file the read-write subtrees are declared there
+    const int dirs = options.policies_.empty() ? 3 : 2;
+    if (argc < dirs + 2)
     {
         std::cerr << "not enough mount points specified, " << std::endl;
         std::cerr << "usage: ./cachefs [options] <mountpoint> <source> <cache> <read-write-subdir>" << std::endl;
+        std::cerr << "       ./cachefs [options] --policy=<file> <mountpoint> <source> <cache>" << std::endl;
+        options.usage(std::cerr);
 
         for (int i = 0; i < argc; ++i)
         {
@@ -335,9 +323,9 @@ int main(int argc, char *argv[])
         }
     }
 
-    std::string src = argv[argc - 3];
-    std::string cache = argv[argc - 2];
-    std::string readWriteSubdir = argv[argc - 1];
+    std::string src = argv[argc - dirs];
+    std::string cache = argv[argc - dirs + 1];
+    std::string readWriteSubdir = dirs == 3 ? argv[argc - 1] : "";
 
     boost::algorithm::trim_right_if(src, boost::algorithm::is_any_of(" /"));
     boost::algorithm::trim_right_if(cache, boost::algorithm::is_any_of(" /"));
@@ -345,18 +333,29 @@ int main(int argc, char *argv[])
 
     std::cout << "source dir: '" << src << "'" << std::endl;
     std::cout << "cache dir:  '" << cache << "'" << std::endl;
-    std::cout << "read-write: '" << readWriteSubdir << "'" << std::endl;
+    if (!readWriteSubdir.empty())
+        std::cout << "read-write: '" << readWriteSubdir << "'" << std::endl;
 
-    if (readWriteSubdir.size() < src.size() || readWriteSubdir.find(src) != 0)
+    if (!readWriteSubdir.empty() && (readWriteSubdir.size() < src.size() || readWriteSubdir.find(src) != 0))
     {
         std::cerr << "read-write subdir must subdirectory of source dir" << std::endl;
         return 1;
     }
 
-    argc -= 3;
+    argc -= dirs;
+
+    try
+    {
+        cache_ = std::make_unique<Cache>(src, cache, readWriteSubdir, options);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "failed to start: " << e.what() << std::endl;
+        return 1;
+    }
 
-    cache_ = std::make_unique<Cache>(src, cache, readWriteSubdir);
     const auto res = fuse_main(argc, argv, &xmp_oper, NULL);
     cache_.reset();
+    Logger::flush();
     return res;
 }
\ No newline at end of file